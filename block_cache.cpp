@@ -0,0 +1,275 @@
+#include "block_cache.h"
+
+#include <algorithm>
+
+namespace nx_spl
+{
+    namespace
+    {
+        // Share of the budget given to the admission window and to the protected segment
+        const int kWindowPercent = 1;
+        const int kProtectedPercent = 80;
+        // Expected block size, used only to size the frequency sketch
+        const uint64_t kTypicalBlockSize = 1024 * 1024;
+        const int kSketchDepth = 4;
+        const uint8_t kMaxFrequency = 15;
+
+        size_t mix(size_t hash, int row)
+        {
+            uint64_t h = (uint64_t) hash + 0x9E3779B97F4A7C15ULL * (uint64_t)(row + 1);
+            h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+            return (size_t)(h ^ (h >> 31));
+        }
+    }
+
+
+    void BlockCache::FrequencySketch::resize(size_t expectedEntries)
+    {
+        size_t width = 64;
+        while (width < expectedEntries)
+            width <<= 1;
+
+        m_table.assign(width * kSketchDepth, 0);
+        m_mask = width - 1;
+        m_additions = 0;
+        m_sampleSize = width * 10;
+    }
+
+
+    size_t BlockCache::FrequencySketch::index(size_t hash, int row) const
+    {
+        return (size_t) row * (m_mask + 1) + (mix(hash, row) & m_mask);
+    }
+
+
+    void BlockCache::FrequencySketch::increment(size_t hash)
+    {
+        if (m_table.empty())
+            return;
+
+        for (int row = 0; row < kSketchDepth; row++)
+        {
+            uint8_t& counter = m_table[index(hash, row)];
+            if (counter < kMaxFrequency)
+                counter++;
+        }
+
+        // Aging: halve everything so that old popularity fades out
+        if (++m_additions >= m_sampleSize)
+        {
+            for (auto& counter : m_table)
+                counter >>= 1;
+            m_additions /= 2;
+        }
+    }
+
+
+    int BlockCache::FrequencySketch::frequency(size_t hash) const
+    {
+        if (m_table.empty())
+            return 0;
+
+        int result = kMaxFrequency;
+        for (int row = 0; row < kSketchDepth; row++)
+            result = std::min<int>(result, m_table[index(hash, row)]);
+        return result;
+    }
+
+
+    BlockCache& BlockCache::instance()
+    {
+        static BlockCache cache;
+        return cache;
+    }
+
+
+    std::string BlockCache::makeKey(
+        const std::string   &bucket,
+        const std::string   &key,
+        const std::string   &etag,
+        uint64_t            block)
+    {
+        std::string result;
+        result.reserve(bucket.size() + key.size() + etag.size() + 24);
+        result.append(bucket).push_back('\0');
+        result.append(key).push_back('\0');
+        result.append(etag).push_back('\0');
+        result.append(std::to_string(block));
+        return result;
+    }
+
+
+    BlockCache::BlockCache()
+        : m_capacity(0)
+    {
+        std::fill(m_bytes, m_bytes + SegmentCount, 0);
+        m_stats = Stats();
+    }
+
+
+    void BlockCache::setCapacity(uint64_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (bytes == m_capacity)
+            return;
+
+        m_capacity = bytes;
+        m_sketch.resize((size_t)(bytes / kTypicalBlockSize));
+        balance();
+    }
+
+
+    uint64_t BlockCache::segmentCapacity(Segment segment) const
+    {
+        uint64_t window = std::max<uint64_t>(m_capacity * kWindowPercent / 100, 1);
+        uint64_t main = m_capacity - std::min(window, m_capacity);
+        switch (segment)
+        {
+            case Window:    return window;
+            case Protected: return main * kProtectedPercent / 100;
+            default:        return main;
+        }
+    }
+
+
+    BlockCache::BlockPtr BlockCache::get(const std::string& key)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_capacity == 0)
+            return BlockPtr();
+
+        m_sketch.increment(m_hash(key));
+
+        auto found = m_map.find(key);
+        if (found == m_map.end())
+        {
+            m_stats.misses++;
+            return BlockPtr();
+        }
+
+        m_stats.hits++;
+        auto it = found->second;
+        // A second hit promotes a probation block to the protected segment
+        moveTo(it, it->segment == Window ? Window : Protected);
+        balance();
+        return it->data;
+    }
+
+
+    bool BlockCache::contains(const std::string& key) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_map.count(key) != 0;
+    }
+
+
+    void BlockCache::put(const std::string& key, BlockPtr data)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_capacity == 0 || !data || data->size() > segmentCapacity(Probation))
+            return;
+
+        if (m_map.count(key) != 0)
+            return;
+
+        Entry entry;
+        entry.key = key;
+        entry.data = data;
+        entry.segment = Window;
+        m_lists[Window].push_front(entry);
+        m_bytes[Window] += data->size();
+        m_map[key] = m_lists[Window].begin();
+        balance();
+    }
+
+
+    BlockCache::Stats BlockCache::stats() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Stats result = m_stats;
+        result.bytes = m_bytes[Window] + m_bytes[Probation] + m_bytes[Protected];
+        result.capacity = m_capacity;
+        return result;
+    }
+
+
+    void BlockCache::moveTo(EntryList::iterator it, Segment segment)
+    {
+        uint64_t size = it->data->size();
+        m_bytes[it->segment] -= size;
+        m_lists[segment].splice(m_lists[segment].begin(), m_lists[it->segment], it);
+        it->segment = segment;
+        m_bytes[segment] += size;
+    }
+
+
+    void BlockCache::evict(EntryList::iterator it)
+    {
+        m_bytes[it->segment] -= it->data->size();
+        m_map.erase(it->key);
+        m_lists[it->segment].erase(it);
+    }
+
+
+    void BlockCache::balance()
+    {
+        if (m_capacity == 0)
+        {
+            m_map.clear();
+            for (int i = 0; i < SegmentCount; i++)
+            {
+                m_lists[i].clear();
+                m_bytes[i] = 0;
+            }
+            return;
+        }
+
+        // Protected overflow is demoted, not dropped
+        while (m_bytes[Protected] > segmentCapacity(Protected))
+            moveTo(std::prev(m_lists[Protected].end()), Probation);
+
+        // Capacity may have shrunk, trim the main area from its cold end
+        uint64_t main_capacity = segmentCapacity(Probation);
+        while (m_bytes[Probation] + m_bytes[Protected] > main_capacity)
+        {
+            Segment segment = m_lists[Probation].empty() ? Protected : Probation;
+            evict(std::prev(m_lists[segment].end()));
+            m_stats.evictions++;
+        }
+
+        while (m_bytes[Window] > segmentCapacity(Window))
+        {
+            auto candidate = std::prev(m_lists[Window].end());
+            uint64_t size = candidate->data->size();
+            int candidate_freq = m_sketch.frequency(m_hash(candidate->key));
+
+            // Admission: the candidate has to be more popular than every victim it displaces
+            bool admit = true;
+            while (admit && m_bytes[Probation] + m_bytes[Protected] + size > main_capacity)
+            {
+                Segment segment = m_lists[Probation].empty() ? Protected : Probation;
+                auto victim = std::prev(m_lists[segment].end());
+                if (candidate_freq > m_sketch.frequency(m_hash(victim->key)))
+                {
+                    evict(victim);
+                    m_stats.evictions++;
+                }
+                else
+                {
+                    admit = false;
+                }
+            }
+
+            if (admit)
+            {
+                moveTo(candidate, Probation);
+            }
+            else
+            {
+                evict(candidate);
+                m_stats.rejections++;
+            }
+        }
+    }
+} // namespace nx_spl
@@ -0,0 +1,102 @@
+#ifndef __S3_BLOCK_CACHE_H__
+#define __S3_BLOCK_CACHE_H__
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace nx_spl
+{
+    // Process-wide cache of object blocks shared by all S3IODevice instances.
+    // Keys carry the ETag, so an overwritten object never hits stale blocks.
+    //
+    // Eviction is W-TinyLFU: new blocks land in a small LRU window, blocks
+    // leaving the window are admitted to the segmented LRU main area only if
+    // they are used more often than the main area's victim. A one-off scan
+    // (export, archive rebuild) therefore can't flush the hot playback set.
+    class BlockCache
+    {
+    public:
+        typedef std::shared_ptr<const std::vector<char>> BlockPtr;
+
+        struct Stats
+        {
+            uint64_t hits;
+            uint64_t misses;
+            uint64_t evictions;
+            uint64_t rejections;    // blocks not admitted past the window
+            uint64_t bytes;
+            uint64_t capacity;
+        };
+
+        static BlockCache& instance();
+        static std::string makeKey(
+            const std::string   &bucket,
+            const std::string   &key,
+            const std::string   &etag,
+            uint64_t            block
+        );
+
+        // 0 disables the cache and drops everything
+        void setCapacity(uint64_t bytes);
+
+        BlockPtr get(const std::string& key);
+        // like get() but doesn't count as an access
+        bool contains(const std::string& key) const;
+        void put(const std::string& key, BlockPtr data);
+
+        Stats stats() const;
+
+    private:
+        BlockCache();
+
+        enum Segment { Window, Probation, Protected, SegmentCount };
+
+        struct Entry
+        {
+            std::string key;
+            BlockPtr    data;
+            Segment     segment;
+        };
+        typedef std::list<Entry> EntryList;
+
+        // Count-min sketch of access frequency with periodic aging
+        class FrequencySketch
+        {
+        public:
+            void resize(size_t expectedEntries);
+            void increment(size_t hash);
+            int frequency(size_t hash) const;
+
+        private:
+            size_t index(size_t hash, int row) const;
+
+        private:
+            std::vector<uint8_t>    m_table;
+            size_t                  m_mask = 0;
+            size_t                  m_additions = 0;
+            size_t                  m_sampleSize = 0;
+        };
+
+        void moveTo(EntryList::iterator it, Segment segment);
+        void evict(EntryList::iterator it);
+        void balance();
+        uint64_t segmentCapacity(Segment segment) const;
+
+    private:
+        mutable std::mutex  m_mutex;
+        uint64_t            m_capacity;
+        EntryList           m_lists[SegmentCount];  // front is most recently used
+        uint64_t            m_bytes[SegmentCount];
+        std::unordered_map<std::string, EntryList::iterator> m_map;
+        FrequencySketch     m_sketch;
+        std::hash<std::string> m_hash;
+        Stats               m_stats;
+    }; // class BlockCache
+} // namespace nx_spl
+
+#endif // __S3_BLOCK_CACHE_H__
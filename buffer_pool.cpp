@@ -0,0 +1,92 @@
+#include "buffer_pool.h"
+
+#include <cstdlib>
+
+namespace nx_spl
+{
+    namespace aux
+    {
+        namespace
+        {
+            const size_t kAlign = 4096;
+            // Idle buffers beyond this go back to the heap
+            const uint64_t kMaxPooled = 64 * 1024 * 1024;
+
+            size_t sizeClass(size_t size)
+            {
+                size_t cls = 0;
+                for (size_t cap = BufferPool::kMinSize; cap < size; cap <<= 1)
+                    cls++;
+                return cls;
+            }
+        }
+
+        const size_t BufferPool::kMinSize;
+        const size_t BufferPool::kMaxSize;
+
+        BufferPool& BufferPool::instance()
+        {
+            static BufferPool pool;
+            return pool;
+        }
+
+        BufferPool::BufferPool()
+            : m_free(sizeClass(kMaxSize) + 1),
+              m_pooled(0)
+        {}
+
+        BufferPool::~BufferPool()
+        {
+            for (auto& list : m_free)
+                for (char* data : list)
+                    free(data);
+        }
+
+        BufferPool::Buffer BufferPool::acquire(size_t size)
+        {
+            Buffer buffer;
+            if (size > kMaxSize)
+                return buffer;
+
+            size_t cls = sizeClass(size);
+            buffer.capacity = kMinSize << cls;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (!m_free[cls].empty())
+                {
+                    buffer.data = m_free[cls].back();
+                    m_free[cls].pop_back();
+                    m_pooled -= buffer.capacity;
+                    return buffer;
+                }
+            }
+
+            if (posix_memalign((void**) &buffer.data, kAlign, buffer.capacity) != 0)
+                buffer = Buffer();
+            return buffer;
+        }
+
+        void BufferPool::release(Buffer buffer)
+        {
+            if (!buffer.data)
+                return;
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (m_pooled + buffer.capacity <= kMaxPooled)
+                {
+                    m_free[sizeClass(buffer.capacity)].push_back(buffer.data);
+                    m_pooled += buffer.capacity;
+                    return;
+                }
+            }
+            free(buffer.data);
+        }
+
+        uint64_t BufferPool::pooledBytes() const
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_pooled;
+        }
+    } // namespace aux
+} // namespace nx_spl
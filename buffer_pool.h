@@ -0,0 +1,53 @@
+#ifndef __S3_BUFFER_POOL_H__
+#define __S3_BUFFER_POOL_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace nx_spl
+{
+    namespace aux
+    {
+        // Size-classed slab of page aligned buffers for objects staged in RAM.
+        // Classes are powers of two from 4 KB to 16 MB, released buffers are kept
+        // on per-class free lists until the pooled bytes reach a cap.
+        class BufferPool
+        {
+        public:
+            struct Buffer
+            {
+                Buffer() : data(nullptr), capacity(0) {}
+
+                char*   data;
+                size_t  capacity;
+            };
+
+            static const size_t kMinSize = 4 * 1024;
+            static const size_t kMaxSize = 16 * 1024 * 1024;
+
+            static BufferPool& instance();
+
+            // Smallest class holding size bytes, data is null if size exceeds kMaxSize
+            Buffer acquire(size_t size);
+            void release(Buffer buffer);
+
+            uint64_t pooledBytes() const;
+
+        private:
+            BufferPool();
+            ~BufferPool();
+
+            BufferPool(const BufferPool&) = delete;
+            BufferPool& operator =(const BufferPool&) = delete;
+
+        private:
+            mutable std::mutex                  m_mutex;
+            std::vector<std::vector<char*>>     m_free;     // by class
+            uint64_t                            m_pooled;
+        }; // class BufferPool
+    } // namespace aux
+} // namespace nx_spl
+
+#endif // __S3_BUFFER_POOL_H__
@@ -0,0 +1,566 @@
+#include "checksum.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define S3_CRC32C_SSE42
+#endif
+
+namespace nx_spl
+{
+    namespace aux
+    {
+        namespace
+        {
+            inline uint32_t rotl(uint32_t x, int c)
+            {
+                return (x << c) | (x >> (32 - c));
+            }
+
+            const uint32_t kCrc32cPoly = 0x82f63b78;
+
+            // Slicing-by-8 tables for CPUs without the instruction
+            struct Crc32cTables
+            {
+                Crc32cTables()
+                {
+                    for (uint32_t i = 0; i < 256; i++)
+                    {
+                        uint32_t crc = i;
+                        for (int k = 0; k < 8; k++)
+                            crc = (crc >> 1) ^ (kCrc32cPoly & (0u - (crc & 1)));
+                        table[0][i] = crc;
+                    }
+                    for (uint32_t i = 0; i < 256; i++)
+                        for (int t = 1; t < 8; t++)
+                            table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xff];
+                }
+
+                uint32_t table[8][256];
+            };
+
+            const Crc32cTables& crcTables()
+            {
+                static const Crc32cTables tables;
+                return tables;
+            }
+
+            uint32_t crc32cSoft(uint32_t crc, const uint8_t* p, size_t size)
+            {
+                const uint32_t (*t)[256] = crcTables().table;
+
+                while (size && ((uintptr_t) p & 7))
+                {
+                    crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+                    size--;
+                }
+
+                while (size >= 8)
+                {
+                    uint32_t lo, hi;
+                    memcpy(&lo, p, 4);
+                    memcpy(&hi, p + 4, 4);
+                    lo ^= crc;
+                    crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24]
+                        ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+                    p += 8;
+                    size -= 8;
+                }
+
+                while (size--)
+                    crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+                return crc;
+            }
+
+#ifdef S3_CRC32C_SSE42
+            __attribute__((target("sse4.2")))
+            uint32_t crc32cHard(uint32_t crc, const uint8_t* p, size_t size)
+            {
+                while (size && ((uintptr_t) p & 7))
+                {
+                    crc = _mm_crc32_u8(crc, *p++);
+                    size--;
+                }
+
+                uint64_t crc64 = crc;
+                while (size >= 8)
+                {
+                    uint64_t word;
+                    memcpy(&word, p, 8);
+                    crc64 = _mm_crc32_u64(crc64, word);
+                    p += 8;
+                    size -= 8;
+                }
+                crc = (uint32_t) crc64;
+
+                while (size--)
+                    crc = _mm_crc32_u8(crc, *p++);
+                return crc;
+            }
+
+            bool hasSse42()
+            {
+                static const bool has = __builtin_cpu_supports("sse4.2");
+                return has;
+            }
+#endif
+
+            // GF(2) matrix helpers for crc32cCombine, as in zlib
+            uint32_t gf2Times(const uint32_t* mat, uint32_t vec)
+            {
+                uint32_t sum = 0;
+                for (; vec; vec >>= 1, mat++)
+                    if (vec & 1)
+                        sum ^= *mat;
+                return sum;
+            }
+
+            void gf2Square(uint32_t* square, const uint32_t* mat)
+            {
+                for (int n = 0; n < 32; n++)
+                    square[n] = gf2Times(mat, mat[n]);
+            }
+
+            // Digests are recomputed from the final content in pieces of this size
+            const size_t kRehashChunk = 1024 * 1024;
+            // User metadata is limited to 2 KB per object, leave room for the rest
+            const size_t kMaxPartsValue = 1536;
+        }
+
+        Md5::Md5()
+            : m_bytes(0)
+        {
+            m_state[0] = 0x67452301;
+            m_state[1] = 0xefcdab89;
+            m_state[2] = 0x98badcfe;
+            m_state[3] = 0x10325476;
+        }
+
+        void Md5::transform(const uint8_t* block)
+        {
+            uint32_t m[16];
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            memcpy(m, block, sizeof(m));
+#else
+            for (int i = 0; i < 16; i++)
+                m[i] = (uint32_t) block[i * 4] | ((uint32_t) block[i * 4 + 1] << 8)
+                     | ((uint32_t) block[i * 4 + 2] << 16) | ((uint32_t) block[i * 4 + 3] << 24);
+#endif
+
+            uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+
+            // RFC 1321 round functions, each step is a += f(b, c, d) + m + k, a <<<= s, a += b
+#define S3_MD5_STEP(f, a, b, c, d, x, s, k) \
+            a += (f) + (x) + (k); \
+            a = rotl(a, s) + (b);
+#define S3_MD5_F(a, b, c, d, x, s, k) S3_MD5_STEP((d) ^ ((b) & ((c) ^ (d))), a, b, c, d, x, s, k)
+#define S3_MD5_G(a, b, c, d, x, s, k) S3_MD5_STEP((c) ^ ((d) & ((b) ^ (c))), a, b, c, d, x, s, k)
+#define S3_MD5_H(a, b, c, d, x, s, k) S3_MD5_STEP((b) ^ (c) ^ (d), a, b, c, d, x, s, k)
+#define S3_MD5_I(a, b, c, d, x, s, k) S3_MD5_STEP((c) ^ ((b) | ~(d)), a, b, c, d, x, s, k)
+
+            S3_MD5_F(a, b, c, d, m[0], 7, 0xd76aa478);
+            S3_MD5_F(d, a, b, c, m[1], 12, 0xe8c7b756);
+            S3_MD5_F(c, d, a, b, m[2], 17, 0x242070db);
+            S3_MD5_F(b, c, d, a, m[3], 22, 0xc1bdceee);
+            S3_MD5_F(a, b, c, d, m[4], 7, 0xf57c0faf);
+            S3_MD5_F(d, a, b, c, m[5], 12, 0x4787c62a);
+            S3_MD5_F(c, d, a, b, m[6], 17, 0xa8304613);
+            S3_MD5_F(b, c, d, a, m[7], 22, 0xfd469501);
+            S3_MD5_F(a, b, c, d, m[8], 7, 0x698098d8);
+            S3_MD5_F(d, a, b, c, m[9], 12, 0x8b44f7af);
+            S3_MD5_F(c, d, a, b, m[10], 17, 0xffff5bb1);
+            S3_MD5_F(b, c, d, a, m[11], 22, 0x895cd7be);
+            S3_MD5_F(a, b, c, d, m[12], 7, 0x6b901122);
+            S3_MD5_F(d, a, b, c, m[13], 12, 0xfd987193);
+            S3_MD5_F(c, d, a, b, m[14], 17, 0xa679438e);
+            S3_MD5_F(b, c, d, a, m[15], 22, 0x49b40821);
+
+            S3_MD5_G(a, b, c, d, m[1], 5, 0xf61e2562);
+            S3_MD5_G(d, a, b, c, m[6], 9, 0xc040b340);
+            S3_MD5_G(c, d, a, b, m[11], 14, 0x265e5a51);
+            S3_MD5_G(b, c, d, a, m[0], 20, 0xe9b6c7aa);
+            S3_MD5_G(a, b, c, d, m[5], 5, 0xd62f105d);
+            S3_MD5_G(d, a, b, c, m[10], 9, 0x02441453);
+            S3_MD5_G(c, d, a, b, m[15], 14, 0xd8a1e681);
+            S3_MD5_G(b, c, d, a, m[4], 20, 0xe7d3fbc8);
+            S3_MD5_G(a, b, c, d, m[9], 5, 0x21e1cde6);
+            S3_MD5_G(d, a, b, c, m[14], 9, 0xc33707d6);
+            S3_MD5_G(c, d, a, b, m[3], 14, 0xf4d50d87);
+            S3_MD5_G(b, c, d, a, m[8], 20, 0x455a14ed);
+            S3_MD5_G(a, b, c, d, m[13], 5, 0xa9e3e905);
+            S3_MD5_G(d, a, b, c, m[2], 9, 0xfcefa3f8);
+            S3_MD5_G(c, d, a, b, m[7], 14, 0x676f02d9);
+            S3_MD5_G(b, c, d, a, m[12], 20, 0x8d2a4c8a);
+
+            S3_MD5_H(a, b, c, d, m[5], 4, 0xfffa3942);
+            S3_MD5_H(d, a, b, c, m[8], 11, 0x8771f681);
+            S3_MD5_H(c, d, a, b, m[11], 16, 0x6d9d6122);
+            S3_MD5_H(b, c, d, a, m[14], 23, 0xfde5380c);
+            S3_MD5_H(a, b, c, d, m[1], 4, 0xa4beea44);
+            S3_MD5_H(d, a, b, c, m[4], 11, 0x4bdecfa9);
+            S3_MD5_H(c, d, a, b, m[7], 16, 0xf6bb4b60);
+            S3_MD5_H(b, c, d, a, m[10], 23, 0xbebfbc70);
+            S3_MD5_H(a, b, c, d, m[13], 4, 0x289b7ec6);
+            S3_MD5_H(d, a, b, c, m[0], 11, 0xeaa127fa);
+            S3_MD5_H(c, d, a, b, m[3], 16, 0xd4ef3085);
+            S3_MD5_H(b, c, d, a, m[6], 23, 0x04881d05);
+            S3_MD5_H(a, b, c, d, m[9], 4, 0xd9d4d039);
+            S3_MD5_H(d, a, b, c, m[12], 11, 0xe6db99e5);
+            S3_MD5_H(c, d, a, b, m[15], 16, 0x1fa27cf8);
+            S3_MD5_H(b, c, d, a, m[2], 23, 0xc4ac5665);
+
+            S3_MD5_I(a, b, c, d, m[0], 6, 0xf4292244);
+            S3_MD5_I(d, a, b, c, m[7], 10, 0x432aff97);
+            S3_MD5_I(c, d, a, b, m[14], 15, 0xab9423a7);
+            S3_MD5_I(b, c, d, a, m[5], 21, 0xfc93a039);
+            S3_MD5_I(a, b, c, d, m[12], 6, 0x655b59c3);
+            S3_MD5_I(d, a, b, c, m[3], 10, 0x8f0ccc92);
+            S3_MD5_I(c, d, a, b, m[10], 15, 0xffeff47d);
+            S3_MD5_I(b, c, d, a, m[1], 21, 0x85845dd1);
+            S3_MD5_I(a, b, c, d, m[8], 6, 0x6fa87e4f);
+            S3_MD5_I(d, a, b, c, m[15], 10, 0xfe2ce6e0);
+            S3_MD5_I(c, d, a, b, m[6], 15, 0xa3014314);
+            S3_MD5_I(b, c, d, a, m[13], 21, 0x4e0811a1);
+            S3_MD5_I(a, b, c, d, m[4], 6, 0xf7537e82);
+            S3_MD5_I(d, a, b, c, m[11], 10, 0xbd3af235);
+            S3_MD5_I(c, d, a, b, m[2], 15, 0x2ad7d2bb);
+            S3_MD5_I(b, c, d, a, m[9], 21, 0xeb86d391);
+
+#undef S3_MD5_I
+#undef S3_MD5_H
+#undef S3_MD5_G
+#undef S3_MD5_F
+#undef S3_MD5_STEP
+
+            m_state[0] += a;
+            m_state[1] += b;
+            m_state[2] += c;
+            m_state[3] += d;
+        }
+
+        void Md5::update(const void* data, size_t size)
+        {
+            const uint8_t* p = (const uint8_t*) data;
+            size_t used = m_bytes & 63;
+            m_bytes += size;
+
+            if (used)
+            {
+                size_t n = std::min(size, 64 - used);
+                memcpy(m_buffer + used, p, n);
+                p += n;
+                size -= n;
+                if (used + n < 64)
+                    return;
+                transform(m_buffer);
+            }
+
+            for (; size >= 64; p += 64, size -= 64)
+                transform(p);
+
+            memcpy(m_buffer, p, size);
+        }
+
+        Md5::Digest Md5::digest() const
+        {
+            Md5 copy(*this);
+            uint64_t bits = m_bytes * 8;
+
+            uint8_t pad[72] = { 0x80 };
+            size_t used = m_bytes & 63;
+            size_t padLen = (used < 56 ? 56 : 120) - used;
+            for (int i = 0; i < 8; i++)
+                pad[padLen + i] = (uint8_t)(bits >> (8 * i));
+            copy.update(pad, padLen + 8);
+
+            Digest digest;
+            for (int i = 0; i < 16; i++)
+                digest[i] = (uint8_t)(copy.m_state[i / 4] >> (8 * (i % 4)));
+            return digest;
+        }
+
+        std::string Md5::toHex(const Digest& digest)
+        {
+            static const char hex[] = "0123456789abcdef";
+            std::string result;
+            for (uint8_t byte : digest)
+            {
+                result += hex[byte >> 4];
+                result += hex[byte & 15];
+            }
+            return result;
+        }
+
+        std::string Md5::toBase64(const Digest& digest)
+        {
+            static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+            std::string result;
+            for (size_t i = 0; i < digest.size(); i += 3)
+            {
+                uint32_t n = (uint32_t) digest[i] << 16;
+                if (i + 1 < digest.size())
+                    n |= (uint32_t) digest[i + 1] << 8;
+                if (i + 2 < digest.size())
+                    n |= digest[i + 2];
+
+                result += alphabet[(n >> 18) & 63];
+                result += alphabet[(n >> 12) & 63];
+                result += i + 1 < digest.size() ? alphabet[(n >> 6) & 63] : '=';
+                result += i + 2 < digest.size() ? alphabet[n & 63] : '=';
+            }
+            return result;
+        }
+
+        uint32_t crc32c(uint32_t crc, const void* data, size_t size)
+        {
+            crc = ~crc;
+#ifdef S3_CRC32C_SSE42
+            if (hasSse42())
+                return ~crc32cHard(crc, (const uint8_t*) data, size);
+#endif
+            return ~crc32cSoft(crc, (const uint8_t*) data, size);
+        }
+
+        uint32_t crc32cCombine(uint32_t crcA, uint32_t crcB, uint64_t lengthB)
+        {
+            if (lengthB == 0)
+                return crcA;
+
+            uint32_t even[32], odd[32];
+
+            // Operator for one zero bit
+            odd[0] = kCrc32cPoly;
+            for (int n = 1; n < 32; n++)
+                odd[n] = 1u << (n - 1);
+
+            gf2Square(even, odd);   // two zero bits
+            gf2Square(odd, even);   // four zero bits
+
+            // Appends lengthB zero bytes to crcA
+            do
+            {
+                gf2Square(even, odd);
+                if (lengthB & 1)
+                    crcA = gf2Times(even, crcA);
+                lengthB >>= 1;
+                if (!lengthB)
+                    break;
+
+                gf2Square(odd, even);
+                if (lengthB & 1)
+                    crcA = gf2Times(odd, crcA);
+                lengthB >>= 1;
+            } while (lengthB);
+
+            return crcA ^ crcB;
+        }
+
+        std::string crc32cToHex(uint32_t crc)
+        {
+            char buf[9];
+            snprintf(buf, sizeof(buf), "%08x", crc);
+            return buf;
+        }
+
+        UploadDigest::UploadDigest(uint64_t segmentSize)
+            : m_segmentSize(segmentSize),
+              m_end(0),
+              m_wholeValid(true),
+              m_crc(0)
+        {}
+
+        UploadDigest::Segment& UploadDigest::segment(size_t index)
+        {
+            if (m_segments.size() <= index)
+                m_segments.resize(index + 1);
+            return m_segments[index];
+        }
+
+        void UploadDigest::update(uint64_t offset, const void* data, size_t size)
+        {
+            if (size == 0)
+                return;
+
+            if (offset != m_end)
+            {
+                // A patch or a hole: everything from there on to the end of the write is stale
+                m_wholeValid = false;
+                uint64_t from = std::min(offset, m_end);
+                for (uint64_t i = from / m_segmentSize; i <= (offset + size - 1) / m_segmentSize; i++)
+                    segment(i).valid = false;
+                m_end = std::max(m_end, offset + size);
+                return;
+            }
+
+            if (m_wholeValid)
+                m_whole.update(data, size);
+
+            const char* p = (const char*) data;
+            while (size > 0)
+            {
+                Segment& seg = segment(offset / m_segmentSize);
+                size_t n = (size_t) std::min<uint64_t>(size, m_segmentSize - offset % m_segmentSize);
+                if (seg.valid)
+                {
+                    seg.md5.update(p, n);
+                    seg.crc = aux::crc32c(seg.crc, p, n);
+                    seg.filled += n;
+                }
+
+                offset += n;
+                p += n;
+                size -= n;
+            }
+            m_end = offset;
+        }
+
+        bool UploadDigest::finalize(uint64_t size, const Reader& read, bool wholeMd5)
+        {
+            size_t count = (size_t)((size + m_segmentSize - 1) / m_segmentSize);
+            m_segments.resize(count);
+
+            // A whole MD5 broken by a patch can't be mended from the segments. It is only
+            // hashed again if every segment is read anyway; otherwise the object goes
+            // without one and relies on its CRC32C.
+            bool allStale = true;
+            for (size_t i = 0; i < count && allStale; i++)
+            {
+                uint64_t length = std::min(m_segmentSize, size - i * m_segmentSize);
+                allStale = !m_segments[i].valid || m_segments[i].filled != length;
+            }
+            bool rehashWhole = wholeMd5 && (!m_wholeValid || m_end != size) && allStale;
+            if (rehashWhole)
+                m_whole = Md5();
+            m_wholeValid = rehashWhole || (m_wholeValid && m_end == size);
+
+            std::vector<char> chunk;
+            m_crc = 0;
+            for (size_t i = 0; i < count; i++)
+            {
+                Segment& seg = m_segments[i];
+                uint64_t start = i * m_segmentSize;
+                uint64_t length = std::min(m_segmentSize, size - start);
+
+                bool stale = !seg.valid || seg.filled != length;
+                if (stale || rehashWhole)
+                {
+                    if (stale)
+                        seg = Segment();
+
+                    chunk.resize((size_t) std::min<uint64_t>(kRehashChunk, length));
+                    for (uint64_t pos = 0; pos < length;)
+                    {
+                        size_t n = (size_t) std::min<uint64_t>(chunk.size(), length - pos);
+                        if (!read(start + pos, chunk.data(), n))
+                            return false;
+
+                        if (stale)
+                        {
+                            seg.md5.update(chunk.data(), n);
+                            seg.crc = aux::crc32c(seg.crc, chunk.data(), n);
+                            seg.filled += n;
+                        }
+                        if (rehashWhole)
+                            m_whole.update(chunk.data(), n);
+                        pos += n;
+                    }
+                }
+
+                m_crc = crc32cCombine(m_crc, seg.crc, length);
+            }
+
+            m_end = size;
+            return true;
+        }
+
+        SegmentCrc::SegmentCrc(uint64_t segmentSize)
+            : m_segmentSize(segmentSize),
+              m_bytes(0)
+        {}
+
+        void SegmentCrc::update(const void* data, size_t size)
+        {
+            const char* p = (const char*) data;
+            while (size > 0)
+            {
+                uint64_t used = m_bytes % m_segmentSize;
+                if (used == 0)
+                    m_crcs.push_back(0);
+
+                size_t n = (size_t) std::min<uint64_t>(size, m_segmentSize - used);
+                m_crcs.back() = aux::crc32c(m_crcs.back(), p, n);
+                m_bytes += n;
+                p += n;
+                size -= n;
+            }
+        }
+
+        void ObjectChecksums::parse(const std::string& crcValue, const std::string& partsValue)
+        {
+            char* end = nullptr;
+            hasCrc = false;
+            if (!crcValue.empty())
+            {
+                crc = (uint32_t) strtoul(crcValue.c_str(), &end, 16);
+                hasCrc = *end == 0;
+            }
+
+            segmentSize = 0;
+            segmentCrcs.clear();
+            size_t colon = partsValue.find(':');
+            if (colon == std::string::npos)
+                return;
+
+            segmentSize = strtoull(partsValue.c_str(), &end, 10);
+            for (const char* p = partsValue.c_str() + colon + 1; *p;)
+            {
+                segmentCrcs.push_back((uint32_t) strtoul(p, &end, 16));
+                if (end == p || (*end && *end != ','))
+                    break;
+                p = *end ? end + 1 : end;
+            }
+
+            // Anything odd and the list is useless
+            if (segmentSize == 0 || (end && *end))
+            {
+                segmentSize = 0;
+                segmentCrcs.clear();
+            }
+        }
+
+        std::string ObjectChecksums::formatParts(uint64_t segmentSize, const std::vector<uint32_t>& crcs)
+        {
+            std::string value = std::to_string(segmentSize) + ":";
+            for (size_t i = 0; i < crcs.size(); i++)
+                value += (i ? "," : "") + crc32cToHex(crcs[i]);
+            return value.size() <= kMaxPartsValue ? value : std::string();
+        }
+
+        std::string multipartEtag(const std::vector<Md5::Digest>& parts)
+        {
+            Md5 md5;
+            for (const auto& part : parts)
+                md5.update(part.data(), part.size());
+            return Md5::toHex(md5.digest()) + "-" + std::to_string(parts.size());
+        }
+
+        bool isMd5Etag(const std::string& etag)
+        {
+            std::string value = etag;
+            value.erase(std::remove(value.begin(), value.end(), '"'), value.end());
+            return value.size() == 32 && value.find_first_not_of("0123456789abcdefABCDEF") == std::string::npos;
+        }
+
+        bool etagEquals(const std::string& etag, const std::string& expected)
+        {
+            std::string value = etag;
+            value.erase(std::remove(value.begin(), value.end(), '"'), value.end());
+            std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+            return value == expected;
+        }
+    } // namespace aux
+} // namespace nx_spl
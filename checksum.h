@@ -0,0 +1,138 @@
+#ifndef __S3_CHECKSUM_H__
+#define __S3_CHECKSUM_H__
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace nx_spl
+{
+    namespace aux
+    {
+        // MD5 (RFC 1321), fed incrementally
+        class Md5
+        {
+        public:
+            typedef std::array<uint8_t, 16> Digest;
+
+            Md5();
+            void update(const void* data, size_t size);
+            // Doesn't change the state, more data can follow
+            Digest digest() const;
+
+            static std::string toHex(const Digest& digest);
+            static std::string toBase64(const Digest& digest);
+
+        private:
+            void transform(const uint8_t* block);
+
+        private:
+            uint32_t    m_state[4];
+            uint64_t    m_bytes;
+            uint8_t     m_buffer[64];
+        }; // class Md5
+
+        // CRC32C (Castagnoli), SSE4.2 instruction when the CPU has it.
+        // Start with crc = 0 and pass the previous result to continue.
+        uint32_t crc32c(uint32_t crc, const void* data, size_t size);
+        // CRC32C of A followed by B from the CRCs of both and the length of B
+        uint32_t crc32cCombine(uint32_t crcA, uint32_t crcB, uint64_t lengthB);
+        std::string crc32cToHex(uint32_t crc);
+
+        // Digests of a staged object collected while it is being written.
+        // Appends are hashed as they arrive, per segment (multipart part) and whole.
+        // A write anywhere else invalidates what it touches, finalize() hashes
+        // those segments again from the final content. The whole MD5 doesn't
+        // survive such a write: hasMd5() is false then, unless nothing was hashed
+        // while writing.
+        class UploadDigest
+        {
+        public:
+            // Returns false if [offset, offset + size) of the object couldn't be read
+            typedef std::function<bool(uint64_t offset, char* dst, size_t size)> Reader;
+
+            explicit UploadDigest(uint64_t segmentSize);
+
+            void update(uint64_t offset, const void* data, size_t size);
+            // wholeMd5: the MD5 of the whole object is wanted too (single PUT), if it
+            // costs no read beyond the stale segments
+            bool finalize(uint64_t size, const Reader& read, bool wholeMd5);
+
+            // Valid after finalize()
+            uint64_t segmentSize() const { return m_segmentSize; }
+            size_t segments() const { return m_segments.size(); }
+            Md5::Digest segmentMd5(size_t index) const { return m_segments[index].md5.digest(); }
+            uint32_t segmentCrc(size_t index) const { return m_segments[index].crc; }
+            Md5::Digest md5() const { return m_whole.digest(); }
+            bool hasMd5() const { return m_wholeValid; }
+            uint32_t crc32c() const { return m_crc; }
+
+        private:
+            struct Segment
+            {
+                Segment() : crc(0), filled(0), valid(true) {}
+
+                Md5         md5;
+                uint32_t    crc;
+                uint64_t    filled;
+                bool        valid;
+            };
+
+            Segment& segment(size_t index);
+
+        private:
+            uint64_t                m_segmentSize;
+            uint64_t                m_end;          // appends continue here
+            std::vector<Segment>    m_segments;
+            Md5                     m_whole;
+            bool                    m_wholeValid;
+            uint32_t                m_crc;
+        }; // class UploadDigest
+
+        // CRC32C of a byte stream cut into fixed size segments, fed in order
+        class SegmentCrc
+        {
+        public:
+            explicit SegmentCrc(uint64_t segmentSize);
+
+            void update(const void* data, size_t size);
+
+            const std::vector<uint32_t>& crcs() const { return m_crcs; }
+            uint64_t bytes() const { return m_bytes; }
+
+        private:
+            uint64_t                m_segmentSize;
+            uint64_t                m_bytes;
+            std::vector<uint32_t>   m_crcs;
+        }; // class SegmentCrc
+
+        // What an object was uploaded with: x-amz-meta-crc32c and, when it fits into
+        // the metadata limit, x-amz-meta-crc32c-parts ("<segment size>:<crc>,<crc>,...")
+        struct ObjectChecksums
+        {
+            ObjectChecksums() : hasCrc(false), crc(0), segmentSize(0) {}
+
+            // Values as received, either may be empty
+            void parse(const std::string& crcValue, const std::string& partsValue);
+            // Empty if there are too many segments for the metadata
+            static std::string formatParts(uint64_t segmentSize, const std::vector<uint32_t>& crcs);
+
+            bool                    hasCrc;
+            uint32_t                crc;
+            uint64_t                segmentSize;
+            std::vector<uint32_t>   segmentCrcs;
+        };
+
+        // ETag S3 gives a multipart object: MD5 of the part MD5s, dash, part count
+        std::string multipartEtag(const std::vector<Md5::Digest>& parts);
+        // Compares an ETag header value (quoted) with a hex digest based one
+        bool etagEquals(const std::string& etag, const std::string& expected);
+        // Single part uploads without SSE-KMS get the MD5 of the body as ETag
+        bool isMd5Etag(const std::string& etag);
+    } // namespace aux
+} // namespace nx_spl
+
+#endif // __S3_CHECKSUM_H__
@@ -0,0 +1,329 @@
+#include "compression.h"
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include <unistd.h>
+
+#ifdef S3_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include "plog/Log.h"
+
+namespace nx_spl
+{
+    namespace aux
+    {
+        namespace
+        {
+            const uint32_t kSkippableMagic = 0x184D2A5E;
+            const uint32_t kSeekableMagic = 0x8F92EAB1;
+            const size_t kSkippableHeaderSize = 8;
+            const size_t kEntrySize = 8;
+            const uint8_t kChecksumFlag = 0x80;
+            // Objects smaller than this aren't worth a seek table
+            const size_t kMinSize = 256;
+            // Stored size, relative to the sample, below which compression pays off
+            const double kMaxRatio = 0.9;
+
+            uint32_t getLe32(const char* p)
+            {
+                const uint8_t* u = (const uint8_t*) p;
+                return (uint32_t) u[0] | ((uint32_t) u[1] << 8) | ((uint32_t) u[2] << 16) | ((uint32_t) u[3] << 24);
+            }
+
+            void putLe32(std::string& out, uint32_t value)
+            {
+                for (int i = 0; i < 4; i++)
+                    out.push_back((char) ((value >> (8 * i)) & 0xff));
+            }
+
+            bool preadAll(int fd, char* dst, size_t size, uint64_t offset)
+            {
+                while (size)
+                {
+                    ssize_t got = pread(fd, dst, size, (off_t) offset);
+                    if (got <= 0)
+                        return false;
+                    dst += got;
+                    size -= got;
+                    offset += got;
+                }
+                return true;
+            }
+
+            bool pwriteAll(int fd, const char* src, size_t size, uint64_t offset)
+            {
+                while (size)
+                {
+                    ssize_t done = pwrite(fd, src, size, (off_t) offset);
+                    if (done <= 0)
+                        return false;
+                    src += done;
+                    size -= done;
+                    offset += done;
+                }
+                return true;
+            }
+
+            // One frame of src into out, false on error
+            bool compressFrame(const char* src, size_t size, int level, std::vector<char>* out)
+            {
+#ifdef S3_WITH_ZSTD
+                out->resize(ZSTD_compressBound(size));
+                size_t result = ZSTD_compress(out->data(), out->size(), src, size, level);
+                if (ZSTD_isError(result))
+                {
+                    LOGE << "zstd compression failed: " << ZSTD_getErrorName(result);
+                    return false;
+                }
+                out->resize(result);
+                return true;
+#else
+                (void) src;
+                (void) size;
+                (void) level;
+                (void) out;
+                return false;
+#endif
+            }
+        }
+
+
+        bool compressionAvailable()
+        {
+#ifdef S3_WITH_ZSTD
+            return true;
+#else
+            return false;
+#endif
+        }
+
+
+        uint64_t SeekTable::tableSize(const char* footer)
+        {
+            if (getLe32(footer + 5) != kSeekableMagic)
+                return 0;
+
+            uint64_t entrySize = kEntrySize + ((footer[4] & kChecksumFlag) ? 4 : 0);
+            return kSkippableHeaderSize + getLe32(footer) * entrySize + kFooterSize;
+        }
+
+
+        bool SeekTable::parse(const char* table, size_t size)
+        {
+            m_frames.clear();
+            if (size < kSkippableHeaderSize + kFooterSize || tableSize(table + size - kFooterSize) != size
+                || getLe32(table) != kSkippableMagic || getLe32(table + 4) != size - kSkippableHeaderSize)
+                return false;
+
+            const char* footer = table + size - kFooterSize;
+            uint32_t count = getLe32(footer);
+            size_t entrySize = kEntrySize + ((footer[4] & kChecksumFlag) ? 4 : 0);
+
+            const char* entry = table + kSkippableHeaderSize;
+            for (uint32_t i = 0; i < count; i++, entry += entrySize)
+                add(getLe32(entry), getLe32(entry + 4));
+
+            // Uniform frames are what lets a logical offset find its frame by division
+            for (size_t i = 0; i + 1 < m_frames.size(); i++)
+            {
+                if (m_frames[i].logicalSize != m_frames[0].logicalSize || m_frames[i].logicalSize == 0)
+                {
+                    m_frames.clear();
+                    return false;
+                }
+            }
+            return true;
+        }
+
+
+        void SeekTable::add(uint32_t size, uint32_t logical)
+        {
+            Frame frame;
+            frame.offset = storedSize();
+            frame.size = size;
+            frame.logicalOffset = logicalSize();
+            frame.logicalSize = logical;
+            m_frames.push_back(frame);
+        }
+
+
+        std::string SeekTable::serialize() const
+        {
+            std::string out;
+            putLe32(out, kSkippableMagic);
+            putLe32(out, (uint32_t) (m_frames.size() * kEntrySize + kFooterSize));
+            for (const auto& frame : m_frames)
+            {
+                putLe32(out, frame.size);
+                putLe32(out, frame.logicalSize);
+            }
+            putLe32(out, (uint32_t) m_frames.size());
+            out.push_back(0);
+            putLe32(out, kSeekableMagic);
+            return out;
+        }
+
+
+        uint64_t SeekTable::logicalSize() const
+        {
+            return m_frames.empty() ? 0 : m_frames.back().logicalOffset + m_frames.back().logicalSize;
+        }
+
+
+        uint64_t SeekTable::storedSize() const
+        {
+            return m_frames.empty() ? 0 : m_frames.back().offset + m_frames.back().size;
+        }
+
+
+        bool compressible(const char* sample, size_t size, int level)
+        {
+            if (size < kMinSize || !compressionAvailable())
+                return false;
+
+            // The fastest levels tell compressible from not just as well
+            std::vector<char> out;
+            return compressFrame(sample, size, std::min(level, 1), &out) && out.size() < size * kMaxRatio;
+        }
+
+
+        bool compressFile(int src, uint64_t size, int dst, uint64_t frameSize, int level, int workers,
+                          uint64_t* stored)
+        {
+            if (!compressionAvailable())
+                return false;
+
+            SeekTable table;
+            uint64_t frames = (size + frameSize - 1) / frameSize;
+            size_t batch = (size_t) std::min<uint64_t>(std::max(workers, 1), std::max<uint64_t>(frames, 1));
+            std::vector<std::vector<char>> in(batch), out(batch);
+            std::vector<char> ok(batch);
+
+            for (uint64_t first = 0; first < frames; first += batch)
+            {
+                size_t count = (size_t) std::min<uint64_t>(batch, frames - first);
+                auto work = [&](size_t i) {
+                    uint64_t offset = (first + i) * frameSize;
+                    in[i].resize((size_t) std::min(frameSize, size - offset));
+                    ok[i] = preadAll(src, in[i].data(), in[i].size(), offset)
+                            && compressFrame(in[i].data(), in[i].size(), level, &out[i]);
+                };
+
+                std::vector<std::thread> threads;
+                for (size_t i = 1; i < count; i++)
+                    threads.emplace_back(work, i);
+                work(0);
+                for (auto& t : threads)
+                    t.join();
+
+                for (size_t i = 0; i < count; i++)
+                {
+                    if (!ok[i] || !pwriteAll(dst, out[i].data(), out[i].size(), table.storedSize()))
+                        return false;
+                    table.add((uint32_t) out[i].size(), (uint32_t) in[i].size());
+                }
+            }
+
+            std::string trailer = table.serialize();
+            if (!pwriteAll(dst, trailer.data(), trailer.size(), table.storedSize()))
+                return false;
+
+            *stored = table.storedSize() + trailer.size();
+            return true;
+        }
+
+
+        bool compressBuffer(const char* data, size_t size, uint64_t frameSize, int level, std::vector<char>* out)
+        {
+            SeekTable table;
+            std::vector<char> frame;
+            out->clear();
+            for (uint64_t offset = 0; offset < size; offset += frameSize)
+            {
+                size_t length = (size_t) std::min<uint64_t>(frameSize, size - offset);
+                if (!compressFrame(data + offset, length, level, &frame))
+                    return false;
+
+                out->insert(out->end(), frame.begin(), frame.end());
+                table.add((uint32_t) frame.size(), (uint32_t) length);
+            }
+
+            std::string trailer = table.serialize();
+            out->insert(out->end(), trailer.begin(), trailer.end());
+            return true;
+        }
+
+
+        bool decompressFrame(const SeekTable::Frame& frame, const char* src, char* dst)
+        {
+#ifdef S3_WITH_ZSTD
+            size_t result = ZSTD_decompress(dst, frame.logicalSize, src, frame.size);
+            if (ZSTD_isError(result) || result != frame.logicalSize)
+            {
+                LOGE << "zstd frame at " << frame.offset << " doesn't decompress";
+                return false;
+            }
+            return true;
+#else
+            (void) src;
+            (void) dst;
+            LOGE << "Compressed object, built without zstd, frame at " << frame.offset;
+            return false;
+#endif
+        }
+
+
+        bool decompressFile(int src, uint64_t storedSize, int dst, uint64_t* logicalSize)
+        {
+            char footer[SeekTable::kFooterSize];
+            if (storedSize < sizeof(footer) || !preadAll(src, footer, sizeof(footer), storedSize - sizeof(footer)))
+                return false;
+
+            uint64_t size = SeekTable::tableSize(footer);
+            std::vector<char> trailer((size_t) size);
+            SeekTable table;
+            if (size == 0 || size > storedSize || !preadAll(src, trailer.data(), trailer.size(), storedSize - size)
+                || !table.parse(trailer.data(), trailer.size()))
+                return false;
+
+            std::vector<char> in, out;
+            for (size_t i = 0; i < table.frames(); i++)
+            {
+                const SeekTable::Frame& frame = table.frame(i);
+                in.resize(frame.size);
+                out.resize(frame.logicalSize);
+                if (frame.offset + frame.size > storedSize - size || !preadAll(src, in.data(), in.size(), frame.offset) || !decompressFrame(frame, in.data(), out.data())
+                    || !pwriteAll(dst, out.data(), out.size(), frame.logicalOffset))
+                    return false;
+            }
+
+            *logicalSize = table.logicalSize();
+            return ftruncate(dst, (off_t) *logicalSize) == 0;
+        }
+
+
+        bool decompressBuffer(const char* data, size_t size, std::vector<char>* out)
+        {
+            if (size < SeekTable::kFooterSize)
+                return false;
+
+            uint64_t tableSize = SeekTable::tableSize(data + size - SeekTable::kFooterSize);
+            SeekTable table;
+            if (tableSize == 0 || tableSize > size || !table.parse(data + size - tableSize, (size_t) tableSize))
+                return false;
+
+            out->resize((size_t) table.logicalSize());
+            for (size_t i = 0; i < table.frames(); i++)
+            {
+                const SeekTable::Frame& frame = table.frame(i);
+                if (frame.offset + frame.size > size - tableSize
+                    || !decompressFrame(frame, data + frame.offset, out->data() + frame.logicalOffset))
+                    return false;
+            }
+            return true;
+        }
+    } // namespace aux
+} // namespace nx_spl
@@ -0,0 +1,75 @@
+#ifndef __S3_COMPRESSION_H__
+#define __S3_COMPRESSION_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace nx_spl
+{
+    namespace aux
+    {
+        // Compressed objects are independent zstd frames of a fixed number of
+        // logical bytes (the last one may be shorter), followed by a seek table
+        // in the zstd seekable format: a skippable frame with the stored and
+        // logical size of every frame. Any logical range can be read by fetching
+        // just the frames it covers.
+        //
+        // zstd is optional (S3_WITH_ZSTD); without it nothing is compressed and
+        // compressed objects can't be read.
+        bool compressionAvailable();
+
+        class SeekTable
+        {
+        public:
+            struct Frame
+            {
+                uint64_t offset;        // stored
+                uint32_t size;
+                uint64_t logicalOffset;
+                uint32_t logicalSize;
+            };
+
+            // Trailer of the table: frame count, descriptor, magic
+            static const size_t kFooterSize = 9;
+
+            // Size of the whole table from its footer (the last kFooterSize bytes
+            // of the object), 0 if there is no table
+            static uint64_t tableSize(const char* footer);
+            // table: the last tableSize() bytes of the object. Frames must all have
+            // the same logical size but the last one.
+            bool parse(const char* table, size_t size);
+
+            void add(uint32_t size, uint32_t logical);
+            std::string serialize() const;
+
+            size_t frames() const { return m_frames.size(); }
+            const Frame& frame(size_t index) const { return m_frames[index]; }
+            // Logical size of every frame but the last
+            uint64_t frameSize() const { return m_frames.empty() ? 0 : m_frames[0].logicalSize; }
+            uint64_t logicalSize() const;
+            uint64_t storedSize() const;
+
+        private:
+            std::vector<Frame> m_frames;
+        }; // class SeekTable
+
+        // Whether size bytes starting with sample (a prefix of them) are worth storing compressed
+        bool compressible(const char* sample, size_t size, int level);
+
+        // [0, size) of src as frames of frameSize logical bytes plus the seek table into dst,
+        // `workers` frames compressed at a time. stored gets the size written.
+        bool compressFile(int src, uint64_t size, int dst, uint64_t frameSize, int level, int workers,
+                          uint64_t* stored);
+        bool compressBuffer(const char* data, size_t size, uint64_t frameSize, int level, std::vector<char>* out);
+
+        // One frame of the table back into frame.logicalSize bytes at dst
+        bool decompressFrame(const SeekTable::Frame& frame, const char* src, char* dst);
+        // A whole compressed object back into its logical bytes
+        bool decompressFile(int src, uint64_t storedSize, int dst, uint64_t* logicalSize);
+        bool decompressBuffer(const char* data, size_t size, std::vector<char>* out);
+    } // namespace aux
+} // namespace nx_spl
+
+#endif // __S3_COMPRESSION_H__
@@ -0,0 +1,46 @@
+#include "dir_lock.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include "plog/Log.h"
+
+namespace nx_spl
+{
+    namespace aux
+    {
+        const char DirLock::kFileName[] = ".lock";
+
+
+        DirLock::DirLock(const std::string& dir)
+            : m_fd(-1)
+        {
+            if (dir.empty())
+                return;
+
+            std::string path = dir + "/" + kFileName;
+            m_fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if (m_fd == -1)
+            {
+                LOGE << "Couldn't open lock file:" << path;
+                return;
+            }
+
+            // Locks of one file opened twice conflict even within a process
+            if (flock(m_fd, LOCK_EX | LOCK_NB) == -1)
+            {
+                LOGE << "Directory is in use by another storage:" << dir;
+                close(m_fd);
+                m_fd = -1;
+            }
+        }
+
+
+        DirLock::~DirLock()
+        {
+            if (m_fd != -1)
+                close(m_fd);
+        }
+    } // namespace aux
+} // namespace nx_spl
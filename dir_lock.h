@@ -0,0 +1,36 @@
+#ifndef __S3_DIR_LOCK_H__
+#define __S3_DIR_LOCK_H__
+
+#include <string>
+
+namespace nx_spl
+{
+    namespace aux
+    {
+        // Exclusive ownership of a state directory (spool, packs, local copies,
+        // metadata index) for the object's lifetime: flock() on a lock file in it.
+        // Storages of one bucket, in this process or another, would otherwise
+        // replay and delete each other's files.
+        class DirLock
+        {
+        public:
+            // Name of the lock file, directory scans skip it
+            static const char kFileName[];
+
+            // dir: empty - nothing is locked
+            explicit DirLock(const std::string& dir);
+            ~DirLock();
+
+            DirLock(const DirLock&) = delete;
+            DirLock& operator =(const DirLock&) = delete;
+
+            // False if dir is held by another owner or can't be locked
+            bool locked() const { return m_fd != -1; }
+
+        private:
+            int m_fd;
+        }; // class DirLock
+    } // namespace aux
+} // namespace nx_spl
+
+#endif // __S3_DIR_LOCK_H__
@@ -0,0 +1,568 @@
+#include "disk_cache.h"
+
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "plog/Log.h"
+
+namespace nx_spl
+{
+    namespace
+    {
+        const char kIndexName[] = "index.log";
+        const char kBlockSuffix[] = ".blk";
+        const char kTempSuffix[] = ".tmp";
+        const char kAddRecord = 'A';
+        const char kRemoveRecord = 'D';
+        // Journal is rewritten once it has this many more dead records than live ones
+        const uint64_t kCompactSlack = 1024;
+
+        // FNV-1a, only has to catch torn or garbled records
+        uint32_t checksum(const char* data, size_t size)
+        {
+            uint32_t hash = 2166136261u;
+            for (size_t i = 0; i < size; i++)
+            {
+                hash ^= (unsigned char) data[i];
+                hash *= 16777619u;
+            }
+            return hash;
+        }
+
+        void putU64(std::string& out, uint64_t value)
+        {
+            out.append((const char*) &value, sizeof(value));
+        }
+
+        void putString(std::string& out, const std::string& value)
+        {
+            uint32_t size = (uint32_t) value.size();
+            out.append((const char*) &size, sizeof(size));
+            out.append(value);
+        }
+
+        class RecordReader
+        {
+        public:
+            RecordReader(const char* data, size_t size) : m_pos(data), m_end(data + size) {}
+
+            bool getChar(char& value)
+            {
+                if (m_pos >= m_end)
+                    return false;
+                value = *m_pos++;
+                return true;
+            }
+
+            bool getU64(uint64_t& value)
+            {
+                if ((size_t)(m_end - m_pos) < sizeof(value))
+                    return false;
+                memcpy(&value, m_pos, sizeof(value));
+                m_pos += sizeof(value);
+                return true;
+            }
+
+            bool getString(std::string& value)
+            {
+                uint32_t size;
+                if ((size_t)(m_end - m_pos) < sizeof(size))
+                    return false;
+                memcpy(&size, m_pos, sizeof(size));
+                m_pos += sizeof(size);
+                if ((size_t)(m_end - m_pos) < size)
+                    return false;
+                value.assign(m_pos, size);
+                m_pos += size;
+                return true;
+            }
+
+        private:
+            const char* m_pos;
+            const char* m_end;
+        };
+
+        bool writeFile(const std::string& path, const char* data, size_t size)
+        {
+            int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd == -1)
+                return false;
+
+            size_t written = 0;
+            while (written < size)
+            {
+                ssize_t res = ::write(fd, data + written, size - written);
+                if (res <= 0)
+                {
+                    ::close(fd);
+                    return false;
+                }
+                written += res;
+            }
+            return ::close(fd) == 0;
+        }
+
+        bool readFile(const std::string& path, uint64_t size, std::vector<char>& data)
+        {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd == -1)
+                return false;
+
+            data.resize(size);
+            size_t done = 0;
+            while (done < size)
+            {
+                ssize_t res = ::read(fd, data.data() + done, size - done);
+                if (res <= 0)
+                    break;
+                done += res;
+            }
+            ::close(fd);
+            return done == size;
+        }
+
+        bool endsWith(const std::string& s, const char* suffix)
+        {
+            size_t len = strlen(suffix);
+            return s.size() >= len && s.compare(s.size() - len, len, suffix) == 0;
+        }
+    }
+
+
+    DiskCache& DiskCache::instance()
+    {
+        static DiskCache cache;
+        return cache;
+    }
+
+
+    DiskCache::DiskCache()
+        : m_capacity(0),
+          m_bytes(0),
+          m_nextId(1),
+          m_deadRecords(0),
+          m_log(nullptr)
+    {
+        m_stats = Stats();
+    }
+
+
+    DiskCache::~DiskCache()
+    {
+        if (m_log)
+            fclose(m_log);
+    }
+
+
+    std::string DiskCache::objectKey(const std::string& bucket, const std::string& key)
+    {
+        return bucket + '\0' + key;
+    }
+
+
+    std::string DiskCache::blockPath(uint64_t id) const
+    {
+        return m_dir + "/" + std::to_string(id) + kBlockSuffix;
+    }
+
+
+    bool DiskCache::configure(const std::string& dir, uint64_t capacity)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (!m_dir.empty() && dir == m_dir && capacity != 0)
+        {
+            m_capacity = capacity;
+            while (m_bytes > m_capacity && !m_lru.empty())
+                removeEntry(m_lru.back(), true);
+            return true;
+        }
+
+        if (m_log)
+        {
+            fclose(m_log);
+            m_log = nullptr;
+        }
+        m_objects.clear();
+        m_blocks.clear();
+        m_lru.clear();
+        m_bytes = 0;
+        m_dir.clear();
+
+        if (dir.empty() || capacity == 0)
+            return false;
+
+        struct stat st;
+        if (mkdir(dir.c_str(), 0755) == -1 && (stat(dir.c_str(), &st) == -1 || !S_ISDIR(st.st_mode)))
+        {
+            LOGE << "Couldn't create disk cache dir:" << dir;
+            return false;
+        }
+
+        m_dir = dir;
+        m_capacity = capacity;
+        load();
+        compact();
+        if (!m_log)
+        {
+            LOGE << "Couldn't open disk cache index in:" << dir;
+            m_dir.clear();
+            return false;
+        }
+
+        while (m_bytes > m_capacity && !m_lru.empty())
+            removeEntry(m_lru.back(), true);
+
+        LOGD << "Disk cache:" << dir << ", blocks " << m_blocks.size() << ", bytes " << m_bytes;
+        return true;
+    }
+
+
+    bool DiskCache::enabled() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return !m_dir.empty();
+    }
+
+
+    void DiskCache::load()
+    {
+        std::string path = m_dir + "/" + kIndexName;
+        std::vector<char> journal;
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0 && !readFile(path, st.st_size, journal))
+            journal.clear();
+
+        size_t pos = 0;
+        while (pos + 2 * sizeof(uint32_t) <= journal.size())
+        {
+            uint32_t size, sum;
+            memcpy(&size, journal.data() + pos, sizeof(size));
+            memcpy(&sum, journal.data() + pos + sizeof(size), sizeof(sum));
+            const char* payload = journal.data() + pos + 2 * sizeof(uint32_t);
+            if (size > journal.size() - pos - 2 * sizeof(uint32_t) || checksum(payload, size) != sum)
+            {
+                LOGD << "Disk cache index: torn record at " << pos;
+                break;
+            }
+            pos += 2 * sizeof(uint32_t) + size;
+
+            RecordReader reader(payload, size);
+            char type = 0;
+            uint64_t id = 0, block = 0, block_size = 0;
+            std::string etag, object;
+            if (!reader.getChar(type) || !reader.getU64(id))
+                break;
+            m_nextId = std::max(m_nextId, id + 1);
+
+            if (type == kRemoveRecord)
+            {
+                removeEntry(id, false);
+            }
+            else if (type == kAddRecord && reader.getU64(block) && reader.getU64(block_size)
+                     && reader.getString(etag) && reader.getString(object))
+            {
+                auto found = m_objects.find(object);
+                if (found != m_objects.end() && found->second.etag != etag)
+                    removeObject(object, false);
+                addEntry(object, etag, block, id, block_size);
+            }
+        }
+
+        // Entries whose file didn't make it are dropped
+        std::vector<uint64_t> missing;
+        for (const auto& entry : m_blocks)
+        {
+            if (stat(blockPath(entry.first).c_str(), &st) == -1 || (uint64_t) st.st_size != entry.second.size)
+                missing.push_back(entry.first);
+        }
+        for (auto id : missing)
+            removeEntry(id, false);
+
+        // So are files no record points to
+        if (DIR* d = opendir(m_dir.c_str()))
+        {
+            while (struct dirent* item = readdir(d))
+            {
+                std::string name = item->d_name;
+                bool orphan = endsWith(name, kTempSuffix);
+                if (endsWith(name, kBlockSuffix))
+                    orphan = m_blocks.count(std::strtoull(name.c_str(), nullptr, 10)) == 0;
+                if (orphan)
+                    unlink((m_dir + "/" + name).c_str());
+            }
+            closedir(d);
+        }
+    }
+
+
+    void DiskCache::compact()
+    {
+        std::string path = m_dir + "/" + kIndexName;
+        std::string temp = path + kTempSuffix;
+
+        if (m_log)
+        {
+            fclose(m_log);
+            m_log = nullptr;
+        }
+
+        FILE* f = fopen(temp.c_str(), "wb");
+        if (f)
+        {
+            m_log = f;
+            // Oldest first, replay then restores the LRU order
+            bool ok = true;
+            for (auto it = m_lru.rbegin(); it != m_lru.rend() && ok; ++it)
+            {
+                const BlockEntry& entry = m_blocks[*it];
+                std::string payload(1, kAddRecord);
+                putU64(payload, *it);
+                putU64(payload, entry.block);
+                putU64(payload, entry.size);
+                putString(payload, m_objects[entry.object].etag);
+                putString(payload, entry.object);
+                ok = appendRecord(payload);
+            }
+            ok = ok && fsync(fileno(f)) == 0;
+            fclose(f);
+            m_log = nullptr;
+
+            if (ok && rename(temp.c_str(), path.c_str()) == 0)
+                m_deadRecords = 0;
+            else
+                unlink(temp.c_str());
+        }
+
+        m_log = fopen(path.c_str(), "ab");
+    }
+
+
+    bool DiskCache::appendRecord(const std::string& payload)
+    {
+        if (!m_log)
+            return false;
+
+        uint32_t header[2] = { (uint32_t) payload.size(), checksum(payload.data(), payload.size()) };
+        return fwrite(header, sizeof(header), 1, m_log) == 1
+            && fwrite(payload.data(), payload.size(), 1, m_log) == 1
+            && fflush(m_log) == 0;
+    }
+
+
+    void DiskCache::addEntry(const std::string& object, const std::string& etag, uint64_t block, uint64_t id, uint64_t size)
+    {
+        auto found = m_objects.find(object);
+        if (found != m_objects.end())
+        {
+            auto existing = found->second.blocks.find(block);
+            if (existing != found->second.blocks.end())
+                removeEntry(existing->second, false);
+        }
+
+        ObjectEntry& entry = m_objects[object];
+        entry.etag = etag;
+        entry.blocks[block] = id;
+        m_lru.push_front(id);
+
+        BlockEntry& block_entry = m_blocks[id];
+        block_entry.object = object;
+        block_entry.block = block;
+        block_entry.size = size;
+        block_entry.lru = m_lru.begin();
+        m_bytes += size;
+    }
+
+
+    void DiskCache::removeEntry(uint64_t id, bool log)
+    {
+        auto found = m_blocks.find(id);
+        if (found == m_blocks.end())
+            return;
+
+        if (!m_dir.empty())
+            unlink(blockPath(id).c_str());
+
+        auto object = m_objects.find(found->second.object);
+        if (object != m_objects.end())
+        {
+            object->second.blocks.erase(found->second.block);
+            if (object->second.blocks.empty())
+                m_objects.erase(object);
+        }
+
+        m_bytes -= found->second.size;
+        m_lru.erase(found->second.lru);
+        m_blocks.erase(found);
+
+        if (log)
+        {
+            std::string payload(1, kRemoveRecord);
+            putU64(payload, id);
+            appendRecord(payload);
+            m_deadRecords += 2;
+        }
+    }
+
+
+    void DiskCache::removeObject(const std::string& object, bool log)
+    {
+        auto found = m_objects.find(object);
+        if (found == m_objects.end())
+            return;
+
+        std::vector<uint64_t> ids;
+        for (const auto& block : found->second.blocks)
+            ids.push_back(block.second);
+        for (auto id : ids)
+            removeEntry(id, log);
+    }
+
+
+    std::string DiskCache::etag(const std::string& bucket, const std::string& key) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto found = m_objects.find(objectKey(bucket, key));
+        return found == m_objects.end() ? std::string() : found->second.etag;
+    }
+
+
+    bool DiskCache::hasBlocks(
+        const std::string   &bucket,
+        const std::string   &key,
+        const std::string   &etag,
+        uint64_t            count) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto found = m_objects.find(objectKey(bucket, key));
+        if (found == m_objects.end() || found->second.etag != etag)
+            return false;
+
+        for (uint64_t block = 0; block < count; block++)
+        {
+            if (found->second.blocks.count(block) == 0)
+                return false;
+        }
+        return true;
+    }
+
+
+    DiskCache::BlockPtr DiskCache::get(
+        const std::string   &bucket,
+        const std::string   &key,
+        const std::string   &etag,
+        uint64_t            block)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_dir.empty())
+            return BlockPtr();
+
+        auto object = m_objects.find(objectKey(bucket, key));
+        if (object == m_objects.end() || object->second.etag != etag || object->second.blocks.count(block) == 0)
+        {
+            m_stats.misses++;
+            return BlockPtr();
+        }
+
+        uint64_t id = object->second.blocks[block];
+        BlockEntry& entry = m_blocks[id];
+        m_lru.splice(m_lru.begin(), m_lru, entry.lru);
+        uint64_t size = entry.size;
+        std::string path = blockPath(id);
+        lock.unlock();
+
+        auto data = std::make_shared<std::vector<char>>();
+        bool ok = readFile(path, size, *data);
+
+        lock.lock();
+        if (!ok)
+        {   // evicted meanwhile or damaged
+            removeEntry(id, true);
+            m_stats.misses++;
+            return BlockPtr();
+        }
+
+        m_stats.hits++;
+        return data;
+    }
+
+
+    void DiskCache::put(
+        const std::string   &bucket,
+        const std::string   &key,
+        const std::string   &etag,
+        uint64_t            block,
+        const BlockPtr      &data)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_dir.empty() || etag.empty() || !data || data->size() > m_capacity)
+            return;
+
+        std::string object = objectKey(bucket, key);
+        auto found = m_objects.find(object);
+        if (found != m_objects.end() && found->second.etag == etag && found->second.blocks.count(block))
+            return;
+
+        uint64_t id = m_nextId++;
+        std::string dir = m_dir;
+        std::string path = blockPath(id);
+        lock.unlock();
+
+        // The block file is complete before the journal mentions it
+        std::string temp = path + kTempSuffix;
+        bool ok = writeFile(temp, data->data(), data->size());
+
+        lock.lock();
+        if (!ok || dir != m_dir || rename(temp.c_str(), path.c_str()) != 0)
+        {
+            unlink(temp.c_str());
+            return;
+        }
+
+        found = m_objects.find(object);
+        if (found != m_objects.end() && found->second.etag != etag)
+            removeObject(object, true);
+
+        std::string payload(1, kAddRecord);
+        putU64(payload, id);
+        putU64(payload, block);
+        putU64(payload, data->size());
+        putString(payload, etag);
+        putString(payload, object);
+        if (!appendRecord(payload))
+        {
+            unlink(path.c_str());
+            return;
+        }
+        addEntry(object, etag, block, id, data->size());
+
+        while (m_bytes > m_capacity && !m_lru.empty())
+        {
+            removeEntry(m_lru.back(), true);
+            m_stats.evictions++;
+        }
+
+        if (m_deadRecords > m_blocks.size() + kCompactSlack)
+            compact();
+    }
+
+
+    void DiskCache::invalidate(const std::string& bucket, const std::string& key)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        removeObject(objectKey(bucket, key), true);
+    }
+
+
+    DiskCache::Stats DiskCache::stats() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Stats result = m_stats;
+        result.bytes = m_bytes;
+        result.capacity = m_dir.empty() ? 0 : m_capacity;
+        return result;
+    }
+} // namespace nx_spl
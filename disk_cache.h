@@ -0,0 +1,116 @@
+#ifndef __S3_DISK_CACHE_H__
+#define __S3_DISK_CACHE_H__
+
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace nx_spl
+{
+    // Optional process-wide cache of object blocks on local disk. Survives
+    // S3IODevice lifetimes and plugin restarts; blocks are tied to the ETag
+    // they were downloaded with, callers revalidate before trusting them.
+    //
+    // Every block is a file <id>.blk in the cache directory. index.log is an
+    // append-only journal of checksummed add/remove records: a block file is
+    // complete before its record is appended, and replay stops at the first
+    // torn record, so a crash can only lose entries, never serve garbage.
+    class DiskCache
+    {
+    public:
+        typedef std::shared_ptr<const std::vector<char>> BlockPtr;
+
+        struct Stats
+        {
+            uint64_t hits;
+            uint64_t misses;
+            uint64_t evictions;
+            uint64_t bytes;
+            uint64_t capacity;
+        };
+
+        static DiskCache& instance();
+
+        // Empty dir or zero capacity disables the cache
+        bool configure(const std::string& dir, uint64_t capacity);
+        bool enabled() const;
+
+        // ETag the cached blocks of the object belong to, empty if none
+        std::string etag(const std::string& bucket, const std::string& key) const;
+        // true if blocks [0, count) are all cached for etag
+        bool hasBlocks(
+            const std::string   &bucket,
+            const std::string   &key,
+            const std::string   &etag,
+            uint64_t            count
+        ) const;
+
+        BlockPtr get(
+            const std::string   &bucket,
+            const std::string   &key,
+            const std::string   &etag,
+            uint64_t            block
+        );
+        // Blocks of another ETag of the same object are dropped
+        void put(
+            const std::string   &bucket,
+            const std::string   &key,
+            const std::string   &etag,
+            uint64_t            block,
+            const BlockPtr      &data
+        );
+        void invalidate(const std::string& bucket, const std::string& key);
+
+        Stats stats() const;
+
+    private:
+        DiskCache();
+        ~DiskCache();
+
+        struct BlockEntry
+        {
+            std::string                 object;
+            uint64_t                    block;
+            uint64_t                    size;
+            std::list<uint64_t>::iterator lru;
+        };
+
+        struct ObjectEntry
+        {
+            std::string                 etag;
+            std::map<uint64_t, uint64_t> blocks; // block index -> id
+        };
+
+        static std::string objectKey(const std::string& bucket, const std::string& key);
+        std::string blockPath(uint64_t id) const;
+
+        void load();
+        void compact();
+        bool appendRecord(const std::string& payload);
+        void addEntry(const std::string& object, const std::string& etag, uint64_t block, uint64_t id, uint64_t size);
+        void removeEntry(uint64_t id, bool log);
+        void removeObject(const std::string& object, bool log);
+
+    private:
+        mutable std::mutex  m_mutex;
+        std::string         m_dir;
+        uint64_t            m_capacity;
+        uint64_t            m_bytes;
+        uint64_t            m_nextId;
+        uint64_t            m_deadRecords;
+        FILE               *m_log;
+
+        std::unordered_map<std::string, ObjectEntry>    m_objects;
+        std::unordered_map<uint64_t, BlockEntry>        m_blocks;
+        std::list<uint64_t>                             m_lru;  // front is most recently used
+        Stats               m_stats;
+    }; // class DiskCache
+} // namespace nx_spl
+
+#endif // __S3_DISK_CACHE_H__
@@ -0,0 +1,296 @@
+#include "index_snapshot.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "plog/Log.h"
+
+namespace nx_spl
+{
+    namespace aux
+    {
+        namespace
+        {
+            const char kMagic[4] = {'N', 'X', 'S', 'I'};
+
+            struct Header
+            {
+                char        magic[4];
+                uint32_t    version;
+                uint64_t    count;
+                uint64_t    listedAt;
+                uint64_t    bytes;
+                uint64_t    restartsOffset;
+                uint64_t    restartCount;
+            };
+
+            void putVarint(std::string* out, uint64_t value)
+            {
+                while (value >= 0x80)
+                {
+                    out->push_back((char) (value | 0x80));
+                    value >>= 7;
+                }
+                out->push_back((char) value);
+            }
+
+            // False past end
+            bool getVarint(const char* data, uint64_t end, uint64_t* offset, uint64_t* value)
+            {
+                *value = 0;
+                for (int shift = 0; shift < 64 && *offset < end; shift += 7)
+                {
+                    uint8_t byte = (uint8_t) data[(*offset)++];
+                    *value |= (uint64_t) (byte & 0x7f) << shift;
+                    if (!(byte & 0x80))
+                        return true;
+                }
+                return false;
+            }
+        }
+
+
+        bool IndexSnapshot::write(const std::string& path, const std::vector<Object>& objects, time_t listedAt)
+        {
+            std::string tmp = path + ".tmp";
+            FILE* f = fopen(tmp.c_str(), "wb");
+            if (!f)
+                return false;
+
+            Header header;
+            memcpy(header.magic, kMagic, sizeof(kMagic));
+            header.version = kVersion;
+            header.count = objects.size();
+            header.listedAt = (uint64_t) listedAt;
+            header.bytes = 0;
+
+            bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+            std::vector<uint64_t> restarts;
+            uint64_t offset = sizeof(header);
+            std::string entry;
+            const std::string* previous = nullptr;
+            for (size_t i = 0; ok && i < objects.size(); i++)
+            {
+                const Object& object = objects[i];
+                size_t shared = 0;
+                if (i % kRestartInterval == 0)
+                {
+                    restarts.push_back(offset);
+                }
+                else
+                {
+                    size_t limit = std::min(previous->size(), object.key.size());
+                    while (shared < limit && (*previous)[shared] == object.key[shared])
+                        shared++;
+                }
+
+                entry.clear();
+                putVarint(&entry, shared);
+                putVarint(&entry, object.key.size() - shared);
+                entry.append(object.key, shared, std::string::npos);
+                putVarint(&entry, object.size);
+                size_t etag = std::min<size_t>(object.etag.size(), 255);
+                entry.push_back((char) etag);
+                entry.append(object.etag, 0, etag);
+
+                ok = fwrite(entry.data(), 1, entry.size(), f) == entry.size();
+                offset += entry.size();
+                header.bytes += object.size;
+                previous = &object.key;
+            }
+
+            header.restartsOffset = offset;
+            header.restartCount = restarts.size();
+            ok = ok && (restarts.empty() || fwrite(restarts.data(), sizeof(uint64_t), restarts.size(), f) == restarts.size())
+                 && fseek(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1
+                 && fflush(f) == 0 && fsync(fileno(f)) == 0;
+            ok = fclose(f) == 0 && ok;
+
+            if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+            {
+                LOGE << "Couldn't write index snapshot:" << path;
+                remove(tmp.c_str());
+                return false;
+            }
+            return true;
+        }
+
+
+        IndexSnapshot::IndexSnapshot()
+            : m_data(nullptr),
+              m_length(0),
+              m_count(0),
+              m_bytes(0),
+              m_listedAt(0),
+              m_entriesEnd(0),
+              m_restarts(0)
+        {}
+
+
+        IndexSnapshot::~IndexSnapshot()
+        {
+            if (m_data)
+                munmap((void*) m_data, m_length);
+        }
+
+
+        bool IndexSnapshot::open(const std::string& path)
+        {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd == -1)
+                return false;
+
+            struct stat st;
+            void* data = MAP_FAILED;
+            if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(Header))
+                data = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (data == MAP_FAILED)
+                return false;
+
+            Header header;
+            memcpy(&header, data, sizeof(header));
+            size_t length = (size_t) st.st_size;
+            if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion
+                || header.restartsOffset < sizeof(Header) || header.restartsOffset > length
+                || header.restartCount != (header.count + kRestartInterval - 1) / kRestartInterval
+                || (length - header.restartsOffset) / sizeof(uint64_t) < header.restartCount)
+            {
+                LOGE << "Index snapshot of another version or damaged:" << path;
+                munmap(data, length);
+                return false;
+            }
+
+            m_data = (const char*) data;
+            m_length = length;
+            m_count = header.count;
+            m_bytes = header.bytes;
+            m_listedAt = (time_t) header.listedAt;
+            m_entriesEnd = header.restartsOffset;
+            m_restarts = header.restartCount;
+            // Lookups jump around, readahead would only waste page cache
+            madvise(data, length, MADV_RANDOM);
+            return true;
+        }
+
+
+        uint64_t IndexSnapshot::restartOffset(uint64_t i) const
+        {
+            uint64_t offset;
+            memcpy(&offset, m_data + m_entriesEnd + i * sizeof(uint64_t), sizeof(offset));
+            return offset;
+        }
+
+
+        std::string IndexSnapshot::restartKey(uint64_t i) const
+        {
+            uint64_t offset = restartOffset(i);
+            uint64_t shared = 0, unshared = 0;
+            if (!getVarint(m_data, m_entriesEnd, &offset, &shared)
+                || !getVarint(m_data, m_entriesEnd, &offset, &unshared)
+                || offset + unshared > m_entriesEnd)
+                return std::string();
+            return std::string(m_data + offset, (size_t) unshared);
+        }
+
+
+        bool IndexSnapshot::find(const std::string& key, Object* object) const
+        {
+            Cursor cursor(*this);
+            cursor.seek(key);
+            if (!cursor.valid() || cursor.object().key != key)
+                return false;
+            if (object)
+                *object = cursor.object();
+            return true;
+        }
+
+
+        std::vector<std::string> IndexSnapshot::sample(size_t count) const
+        {
+            std::vector<std::string> keys;
+            if (!isOpen() || count == 0)
+                return keys;
+
+            // Restart entries hold whole keys, no decoding needed
+            uint64_t step = std::max<uint64_t>(m_restarts / count, 1);
+            for (uint64_t i = step; i < m_restarts; i += step)
+                keys.push_back(restartKey(i));
+            return keys;
+        }
+
+
+        IndexSnapshot::Cursor::Cursor(const IndexSnapshot& snapshot)
+            : m_snapshot(snapshot),
+              m_offset(0),
+              m_valid(false)
+        {}
+
+
+        void IndexSnapshot::Cursor::seek(const std::string& key)
+        {
+            m_valid = false;
+            if (!m_snapshot.isOpen() || m_snapshot.m_restarts == 0)
+                return;
+
+            // Last restart with a key <= key, then linear within its run
+            uint64_t low = 0, high = m_snapshot.m_restarts;
+            while (high - low > 1)
+            {
+                uint64_t mid = low + (high - low) / 2;
+                if (m_snapshot.restartKey(mid) <= key)
+                    low = mid;
+                else
+                    high = mid;
+            }
+
+            m_offset = m_snapshot.restartOffset(low);
+            m_object.key.clear();
+            while (decode() && m_object.key < key)
+                ;
+        }
+
+
+        void IndexSnapshot::Cursor::next()
+        {
+            if (m_valid)
+                decode();
+        }
+
+
+        bool IndexSnapshot::Cursor::decode()
+        {
+            const char* data = m_snapshot.m_data;
+            uint64_t end = m_snapshot.m_entriesEnd;
+            uint64_t shared = 0, unshared = 0, size = 0;
+            m_valid = m_offset < end
+                      && getVarint(data, end, &m_offset, &shared)
+                      && getVarint(data, end, &m_offset, &unshared)
+                      && shared <= m_object.key.size() && m_offset + unshared <= end;
+            if (!m_valid)
+                return false;
+
+            m_object.key.resize((size_t) shared);
+            m_object.key.append(data + m_offset, (size_t) unshared);
+            m_offset += unshared;
+
+            m_valid = getVarint(data, end, &m_offset, &size) && m_offset < end;
+            if (!m_valid)
+                return false;
+            m_object.size = size;
+
+            uint8_t etag = (uint8_t) data[m_offset++];
+            m_valid = m_offset + etag <= end;
+            if (!m_valid)
+                return false;
+            m_object.etag.assign(data + m_offset, etag);
+            m_offset += etag;
+            return true;
+        }
+    } // namespace aux
+} // namespace nx_spl
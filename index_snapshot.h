@@ -0,0 +1,99 @@
+#ifndef __S3_INDEX_SNAPSHOT_H__
+#define __S3_INDEX_SNAPSHOT_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+
+namespace nx_spl
+{
+    namespace aux
+    {
+        // Read-only, memory mapped list of a bucket: keys in byte order with
+        // their sizes and ETags, as of one full listing.
+        //
+        // File layout (native byte order, versioned header):
+        //   header     magic "NXSI", version, entry count, listing time, total bytes,
+        //              restart table offset and count
+        //   entries    varint shared prefix length, varint suffix length, suffix,
+        //              varint size, ETag length byte, ETag
+        //   restarts   uint64 offset of every kRestartInterval-th entry, whose
+        //              shared length is 0; lookups bisect these
+        //
+        // Opening costs an mmap, pages are read as lookups touch them.
+        class IndexSnapshot
+        {
+        public:
+            struct Object
+            {
+                std::string key;
+                uint64_t    size;
+                std::string etag;
+            };
+
+            static const uint32_t kVersion = 1;
+            static const size_t   kRestartInterval = 16;
+
+            // objects: sorted by key, unique. Written next to path and renamed over it.
+            static bool write(const std::string& path, const std::vector<Object>& objects, time_t listedAt);
+
+            IndexSnapshot();
+            ~IndexSnapshot();
+
+            IndexSnapshot(const IndexSnapshot&) = delete;
+            IndexSnapshot& operator =(const IndexSnapshot&) = delete;
+
+            // False if path is missing, of another version or damaged
+            bool open(const std::string& path);
+            bool isOpen() const { return m_data != nullptr; }
+
+            uint64_t count() const { return m_count; }
+            uint64_t bytes() const { return m_bytes; }
+            time_t listedAt() const { return m_listedAt; }
+
+            bool find(const std::string& key, Object* object) const;
+            // Up to count keys spread evenly over the snapshot, in order
+            std::vector<std::string> sample(size_t count) const;
+
+            // Forward iteration from a key
+            class Cursor
+            {
+            public:
+                explicit Cursor(const IndexSnapshot& snapshot);
+
+                // First entry with key >= key
+                void seek(const std::string& key);
+                bool valid() const { return m_valid; }
+                void next();
+                const Object& object() const { return m_object; }
+
+            private:
+                bool decode();
+
+            private:
+                const IndexSnapshot&    m_snapshot;
+                uint64_t                m_offset;   // of the next entry
+                bool                    m_valid;
+                Object                  m_object;
+            };
+
+        private:
+            // Key of the restart entry at index i
+            std::string restartKey(uint64_t i) const;
+            uint64_t restartOffset(uint64_t i) const;
+
+        private:
+            const char* m_data;
+            size_t      m_length;
+            uint64_t    m_count;
+            uint64_t    m_bytes;
+            time_t      m_listedAt;
+            uint64_t    m_entriesEnd;   // = restart table offset
+            uint64_t    m_restarts;
+        }; // class IndexSnapshot
+    } // namespace aux
+} // namespace nx_spl
+
+#endif // __S3_INDEX_SNAPSHOT_H__
@@ -0,0 +1,305 @@
+#include "local_store.h"
+
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "plog/Log.h"
+
+namespace nx_spl
+{
+    namespace
+    {
+        const char kSnapshotSuffix[] = ".snap";
+        const char kPartialSuffix[] = ".part";
+        // A file written to this recently is likely mid-transaction, sync(false) leaves it for later
+        const time_t kQuietSec = 2;
+
+        bool endsWith(const std::string& s, const char* suffix)
+        {
+            size_t len = strlen(suffix);
+            return s.size() >= len && s.compare(s.size() - len, len, suffix) == 0;
+        }
+
+        // Keys become flat file names: '/' and '%' are escaped
+        std::string escape(const std::string& key)
+        {
+            std::string name;
+            for (char c : key)
+            {
+                if (c == '/')
+                    name += "%2F";
+                else if (c == '%')
+                    name += "%25";
+                else
+                    name += c;
+            }
+            return name;
+        }
+
+        std::string unescape(const std::string& name)
+        {
+            std::string key;
+            for (size_t i = 0; i < name.size(); i++)
+            {
+                if (name[i] == '%' && name.compare(i, 3, "%2F") == 0)
+                {
+                    key += '/';
+                    i += 2;
+                }
+                else if (name[i] == '%' && name.compare(i, 3, "%25") == 0)
+                {
+                    key += '%';
+                    i += 2;
+                }
+                else
+                {
+                    key += name[i];
+                }
+            }
+            return key;
+        }
+
+        bool copyFile(int in, const std::string& to, uint64_t* size)
+        {
+            FILE* out = fopen(to.c_str(), "wb");
+            if (!out)
+                return false;
+
+            char buffer[64 * 1024];
+            ssize_t got;
+            uint64_t offset = 0;
+            bool ok = true;
+            while (ok && (got = pread(in, buffer, sizeof(buffer), (off_t) offset)) > 0)
+            {
+                ok = fwrite(buffer, 1, (size_t) got, out) == (size_t) got;
+                offset += (uint64_t) got;
+            }
+
+            *size = offset;
+            return fclose(out) == 0 && ok && got == 0;
+        }
+    }
+
+
+    LocalStore::LocalStore(const std::string& dir, const std::string& exts, UploadFunc upload)
+        : m_upload(upload)
+    {
+        size_t start = 0;
+        while (start <= exts.size())
+        {
+            size_t end = exts.find(',', start);
+            if (end == std::string::npos)
+                end = exts.size();
+            if (end > start)
+                m_exts.push_back("." + exts.substr(start, end - start));
+            start = end + 1;
+        }
+
+        struct stat st;
+        if (mkdir(dir.c_str(), 0755) == -1 && (stat(dir.c_str(), &st) == -1 || !S_ISDIR(st.st_mode)))
+        {
+            LOGE << "Couldn't create local store dir:" << dir;
+            return;
+        }
+        // Copies are synced and dropped by their store only
+        m_lock.reset(new aux::DirLock(dir));
+        if (!m_lock->locked())
+            return;
+        m_dir = dir;
+
+        // Copies that were open when the process went down may be ahead of the bucket
+        DIR* d = opendir(m_dir.c_str());
+        while (d)
+        {
+            struct dirent* de = readdir(d);
+            if (!de)
+                break;
+
+            std::string name = de->d_name;
+            if (name == "." || name == ".." || name == aux::DirLock::kFileName)
+                continue;
+            if (endsWith(name, kSnapshotSuffix) || endsWith(name, kPartialSuffix))
+            {
+                std::remove((m_dir + "/" + name).c_str());
+                continue;
+            }
+
+            auto file = entry(unescape(name));
+            file->generation = 1;
+        }
+        if (d)
+            closedir(d);
+    }
+
+
+    bool LocalStore::handles(const std::string& key) const
+    {
+        for (const auto& ext : m_exts)
+            if (endsWith(key, ext.c_str()))
+                return valid();
+        return false;
+    }
+
+
+    std::string LocalStore::path(const std::string& key) const
+    {
+        return m_dir + "/" + escape(key);
+    }
+
+
+    std::string LocalStore::partialPath(const std::string& key) const
+    {
+        return path(key) + kPartialSuffix;
+    }
+
+
+    bool LocalStore::exists(const std::string& key, uint64_t* size) const
+    {
+        struct stat st;
+        if (stat(path(key).c_str(), &st) == -1)
+            return false;
+        if (size)
+            *size = (uint64_t) st.st_size;
+        return true;
+    }
+
+
+    std::shared_ptr<LocalStore::File> LocalStore::entry(const std::string& key)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto& file = m_files[key];
+        if (!file)
+            file = std::make_shared<File>();
+        return file;
+    }
+
+
+    std::shared_ptr<LocalStore::File> LocalStore::open(const std::string& key, bool write)
+    {
+        auto file = entry(key);
+        if (write)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            file->writers++;
+        }
+        return file;
+    }
+
+
+    void LocalStore::close(const std::string& key, const std::shared_ptr<File>& file, bool write)
+    {
+        if (!write)
+            return;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        file->writers--;
+        LOGD << "Local copy closed:" << key << ", generation " << file->generation;
+    }
+
+
+    void LocalStore::remove(const std::string& key)
+    {
+        std::shared_ptr<File> file;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_files.find(key);
+            if (it != m_files.end())
+            {
+                file = it->second;
+                m_files.erase(it);
+            }
+        }
+
+        std::unique_lock<std::mutex> lock;
+        if (file)
+            lock = std::unique_lock<std::mutex>(file->lock);
+        std::remove(path(key).c_str());
+    }
+
+
+    bool LocalStore::rename(const std::string& from, const std::string& to)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_files.find(from);
+        if (it != m_files.end() && it->second->writers > 0)
+            return false;
+
+        if (::rename(path(from).c_str(), path(to).c_str()) != 0)
+            return false;
+
+        // The new key isn't in the bucket yet
+        std::shared_ptr<File> file = std::make_shared<File>();
+        if (it != m_files.end())
+        {
+            file = it->second;
+            m_files.erase(it);
+        }
+        file->generation++;
+        m_files[to] = file;
+        return true;
+    }
+
+
+    bool LocalStore::snapshot(const std::string& key, File& file, std::string* snap, uint64_t* size,
+                              uint64_t* generation)
+    {
+        std::lock_guard<std::mutex> lock(file.lock);
+        int fd = ::open(path(key).c_str(), O_RDONLY);
+        if (fd == -1)
+            return false;
+
+        *generation = file.generation;
+        *snap = path(key) + "." + std::to_string(*generation) + kSnapshotSuffix;
+        bool ok = copyFile(fd, *snap, size);
+        ::close(fd);
+        if (!ok)
+            std::remove(snap->c_str());
+        return ok;
+    }
+
+
+    size_t LocalStore::sync(bool all)
+    {
+        std::lock_guard<std::mutex> syncLock(m_syncMutex);
+
+        std::vector<std::pair<std::string, std::shared_ptr<File>>> files;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            files.assign(m_files.begin(), m_files.end());
+        }
+
+        size_t failed = 0;
+        time_t now = time(nullptr);
+        for (const auto& item : files)
+        {
+            File& file = *item.second;
+            if (file.generation == file.synced || (!all && now - file.changed < kQuietSec))
+                continue;
+
+            std::string snap;
+            uint64_t size = 0, generation = 0;
+            if (!snapshot(item.first, file, &snap, &size, &generation))
+            {
+                LOGE << "Couldn't snapshot local copy:" << item.first;
+                failed++;
+                continue;
+            }
+
+            if (!m_upload(item.first, snap, size))
+            {
+                LOGE << "Couldn't sync local copy:" << item.first;
+                std::remove(snap.c_str());
+                failed++;
+                continue;
+            }
+
+            file.synced = generation;
+            LOGD << "Synced local copy:" << item.first << ", " << size << " bytes";
+        }
+        return failed;
+    }
+} // namespace nx_spl
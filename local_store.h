@@ -0,0 +1,88 @@
+#ifndef __S3_LOCAL_STORE_H__
+#define __S3_LOCAL_STORE_H__
+
+#include <atomic>
+#include <ctime>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "dir_lock.h"
+
+namespace nx_spl
+{
+    // Primary copies of objects that are rewritten in place all the time, the
+    // .nxdb databases. Devices do their I/O on the local file; the bucket gets a
+    // snapshot of each changed file from sync(), which the storage calls on a
+    // schedule and once more at shutdown.
+    //
+    // Files live flat in the store directory, named by the escaped key. Files
+    // found there at startup may be ahead of the bucket and are synced once.
+    class LocalStore
+    {
+    public:
+        // Uploads the snapshot at path as key and disposes of the file, true on success
+        typedef std::function<bool(const std::string& key, const std::string& path, uint64_t size)> UploadFunc;
+
+        // Shared by the devices open on one key. Writers hold lock while they
+        // write, so a snapshot never sees half of a write.
+        struct File
+        {
+            File() : generation(0), synced(0), changed(0), writers(0) {}
+
+            std::mutex              lock;
+            std::atomic<uint64_t>   generation;     // bumped by every write
+            std::atomic<uint64_t>   synced;         // generation in the bucket
+            std::atomic<time_t>     changed;        // time of the last write
+            int                     writers;        // devices open for write, under the store mutex
+        };
+
+        // exts: comma separated extensions kept locally, e.g. "nxdb"
+        LocalStore(const std::string& dir, const std::string& exts, UploadFunc upload);
+
+        LocalStore(const LocalStore&) = delete;
+        LocalStore& operator =(const LocalStore&) = delete;
+
+        // False if the directory couldn't be created, the store is unusable then
+        bool valid() const { return !m_dir.empty(); }
+        // True if key is kept locally
+        bool handles(const std::string& key) const;
+
+        std::string path(const std::string& key) const;
+        // A download of key goes here first and is renamed to path() when complete
+        std::string partialPath(const std::string& key) const;
+        bool exists(const std::string& key, uint64_t* size) const;
+
+        // A device opens / closes the primary copy of key
+        std::shared_ptr<File> open(const std::string& key, bool write);
+        void close(const std::string& key, const std::shared_ptr<File>& file, bool write);
+
+        void remove(const std::string& key);
+        bool rename(const std::string& from, const std::string& to);
+
+        // Uploads a snapshot of every file changed since its last sync.
+        // all = false skips files written to less than a few seconds ago, those
+        // are likely in the middle of a transaction and go next time.
+        // Returns the number of files that couldn't be synced.
+        size_t sync(bool all);
+
+    private:
+        std::shared_ptr<File> entry(const std::string& key);
+        bool snapshot(const std::string& key, File& file, std::string* path, uint64_t* size, uint64_t* generation);
+
+    private:
+        std::string                                     m_dir;
+        std::unique_ptr<aux::DirLock>                   m_lock;
+        std::vector<std::string>                        m_exts;
+        UploadFunc                                      m_upload;
+        mutable std::mutex                              m_mutex;
+        std::map<std::string, std::shared_ptr<File>>    m_files;
+        std::mutex                                      m_syncMutex;    // one sync() at a time
+    }; // class LocalStore
+} // namespace nx_spl
+
+#endif // __S3_LOCAL_STORE_H__
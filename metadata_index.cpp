@@ -0,0 +1,668 @@
+#include "metadata_index.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "plog/Log.h"
+
+namespace nx_spl
+{
+    namespace
+    {
+        const char kSnapshotName[] = "index.snap";
+        const char kLogName[] = "index.log";
+
+        // Changes over the snapshot after which an incremental reconcile writes a new one
+        const size_t kCheckpointChanges = 65536;
+    }
+
+
+    class MetadataIndex::View
+    {
+    public:
+        explicit View(const MetadataIndex& index)
+            : m_cursor(*index.m_snapshot),
+              m_overlay(index.m_overlay),
+              m_it(index.m_overlay.end()),
+              m_cmp(0),
+              m_valid(false)
+        {}
+
+        // First present key >= key
+        void seek(const std::string& key)
+        {
+            m_cursor.seek(key);
+            m_it = m_overlay.lower_bound(key);
+            settle();
+        }
+
+        void next()
+        {
+            if (m_cmp <= 0)
+                m_cursor.next();
+            if (m_cmp >= 0)
+                ++m_it;
+            settle();
+        }
+
+        bool valid() const { return m_valid; }
+        const std::string& key() const { return m_cmp < 0 ? m_cursor.object().key : m_it->first; }
+        uint64_t size() const { return m_cmp < 0 ? m_cursor.object().size : m_it->second.size; }
+        const std::string& etag() const { return m_cmp < 0 ? m_cursor.object().etag : m_it->second.etag; }
+
+    private:
+        // m_cmp < 0: the snapshot entry is current, > 0: the overlay one, 0: both, the overlay wins
+        void settle()
+        {
+            for (;;)
+            {
+                bool snapshot = m_cursor.valid(), overlay = m_it != m_overlay.end();
+                m_valid = snapshot || overlay;
+                if (!m_valid)
+                    return;
+
+                m_cmp = !snapshot ? 1 : !overlay ? -1 : m_cursor.object().key.compare(m_it->first);
+                if (m_cmp < 0 || m_it->second.present)
+                    return;
+
+                if (m_cmp == 0)
+                    m_cursor.next();
+                ++m_it;
+            }
+        }
+
+    private:
+        aux::IndexSnapshot::Cursor                      m_cursor;
+        const std::map<std::string, Change>&            m_overlay;
+        std::map<std::string, Change>::const_iterator   m_it;
+        int                                             m_cmp;
+        bool                                            m_valid;
+    }; // class MetadataIndex::View
+
+
+    MetadataIndex::MetadataIndex(int maxStaleness, const std::string& dir)
+        : m_maxStaleness(maxStaleness),
+          m_dir(dir),
+          m_persistent(false),
+          m_snapshot(new aux::IndexSnapshot()),
+          m_log(nullptr),
+          m_bytes(0),
+          m_listedAt(0),
+          m_finishedAt(0),
+          m_restored(false),
+          m_reconciling(false),
+          m_reconcileStart(0)
+    {}
+
+
+    MetadataIndex::~MetadataIndex()
+    {
+        if (m_log)
+            fclose(m_log);
+    }
+
+
+    bool MetadataIndex::load()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        struct stat st;
+        if (m_dir.empty()
+            || (mkdir(m_dir.c_str(), 0755) == -1 && (stat(m_dir.c_str(), &st) == -1 || !S_ISDIR(st.st_mode))))
+        {
+            LOGE << "Couldn't create metadata index dir:" << m_dir;
+            return false;
+        }
+        m_lock.reset(new aux::DirLock(m_dir));
+        if (!m_lock->locked())
+            return false;
+
+        // A log without its snapshot belongs to nothing
+        std::string logPath = m_dir + "/" + kLogName;
+        if (m_snapshot->open(m_dir + "/" + kSnapshotName))
+        {
+            m_bytes = m_snapshot->bytes();
+            m_listedAt = m_snapshot->listedAt();
+            // However old, the snapshot with its log beats asking the bucket until the first
+            // reconcile of this run is done: listing a big bucket takes a while
+            m_restored = m_listedAt != 0;
+
+            // A line without its newline is torn
+            if (FILE* f = fopen(logPath.c_str(), "r"))
+            {
+                char buf[4096];
+                while (fgets(buf, sizeof(buf), f))
+                {
+                    size_t len = strlen(buf);
+                    if (len == 0 || buf[len - 1] != '\n')
+                        break;
+                    buf[len - 1] = 0;
+                    if (!apply(buf))
+                        LOGE << "Damaged metadata index log line:" << buf;
+                }
+                fclose(f);
+            }
+        }
+        else
+        {
+            ::remove(logPath.c_str());
+        }
+
+        m_log = fopen(logPath.c_str(), "a");
+        if (!m_log)
+        {
+            LOGE << "Couldn't open metadata index log:" << logPath;
+            m_snapshot.reset(new aux::IndexSnapshot());
+            m_overlay.clear();
+            m_bytes = 0;
+            m_listedAt = 0;
+            m_restored = false;
+            return false;
+        }
+
+        m_persistent = true;
+        LOGD << "Metadata index snapshot: " << m_snapshot->count() << " objects, " << m_overlay.size()
+             << " changes since, listed " << (m_snapshot->isOpen() ? time(nullptr) - m_listedAt : -1) << " s ago";
+        return true;
+    }
+
+
+    // Log lines:  P <size> <etag> <key>, D <key>. Both set state, so replaying
+    // the log on top of a state that already has them changes nothing.
+    bool MetadataIndex::apply(const std::string& line)
+    {
+        if (line.compare(0, 2, "D\t") == 0)
+        {
+            set(line.substr(2), Change{false, 0, std::string()}, false);
+            return true;
+        }
+        if (line.compare(0, 2, "P\t") != 0)
+            return false;
+
+        size_t sizeEnd = line.find('\t', 2);
+        size_t etagEnd = sizeEnd == std::string::npos ? sizeEnd : line.find('\t', sizeEnd + 1);
+        if (etagEnd == std::string::npos)
+            return false;
+
+        Change change{true, strtoull(line.c_str() + 2, nullptr, 10), line.substr(sizeEnd + 1, etagEnd - sizeEnd - 1)};
+        set(line.substr(etagEnd + 1), change, false);
+        return true;
+    }
+
+
+    void MetadataIndex::writeLog()
+    {
+        std::string logPath = m_dir + "/" + kLogName;
+        std::string tmp = logPath + ".tmp";
+        if (m_log)
+            fclose(m_log);
+
+        bool ok = false;
+        if (FILE* f = fopen(tmp.c_str(), "w"))
+        {
+            for (const auto& change : m_overlay)
+            {
+                if (change.second.present)
+                    fprintf(f, "P\t%llu\t%s\t%s\n", (unsigned long long) change.second.size,
+                            change.second.etag.c_str(), change.first.c_str());
+                else
+                    fprintf(f, "D\t%s\n", change.first.c_str());
+            }
+            ok = fclose(f) == 0 && ::rename(tmp.c_str(), logPath.c_str()) == 0;
+        }
+        if (!ok)
+            LOGE << "Couldn't rewrite metadata index log:" << logPath;
+
+        m_log = fopen(logPath.c_str(), "a");
+    }
+
+
+    void MetadataIndex::beginReconcile()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_reconciling = true;
+        m_reconcileStart = time(nullptr);
+        m_since.clear();
+    }
+
+
+    void MetadataIndex::finishReconcile(Listing&& objects)
+    {
+        auto byKey = [](const aux::IndexSnapshot::Object& a, const aux::IndexSnapshot::Object& b) {
+            return a.key < b.key;
+        };
+        if (!std::is_sorted(objects.begin(), objects.end(), byKey))
+            std::sort(objects.begin(), objects.end(), byKey);
+
+        // Written and mapped before taking the lock, lookups go on meanwhile
+        std::unique_ptr<aux::IndexSnapshot> snapshot(new aux::IndexSnapshot());
+        if (m_persistent)
+        {
+            std::string path = m_dir + "/" + kSnapshotName;
+            time_t start;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                start = m_reconcileStart;
+            }
+            if (!aux::IndexSnapshot::write(path, objects, start) || !snapshot->open(path))
+                LOGE << "Metadata index snapshot failed, keeping this listing in memory";
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_reconciling)
+            return;
+
+        // Entries the listing disagrees with: changes by other writers, or ours during the listing
+        size_t drift = 0;
+        if (m_listedAt != 0)
+        {
+            View a(*this);
+            a.seek(std::string());
+            auto b = objects.cbegin();
+            while (a.valid() || b != objects.cend())
+            {
+                int cmp = !a.valid() ? 1 : b == objects.cend() ? -1 : a.key().compare(b->key);
+                if (cmp < 0)
+                    a.next();
+                else if (cmp > 0)
+                    ++b;
+                else
+                {
+                    bool same = a.size() == b->size && (a.etag().empty() || b->etag.empty() || a.etag() == b->etag);
+                    a.next();
+                    ++b;
+                    if (same)
+                        continue;
+                }
+                drift++;
+            }
+        }
+
+        m_overlay.clear();
+        m_bytes = 0;
+        if (snapshot->isOpen())
+        {
+            m_snapshot.swap(snapshot);
+            m_bytes = m_snapshot->bytes();
+        }
+        else
+        {
+            m_snapshot.reset(new aux::IndexSnapshot());
+            for (auto& object : objects)
+            {
+                m_bytes += object.size;
+                m_overlay.emplace(std::move(object.key), Change{true, object.size, std::move(object.etag)});
+            }
+        }
+        m_listedAt = m_reconcileStart;
+        m_finishedAt = time(nullptr);
+        m_restored = false;
+        m_reconciling = false;
+
+        // Our own changes during the listing win over what it saw
+        for (const auto& change : m_since)
+            set(change.first, change.second, false);
+        m_since.clear();
+
+        if (m_persistent)
+        {
+            if (m_snapshot->isOpen())
+            {
+                writeLog();
+            }
+            else
+            {
+                // Neither the old snapshot nor its log describe the bucket any more
+                ::remove((m_dir + "/" + kSnapshotName).c_str());
+                // Buffered lines would land after the truncate; if it fails the log is rewritten
+                if (m_log && (fflush(m_log) != 0 || ftruncate(fileno(m_log), 0) != 0))
+                    writeLog();
+            }
+        }
+
+        LOGD << "Metadata index: " << (m_snapshot->count() + m_overlay.size()) << " entries, " << m_bytes
+             << " bytes, " << drift << " reconciled";
+    }
+
+
+    void MetadataIndex::abortReconcile()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_reconciling = false;
+        m_since.clear();
+    }
+
+
+    bool MetadataIndex::lookup(const std::string& key, Change* change) const
+    {
+        auto it = m_overlay.find(key);
+        if (it != m_overlay.end())
+        {
+            *change = it->second;
+            return change->present;
+        }
+
+        aux::IndexSnapshot::Object object;
+        if (!m_snapshot->find(key, &object))
+            return false;
+        *change = Change{true, object.size, std::move(object.etag)};
+        return true;
+    }
+
+
+    void MetadataIndex::set(const std::string& key, const Change& change, bool log)
+    {
+        Change old;
+        if (lookup(key, &old))
+            m_bytes -= old.size;
+        if (change.present)
+            m_bytes += change.size;
+
+        // A deletion only needs remembering over the snapshot
+        if (change.present || m_snapshot->find(key, nullptr))
+            m_overlay[key] = change;
+        else
+            m_overlay.erase(key);
+
+        if (log && m_log)
+        {
+            if (change.present)
+                fprintf(m_log, "P\t%llu\t%s\t%s\n", (unsigned long long) change.size, change.etag.c_str(), key.c_str());
+            else
+                fprintf(m_log, "D\t%s\n", key.c_str());
+            fflush(m_log);
+        }
+    }
+
+
+    void MetadataIndex::change(const std::string& key, const Change& change)
+    {
+        set(key, change, true);
+        if (m_reconciling)
+            m_since[key] = change;
+    }
+
+
+    void MetadataIndex::put(const std::string& key, uint64_t size, const std::string& etag)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        change(key, Change{true, size, etag});
+    }
+
+
+    void MetadataIndex::remove(const std::string& key)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        change(key, Change{false, 0, std::string()});
+    }
+
+
+    void MetadataIndex::rename(const std::string& from, const std::string& to)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Change change;
+        if (!lookup(from, &change))
+            return;
+
+        this->change(from, Change{false, 0, std::string()});
+        this->change(to, change);
+    }
+
+
+    bool MetadataIndex::reconcile(const std::string& key, const Change& listed)
+    {
+        if (m_since.count(key))
+            return false;
+
+        Change old;
+        bool present = lookup(key, &old);
+        if (!listed.present ? !present
+                            : present && old.size == listed.size
+                              && (old.etag.empty() || listed.etag.empty() || old.etag == listed.etag))
+            return false;
+
+        set(key, listed, true);
+        return true;
+    }
+
+
+    size_t MetadataIndex::merge(const std::vector<std::string>& keys, const Listing& listed)
+    {
+        size_t changed = 0;
+        auto a = keys.cbegin();
+        auto b = listed.cbegin();
+        while (a != keys.cend() || b != listed.cend())
+        {
+            if (b == listed.cend() || (a != keys.cend() && *a < b->key))
+            {
+                changed += reconcile(*a++, Change{false, 0, std::string()});
+                continue;
+            }
+            if (a != keys.cend() && *a == b->key)
+                ++a;
+            changed += reconcile(b->key, Change{true, b->size, b->etag});
+            ++b;
+        }
+        return changed;
+    }
+
+
+    size_t MetadataIndex::mergeRange(const std::string& prefix, const std::string& after, const std::string& last,
+                                     const Listing& listed)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_reconciling)
+            return 0;
+
+        // Collected first: merging changes the overlay the view walks
+        std::vector<std::string> keys;
+        View view(*this);
+        view.seek(std::max(prefix, after));
+        if (view.valid() && !after.empty() && view.key() == after)
+            view.next();
+        while (view.valid() && view.key().compare(0, prefix.size(), prefix) == 0
+               && (last.empty() || view.key() <= last))
+        {
+            keys.push_back(view.key());
+            view.next();
+        }
+        return merge(keys, listed);
+    }
+
+
+    size_t MetadataIndex::mergeLevel(const std::string& prefix, const Listing& files, std::set<std::string>* dirs)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_reconciling)
+            return 0;
+
+        Objects objects;
+        level(prefix, &objects, dirs);
+        std::vector<std::string> keys;
+        keys.reserve(objects.size());
+        for (auto& object : objects)
+            keys.push_back(std::move(object.first));
+        return merge(keys, files);
+    }
+
+
+    void MetadataIndex::finishIncremental()
+    {
+        Listing current;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_reconciling)
+                return;
+
+            if (!m_persistent || m_overlay.size() < kCheckpointChanges)
+            {
+                m_listedAt = m_reconcileStart;
+                m_finishedAt = time(nullptr);
+                m_restored = false;
+                m_reconciling = false;
+                m_since.clear();
+                return;
+            }
+
+            View view(*this);
+            for (view.seek(std::string()); view.valid(); view.next())
+                current.push_back(aux::IndexSnapshot::Object{view.key(), view.size(), view.etag()});
+        }
+
+        // Folded into a new snapshot, the log starts over; changes made meanwhile go on top as usual
+        finishReconcile(std::move(current));
+    }
+
+
+    void MetadataIndex::streams(std::vector<Stream>* streams, std::set<std::string>* parents) const
+    {
+        auto addParents = [parents](const std::string& dir) {
+            for (size_t slash = dir.find('/'); slash != std::string::npos; slash = dir.find('/', slash + 1))
+                parents->insert(dir.substr(0, slash + 1));
+            parents->insert(std::string());
+        };
+
+        std::map<std::string, std::string> found;
+        auto current = found.end();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        View view(*this);
+        for (view.seek(std::string()); view.valid(); view.next())
+        {
+            const std::string& key = view.key();
+
+            // First all-digit directory component starts the time ordered part
+            size_t start = 0, slash;
+            while ((slash = key.find('/', start)) != std::string::npos)
+            {
+                if (slash > start && std::all_of(key.begin() + start, key.begin() + slash,
+                                                 [](char c) { return isdigit((unsigned char) c) != 0; }))
+                    break;
+                start = slash + 1;
+            }
+
+            if (slash == std::string::npos)
+            {
+                addParents(key.substr(0, start));
+                continue;
+            }
+
+            // Keys of one stream mostly come in a row
+            if (current == found.end() || current->first.compare(0, std::string::npos, key, 0, start) != 0)
+            {
+                std::string prefix = key.substr(0, start);
+                current = found.find(prefix);
+                if (current == found.end())
+                {
+                    addParents(prefix.substr(0, prefix.empty() ? 0 : prefix.rfind('/', prefix.size() - 2) + 1));
+                    current = found.emplace(prefix, std::string()).first;
+                }
+            }
+            current->second = key;
+        }
+
+        for (auto& stream : found)
+            streams->push_back(Stream{stream.first, stream.second});
+    }
+
+
+    time_t MetadataIndex::listedAt() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_listedAt;
+    }
+
+
+    bool MetadataIndex::fresh() const
+    {
+        // A listing of a big bucket may take longer than maxStaleness: age counts from its end,
+        // and a running one keeps the index answering
+        return m_listedAt != 0
+               && (m_restored || m_reconciling || time(nullptr) - m_finishedAt <= m_maxStaleness);
+    }
+
+
+    bool MetadataIndex::find(const std::string& key, bool* exists, uint64_t* size) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!fresh())
+            return false;
+
+        Change change;
+        *exists = lookup(key, &change);
+        if (size)
+            *size = *exists ? change.size : 0;
+        return true;
+    }
+
+
+    bool MetadataIndex::dirExists(const std::string& dir, bool* exists) const
+    {
+        std::string prefix = dir;
+        if (!prefix.empty() && prefix[prefix.size() - 1] != '/')
+            prefix += '/';
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!fresh())
+            return false;
+
+        View view(*this);
+        view.seek(prefix);
+        *exists = view.valid() && view.key().compare(0, prefix.size(), prefix) == 0;
+        return true;
+    }
+
+
+    bool MetadataIndex::list(const std::string& prefix, Objects* files, std::set<std::string>* dirs) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!fresh())
+            return false;
+
+        level(prefix, files, dirs);
+        return true;
+    }
+
+
+    void MetadataIndex::level(const std::string& prefix, Objects* files, std::set<std::string>* dirs) const
+    {
+        View view(*this);
+        view.seek(prefix);
+        while (view.valid() && view.key().compare(0, prefix.size(), prefix) == 0)
+        {
+            size_t slash = view.key().find('/', prefix.size());
+            if (slash == std::string::npos)
+            {
+                files->push_back(std::make_pair(view.key(), view.size()));
+                view.next();
+                continue;
+            }
+
+            // One entry per subdirectory, then skip past everything under it
+            std::string dir = view.key().substr(0, slash + 1);
+            dirs->insert(dir);
+            std::string next = dir;
+            next[next.size() - 1] = '/' + 1;
+            view.seek(next);
+        }
+    }
+
+
+    bool MetadataIndex::totalSize(uint64_t* bytes) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!fresh())
+            return false;
+        *bytes = m_bytes;
+        return true;
+    }
+
+
+    std::vector<std::string> MetadataIndex::splitPoints(size_t count) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_snapshot->sample(count);
+    }
+} // namespace nx_spl
@@ -0,0 +1,139 @@
+#ifndef __S3_METADATA_INDEX_H__
+#define __S3_METADATA_INDEX_H__
+
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "dir_lock.h"
+#include "index_snapshot.h"
+
+namespace nx_spl
+{
+    // Keys and sizes of the whole bucket, so that fileExists, fileSize,
+    // dirExists and directory listings need no request. It is built from one
+    // full listing, kept current by the storage's own writes, deletes and
+    // renames, and reconciled with a fresh listing in the background.
+    //
+    // Answers are only given while the last full listing finished at most
+    // maxStaleness seconds ago, or while the next one runs; otherwise the query
+    // methods return false and the caller asks the bucket. Changes made while a listing runs are applied on top of its
+    // result, the listing may or may not have seen them.
+    //
+    // With a dir, every listing is kept there as a mapped snapshot (index.snap)
+    // and the changes since as a log (index.log): a restart maps the snapshot,
+    // replays the log and answers at once, however old the snapshot, until the
+    // first reconcile of the new run finishes.
+    // Without one, or if the dir is unusable, everything lives in memory.
+    class MetadataIndex
+    {
+    public:
+        typedef std::vector<std::pair<std::string, uint64_t>> Objects;
+        typedef std::vector<aux::IndexSnapshot::Object> Listing;
+
+        // Keys with a timestamp component ("cam/2024/01/...") grouped by the path
+        // before it. Chunk keys embed their start time, so a stream only grows
+        // at its end and last is where a rescan picks up.
+        struct Stream
+        {
+            std::string prefix;
+            std::string last;
+        };
+
+        MetadataIndex(int maxStaleness, const std::string& dir);
+        ~MetadataIndex();
+
+        MetadataIndex(const MetadataIndex&) = delete;
+        MetadataIndex& operator =(const MetadataIndex&) = delete;
+
+        // Maps the last snapshot and replays the log. False if dir is unusable or
+        // held by another index, the index then stays in memory only.
+        bool load();
+
+        // Around a full listing: begin first, then finish with its result or abort
+        void beginReconcile();
+        void finishReconcile(Listing&& objects);
+        void abortReconcile();
+
+        // A reconcile may also be made of partial listings, merged one by one and
+        // ended with finishIncremental(). Keys changed by put/remove/rename since
+        // beginReconcile() are left alone. Both return the number of keys changed.
+        //
+        // Keys under prefix in (after, last] become exactly listed (sorted); last empty - no bound
+        size_t mergeRange(const std::string& prefix, const std::string& after, const std::string& last,
+                          const Listing& listed);
+        // Keys right under prefix become exactly files (sorted); dirs gets its subdirectories
+        size_t mergeLevel(const std::string& prefix, const Listing& files, std::set<std::string>* dirs);
+        // The index then counts as listed at beginReconcile()
+        void finishIncremental();
+
+        // Streams, and the directories above them or holding keys of no stream
+        void streams(std::vector<Stream>* streams, std::set<std::string>* parents) const;
+        time_t listedAt() const;
+
+        void put(const std::string& key, uint64_t size, const std::string& etag = std::string());
+        void remove(const std::string& key);
+        void rename(const std::string& from, const std::string& to);
+
+        // False if the index can't answer: never loaded or stale
+        bool find(const std::string& key, bool* exists, uint64_t* size) const;
+        bool dirExists(const std::string& dir, bool* exists) const;
+        // Keys right under prefix, and the next path component ("sub/") of deeper ones
+        bool list(const std::string& prefix, Objects* files, std::set<std::string>* dirs) const;
+        bool totalSize(uint64_t* bytes) const;
+        // Keys of the last listing cutting it into about count even parts, for
+        // listing the bucket in parallel. Empty without a snapshot.
+        std::vector<std::string> splitPoints(size_t count) const;
+
+    private:
+        struct Change
+        {
+            bool        present;
+            uint64_t    size;
+            std::string etag;
+        };
+
+        // Snapshot with the overlay on top, deleted keys skipped
+        class View;
+
+        bool fresh() const;
+        bool lookup(const std::string& key, Change* change) const;
+        void set(const std::string& key, const Change& change, bool log);
+        // Our own change: logged and kept over a running reconcile
+        void change(const std::string& key, const Change& change);
+        // Listed state of key, unless we changed it since the reconcile began
+        bool reconcile(const std::string& key, const Change& listed);
+        size_t merge(const std::vector<std::string>& keys, const Listing& listed);
+        void level(const std::string& prefix, Objects* files, std::set<std::string>* dirs) const;
+        bool apply(const std::string& line);
+        void writeLog();
+
+    private:
+        const int                           m_maxStaleness;
+        const std::string                   m_dir;
+        std::unique_ptr<aux::DirLock>       m_lock;         // of m_dir, from load() on
+        bool                                m_persistent;
+        mutable std::mutex                  m_mutex;
+        std::unique_ptr<aux::IndexSnapshot> m_snapshot;     // last listing, empty if not persistent
+        std::map<std::string, Change>       m_overlay;      // changes since, everything if not persistent
+        FILE*                               m_log;
+        uint64_t                            m_bytes;
+        time_t                              m_listedAt;     // start of the last complete listing, 0 - none
+        time_t                              m_finishedAt;   // and its end
+        bool                                m_restored;     // loaded from the snapshot, not reconciled since
+
+        // While a listing runs: what changed since it started
+        bool                                m_reconciling;
+        time_t                              m_reconcileStart;
+        std::map<std::string, Change>       m_since;
+    }; // class MetadataIndex
+} // namespace nx_spl
+
+#endif // __S3_METADATA_INDEX_H__
@@ -0,0 +1,611 @@
+#include "pack_store.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "plog/Log.h"
+
+namespace nx_spl
+{
+    namespace
+    {
+        const char kPackSuffix[] = ".pack";
+        const char kLogName[] = "index.log";
+
+        bool readFile(const std::string& path, std::vector<char>* data)
+        {
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd == -1)
+                return false;
+
+            struct stat st;
+            bool ok = fstat(fd, &st) == 0;
+            if (ok)
+            {
+                data->resize((size_t) st.st_size);
+                ok = pread(fd, data->data(), data->size(), 0) == (ssize_t) data->size();
+            }
+            close(fd);
+            return ok;
+        }
+
+        // "<id>.pack" -> id, 0 if name isn't a pack
+        uint64_t packId(const std::string& name)
+        {
+            size_t len = sizeof(kPackSuffix) - 1;
+            if (name.size() <= len || name.compare(name.size() - len, len, kPackSuffix) != 0)
+                return 0;
+
+            char* end = nullptr;
+            uint64_t id = strtoull(name.c_str(), &end, 10);
+            return end == name.c_str() + name.size() - len ? id : 0;
+        }
+    }
+
+
+    const char PackStore::kIndexName[] = "index";
+
+
+    std::string PackStore::packName(uint64_t id)
+    {
+        return std::to_string(id) + kPackSuffix;
+    }
+
+
+    PackStore::PackStore(const std::string& dir, uint64_t packSize, int maxAge, double minLive,
+                         PutFunc put, GetFunc get, RemoveFunc remove)
+        : m_dir(dir),
+          m_packSize(packSize),
+          m_maxAge(maxAge),
+          m_minLive(minLive),
+          m_put(put),
+          m_get(get),
+          m_remove(remove),
+          m_next(1),
+          m_dirty(false),
+          m_log(nullptr),
+          m_open(0),
+          m_openFd(-1),
+          m_openSince(0)
+    {}
+
+
+    PackStore::~PackStore()
+    {
+        closePack();
+        if (m_log)
+            fclose(m_log);
+    }
+
+
+    bool PackStore::load(const std::string& index)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        std::istringstream lines(index);
+        std::string line;
+        while (std::getline(lines, line))
+        {
+            if (!line.empty() && !apply(line, false))
+            {
+                LOGE << "Damaged pack index line:" << line;
+                return false;
+            }
+        }
+
+        struct stat st;
+        if (mkdir(m_dir.c_str(), 0755) == -1 && (stat(m_dir.c_str(), &st) == -1 || !S_ISDIR(st.st_mode)))
+        {
+            LOGE << "Couldn't create pack dir:" << m_dir;
+            return false;
+        }
+        // Another store on the dir would append to our packs and log and drop packs it didn't seal
+        m_lock.reset(new aux::DirLock(m_dir));
+        if (!m_lock->locked())
+            return false;
+
+        // Changes the uploaded index doesn't have yet; a line without its newline is torn
+        std::string logPath = m_dir + "/" + kLogName;
+        if (FILE* f = fopen(logPath.c_str(), "r"))
+        {
+            char buf[4096];
+            while (fgets(buf, sizeof(buf), f))
+            {
+                size_t len = strlen(buf);
+                if (len == 0 || buf[len - 1] != '\n')
+                    break;
+                buf[len - 1] = 0;
+                m_dirty = apply(buf, true) || m_dirty;
+            }
+            fclose(f);
+        }
+
+        // Packs that never made it to the bucket
+        if (DIR* d = opendir(m_dir.c_str()))
+        {
+            while (struct dirent* de = readdir(d))
+            {
+                uint64_t id = packId(de->d_name);
+                if (id == 0 || stat(localPath(id).c_str(), &st) == -1)
+                    continue;
+
+                Pack& pack = m_packs[id];
+                pack.size = (uint64_t) st.st_size;
+                m_local.insert(id);
+                if (pack.live == 0)
+                {
+                    ::remove(localPath(id).c_str());
+                    m_local.erase(id);
+                    m_packs.erase(id);
+                }
+            }
+            closedir(d);
+        }
+
+        // Uploaded packs whose index line was lost with a restart
+        for (const auto& entry : m_entries)
+        {
+            Pack& pack = m_packs[entry.second.pack];
+            pack.size = std::max(pack.size, entry.second.offset + entry.second.size);
+        }
+
+        for (const auto& pack : m_packs)
+            m_next = std::max(m_next, pack.first + 1);
+        for (uint64_t id : m_garbage)
+            m_next = std::max(m_next, id + 1);
+
+        m_log = fopen(logPath.c_str(), "a");
+        if (!m_log)
+            LOGE << "Couldn't open pack log:" << logPath;
+
+        LOGD << "Pack index: " << m_entries.size() << " objects in " << m_packs.size() << " packs, "
+             << m_local.size() << " local";
+        return m_log != nullptr;
+    }
+
+
+    // Index lines:  P <id> <size>, E <pack> <offset> <size> <mtime> <key>
+    // Log lines add D <key> and G <id>. All of them set state, so replaying
+    // any tail of the log on top of a later state changes nothing.
+    bool PackStore::apply(const std::string& line, bool replay)
+    {
+        std::vector<std::string> fields;
+        size_t start = 0;
+        while (fields.size() < 5)
+        {
+            size_t tab = line.find('\t', start);
+            if (tab == std::string::npos)
+                break;
+            fields.push_back(line.substr(start, tab - start));
+            start = tab + 1;
+        }
+        fields.push_back(line.substr(start));
+
+        const std::string& op = fields[0];
+        if (op == "P" && fields.size() == 3)
+        {
+            m_packs[strtoull(fields[1].c_str(), nullptr, 10)].size = strtoull(fields[2].c_str(), nullptr, 10);
+            return true;
+        }
+        if (op == "E" && fields.size() == 6)
+        {
+            Entry entry;
+            entry.pack = strtoull(fields[1].c_str(), nullptr, 10);
+            entry.offset = strtoull(fields[2].c_str(), nullptr, 10);
+            entry.size = strtoull(fields[3].c_str(), nullptr, 10);
+            entry.mtime = (time_t) strtoll(fields[4].c_str(), nullptr, 10);
+            put(fields[5], entry);
+            return true;
+        }
+        if (replay && op == "D" && fields.size() == 2)
+        {
+            drop(fields[1]);
+            return true;
+        }
+        if (replay && op == "G" && fields.size() == 2)
+        {
+            uint64_t id = strtoull(fields[1].c_str(), nullptr, 10);
+            m_packs.erase(id);
+            m_garbage.insert(id);
+            return true;
+        }
+        return false;
+    }
+
+
+    void PackStore::log(const std::string& line)
+    {
+        m_dirty = true;
+        if (m_log && (fputs((line + "\n").c_str(), m_log) < 0 || fflush(m_log) != 0))
+            LOGE << "Couldn't write pack log";
+    }
+
+
+    static std::string entryLine(const std::string& key, const PackStore::Entry& entry)
+    {
+        return "E\t" + std::to_string(entry.pack) + "\t" + std::to_string(entry.offset) + "\t"
+               + std::to_string(entry.size) + "\t" + std::to_string((long long) entry.mtime) + "\t" + key;
+    }
+
+
+    void PackStore::put(const std::string& key, const Entry& entry)
+    {
+        drop(key);
+        m_entries[key] = entry;
+        m_packs[entry.pack].live += entry.size;
+    }
+
+
+    void PackStore::drop(const std::string& key)
+    {
+        auto it = m_entries.find(key);
+        if (it == m_entries.end())
+            return;
+
+        auto pack = m_packs.find(it->second.pack);
+        if (pack != m_packs.end())
+            pack->second.live -= std::min(pack->second.live, it->second.size);
+        m_entries.erase(it);
+    }
+
+
+    std::string PackStore::localPath(uint64_t id) const
+    {
+        return m_dir + "/" + packName(id);
+    }
+
+
+    bool PackStore::openPack()
+    {
+        uint64_t id = m_next++;
+        int fd = open(localPath(id).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1)
+        {
+            LOGE << "Couldn't create local pack:" << localPath(id);
+            return false;
+        }
+
+        m_open = id;
+        m_openFd = fd;
+        m_openSince = time(nullptr);
+        m_packs[id] = Pack{0, 0};
+        m_local.insert(id);
+        return true;
+    }
+
+
+    void PackStore::closePack()
+    {
+        if (m_openFd != -1)
+            close(m_openFd);
+        m_openFd = -1;
+        m_open = 0;
+    }
+
+
+    bool PackStore::add(const std::string& key, const char* data, uint64_t size)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_log || (m_open == 0 && !openPack()))
+            return false;
+
+        Pack& pack = m_packs[m_open];
+        Entry entry{m_open, pack.size, size, time(nullptr)};
+        if (size && pwrite(m_openFd, data, (size_t) size, (off_t) entry.offset) != (ssize_t) size)
+        {
+            LOGE << "Couldn't append to local pack:" << localPath(m_open);
+            return false;
+        }
+
+        pack.size += size;
+        put(key, entry);
+        log(entryLine(key, entry));
+        return true;
+    }
+
+
+    bool PackStore::find(const std::string& key, Entry* entry) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_entries.find(key);
+        if (it == m_entries.end())
+            return false;
+        if (entry)
+            *entry = it->second;
+        return true;
+    }
+
+
+    bool PackStore::read(const std::string& key, std::vector<char>* data) const
+    {
+        // A local pack may be uploaded and deleted, a pack rewritten, while we read
+        for (int attempt = 0; attempt < 2; attempt++)
+        {
+            Entry entry;
+            bool local;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                auto it = m_entries.find(key);
+                if (it == m_entries.end())
+                    return false;
+                entry = it->second;
+                local = m_local.count(entry.pack) != 0;
+            }
+
+            data->resize((size_t) entry.size);
+            if (entry.size == 0)
+                return true;
+
+            if (local)
+            {
+                int fd = open(localPath(entry.pack).c_str(), O_RDONLY);
+                bool ok = fd != -1 && pread(fd, data->data(), data->size(), (off_t) entry.offset) == (ssize_t) entry.size;
+                if (fd != -1)
+                    close(fd);
+                if (ok)
+                    return true;
+            }
+            else if (m_get(packName(entry.pack), entry.offset, entry.size, data->data()))
+            {
+                return true;
+            }
+        }
+        LOGE << "Couldn't read packed object:" << key;
+        return false;
+    }
+
+
+    bool PackStore::remove(const std::string& key)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_entries.find(key) == m_entries.end())
+            return false;
+
+        drop(key);
+        log("D\t" + key);
+        return true;
+    }
+
+
+    bool PackStore::rename(const std::string& from, const std::string& to)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_entries.find(from);
+        if (it == m_entries.end())
+            return false;
+
+        // Logged as delete + entry, a plain rename wouldn't replay on top of later state
+        Entry entry = it->second;
+        drop(from);
+        put(to, entry);
+        log("D\t" + from);
+        log(entryLine(to, entry));
+        return true;
+    }
+
+
+    void PackStore::list(const std::string& prefix, std::vector<std::pair<std::string, Entry>>* files,
+                         std::set<std::string>* dirs) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto it = m_entries.lower_bound(prefix);
+             it != m_entries.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+        {
+            size_t slash = it->first.find('/', prefix.size());
+            if (slash == std::string::npos)
+                files->push_back(*it);
+            else
+                dirs->insert(it->first.substr(0, slash + 1));
+        }
+    }
+
+
+    bool PackStore::referenced(const std::string& name) const
+    {
+        if (name == kIndexName)
+            return true;
+
+        uint64_t id = packId(name);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return id != 0 && (m_packs.count(id) || m_garbage.count(id));
+    }
+
+
+    std::string PackStore::serialize(bool local) const
+    {
+        std::string out;
+        if (!local)
+        {
+            for (const auto& pack : m_packs)
+                if (!m_local.count(pack.first))
+                    out += "P\t" + std::to_string(pack.first) + "\t" + std::to_string(pack.second.size) + "\n";
+        }
+        for (const auto& entry : m_entries)
+            if ((m_local.count(entry.second.pack) != 0) == local)
+                out += entryLine(entry.first, entry.second) + "\n";
+        return out;
+    }
+
+
+    bool PackStore::rewriteLog()
+    {
+        std::string content = serialize(true);
+        for (uint64_t id : m_garbage)
+            content += "G\t" + std::to_string(id) + "\n";
+
+        std::string path = m_dir + "/" + kLogName;
+        std::string tmp = path + ".tmp";
+        FILE* f = fopen(tmp.c_str(), "w");
+        bool ok = f && fputs(content.c_str(), f) >= 0;
+        if (f)
+            ok = fclose(f) == 0 && ok;
+        if (!ok || ::rename(tmp.c_str(), path.c_str()) != 0)
+        {
+            ::remove(tmp.c_str());
+            return false;
+        }
+
+        if (m_log)
+            fclose(m_log);
+        m_log = fopen(path.c_str(), "a");
+        return m_log != nullptr;
+    }
+
+
+    bool PackStore::seal(bool force)
+    {
+        std::lock_guard<std::mutex> sealLock(m_sealMutex);
+
+        std::vector<uint64_t> pending;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_open != 0 && (force || m_packs[m_open].size >= m_packSize
+                                || time(nullptr) - m_openSince >= m_maxAge))
+                closePack();
+            for (uint64_t id : m_local)
+                if (id != m_open)
+                    pending.push_back(id);
+        }
+
+        // Packs first: the index must never point at a pack that isn't there
+        bool ok = true;
+        for (uint64_t id : pending)
+        {
+            std::vector<char> data;
+            if (!readFile(localPath(id), &data) || !m_put(packName(id), data.data(), data.size()))
+            {
+                LOGE << "Couldn't upload pack:" << packName(id);
+                ok = false;
+                continue;
+            }
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_local.erase(id);
+            ::remove(localPath(id).c_str());
+            m_dirty = true;
+            LOGD << "Pack uploaded:" << packName(id) << ", " << data.size() << " bytes";
+        }
+        if (!ok)
+            return false;
+
+        std::string index;
+        std::set<uint64_t> garbage;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_dirty)
+                return true;
+            index = serialize(false);
+            garbage = m_garbage;
+            m_dirty = false;
+        }
+
+        if (!m_put(kIndexName, index.data(), index.size()))
+        {
+            LOGE << "Couldn't upload pack index";
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_dirty = true;
+            return false;
+        }
+
+        // Nothing refers to rewritten packs any more
+        for (uint64_t id : garbage)
+        {
+            if (!m_remove(packName(id)))
+                continue;
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_garbage.erase(id);
+        }
+
+        // The log keeps what the uploaded index doesn't have: objects in local
+        // packs, undeleted garbage and whatever changed during the upload
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_dirty && !rewriteLog())
+            LOGE << "Couldn't truncate pack log";
+        return true;
+    }
+
+
+    size_t PackStore::collect()
+    {
+        std::lock_guard<std::mutex> sealLock(m_sealMutex);
+
+        std::vector<std::pair<uint64_t, uint64_t>> sparse;    // id, size
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (const auto& pack : m_packs)
+            {
+                if (!m_local.count(pack.first) && pack.second.size > 0
+                    && (double) pack.second.live < m_minLive * (double) pack.second.size)
+                    sparse.push_back(std::make_pair(pack.first, pack.second.size));
+            }
+        }
+
+        size_t rewritten = 0;
+        for (const auto& item : sparse)
+        {
+            uint64_t id = item.first;
+            std::vector<char> data;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                auto pack = m_packs.find(id);
+                if (pack == m_packs.end())
+                    continue;
+                // Whole pack in one GET, unless nothing in it is alive
+                if (pack->second.live > 0)
+                    data.resize((size_t) item.second);
+            }
+            if (!data.empty() && !m_get(packName(id), 0, data.size(), data.data()))
+            {
+                LOGE << "Couldn't fetch pack for rewrite:" << packName(id);
+                continue;
+            }
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            std::vector<std::pair<std::string, Entry>> live;
+            for (const auto& entry : m_entries)
+                if (entry.second.pack == id)
+                    live.push_back(entry);
+
+            bool ok = true;
+            for (const auto& entry : live)
+            {
+                if (m_open == 0 && !openPack())
+                {
+                    ok = false;
+                    break;
+                }
+
+                Pack& pack = m_packs[m_open];
+                Entry moved{m_open, pack.size, entry.second.size, entry.second.mtime};
+                if (entry.second.offset + entry.second.size > data.size()
+                    || pwrite(m_openFd, data.data() + entry.second.offset, (size_t) moved.size,
+                              (off_t) moved.offset) != (ssize_t) moved.size)
+                {
+                    ok = false;
+                    break;
+                }
+                pack.size += moved.size;
+                put(entry.first, moved);
+                log(entryLine(entry.first, moved));
+            }
+            if (!ok)
+            {
+                LOGE << "Couldn't rewrite pack:" << packName(id);
+                continue;
+            }
+
+            m_packs.erase(id);
+            m_garbage.insert(id);
+            log("G\t" + std::to_string(id));
+            rewritten++;
+            LOGD << "Pack rewritten:" << packName(id) << ", " << live.size() << " live objects";
+        }
+        return rewritten;
+    }
+} // namespace nx_spl
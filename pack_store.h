@@ -0,0 +1,129 @@
+#ifndef __S3_PACK_STORE_H__
+#define __S3_PACK_STORE_H__
+
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "dir_lock.h"
+
+namespace nx_spl
+{
+    // Small objects (*_db_ref.guid, info.txt) packed into larger pack objects,
+    // so that one PUT carries many of them. A pack is named <id>.pack and holds
+    // object bodies back to back; the index object maps every packed key to
+    // its pack, offset and size. Names are relative to the storage's pack prefix.
+    //
+    // add() appends to a local pack file and returns; seal() uploads local packs
+    // that are full or old enough and then the index. Every change of the index
+    // since its last upload is also appended to a log in the local directory and
+    // replayed by load(), so nothing added is lost to a restart.
+    //
+    // collect() moves the live objects of packs that are mostly dead into the
+    // open pack; the old packs are deleted once an index without them is up.
+    class PackStore
+    {
+    public:
+        // Object I/O under the pack prefix, true on success
+        typedef std::function<bool(const std::string& name, const char* data, uint64_t size)> PutFunc;
+        typedef std::function<bool(const std::string& name, uint64_t offset, uint64_t size, char* dst)> GetFunc;
+        typedef std::function<bool(const std::string& name)> RemoveFunc;
+
+        struct Entry
+        {
+            uint64_t    pack;
+            uint64_t    offset;
+            uint64_t    size;
+            time_t      mtime;
+        };
+
+        static const char kIndexName[];
+        static std::string packName(uint64_t id);
+
+        // dir: local packs and the log
+        // packSize: a local pack is sealed once it is this big
+        // maxAge: ... or its first object is this old (s)
+        // minLive: packs with less than this fraction of live bytes are rewritten by collect()
+        PackStore(const std::string& dir, uint64_t packSize, int maxAge, double minLive,
+                  PutFunc put, GetFunc get, RemoveFunc remove);
+        ~PackStore();
+
+        PackStore(const PackStore&) = delete;
+        PackStore& operator =(const PackStore&) = delete;
+
+        // index: content of the index object, empty if there is none yet.
+        // False if it is damaged or the local directory is unusable or held by another store.
+        bool load(const std::string& index);
+
+        bool add(const std::string& key, const char* data, uint64_t size);
+        bool find(const std::string& key, Entry* entry) const;
+        // One ranged GET, or a local read while the pack isn't uploaded
+        bool read(const std::string& key, std::vector<char>* data) const;
+        bool remove(const std::string& key);
+        bool rename(const std::string& from, const std::string& to);
+
+        // Packed keys right under prefix, and the next path component ("sub/") of deeper ones
+        void list(const std::string& prefix, std::vector<std::pair<std::string, Entry>>* files,
+                  std::set<std::string>* dirs) const;
+        // True for the index and for packs it or the log refers to
+        bool referenced(const std::string& name) const;
+
+        // Uploads local packs that are full or old (all of them with force), then the index.
+        // False if something is left for the next call.
+        bool seal(bool force);
+        // Rewrites mostly dead packs, returns how many
+        size_t collect();
+
+    private:
+        struct Pack
+        {
+            uint64_t    size;
+            uint64_t    live;
+        };
+
+        bool apply(const std::string& line, bool replay);
+        void log(const std::string& line);
+        bool openPack();
+        void closePack();
+        void put(const std::string& key, const Entry& entry);
+        void drop(const std::string& key);
+        std::string localPath(uint64_t id) const;
+        std::string serialize(bool local) const;
+        bool rewriteLog();
+
+    private:
+        const std::string   m_dir;
+        const uint64_t      m_packSize;
+        const int           m_maxAge;
+        const double        m_minLive;
+        PutFunc             m_put;
+        GetFunc             m_get;
+        RemoveFunc          m_remove;
+        std::unique_ptr<aux::DirLock>       m_lock;         // of m_dir, from load() on
+
+        mutable std::mutex                  m_mutex;
+        std::mutex                          m_sealMutex;    // one seal() or collect() at a time
+        std::map<std::string, Entry>        m_entries;
+        std::map<uint64_t, Pack>            m_packs;
+        std::set<uint64_t>                  m_local;        // not uploaded yet, files in m_dir
+        std::set<uint64_t>                  m_garbage;      // rewritten, deleted after the next index upload
+        uint64_t                            m_next;
+        bool                                m_dirty;        // index object is behind
+        FILE*                               m_log;
+
+        // The pack add() appends to, 0 - none
+        uint64_t                            m_open;
+        int                                 m_openFd;
+        time_t                              m_openSince;
+    }; // class PackStore
+} // namespace nx_spl
+
+#endif // __S3_PACK_STORE_H__
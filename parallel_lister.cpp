@@ -0,0 +1,238 @@
+#include "parallel_lister.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <queue>
+#include <thread>
+
+#include "plog/Log.h"
+
+namespace nx_spl
+{
+    namespace aux
+    {
+        namespace
+        {
+            // Waiting ranges per worker beyond which common prefixes are listed flat
+            const size_t kFanout = 4;
+        }
+
+
+        ParallelLister::ParallelLister(PageFunc page, int workers)
+            : m_page(page),
+              m_workers(std::max(workers, 1)),
+              m_results(nullptr),
+              m_limit(0),
+              m_active(0),
+              m_successes(0),
+              m_failed(false),
+              m_requests(0)
+        {}
+
+
+        bool ParallelLister::list(const std::string& prefix, const std::vector<std::string>& splits,
+                                  std::vector<Object>* objects)
+        {
+            reset();
+
+            std::string marker;
+            for (const auto& split : splits)
+            {
+                if (split.compare(0, prefix.size(), prefix) != 0 || split.size() == prefix.size() || split <= marker)
+                    continue;
+                m_ranges.push_back(Range{prefix, marker, split, false, kNoScan, 0});
+                marker = split;
+            }
+            m_ranges.push_back(Range{prefix, marker, std::string(), m_ranges.empty(), kNoScan, 0});
+
+            if (!drain())
+            {
+                LOGE << "Couldn't list bucket, prefix:" << prefix;
+                return false;
+            }
+
+            merge(objects);
+            LOGD << "Listed " << objects->size() << " objects under '" << prefix << "' with " << m_requests
+                 << " requests";
+            return true;
+        }
+
+
+        bool ParallelLister::scan(const std::vector<Scan>& scans, std::vector<Result>* results)
+        {
+            reset();
+            results->assign(scans.size(), Result());
+            for (size_t i = 0; i < scans.size(); i++)
+            {
+                const Scan& s = scans[i];
+                m_ranges.push_back(Range{s.prefix, s.marker, std::string(), s.delimit, i, s.pages});
+                (*results)[i].complete = true;
+            }
+
+            m_results = results;
+            bool ok = drain();
+            m_results = nullptr;
+            if (!ok)
+            {
+                LOGE << "Couldn't scan bucket, " << scans.size() << " ranges";
+                return false;
+            }
+            LOGD << "Scanned " << scans.size() << " ranges with " << m_requests << " requests";
+            return true;
+        }
+
+
+        void ParallelLister::reset()
+        {
+            m_ranges.clear();
+            m_runs.clear();
+            m_limit = m_workers;
+            m_active = 0;
+            m_successes = 0;
+            m_failed = false;
+            m_requests = 0;
+        }
+
+
+        bool ParallelLister::drain()
+        {
+            std::vector<std::thread> threads;
+            for (int i = 0; i < m_workers; i++)
+                threads.emplace_back([this]{ run(); });
+            for (auto& t : threads)
+                t.join();
+            return !m_failed;
+        }
+
+
+        void ParallelLister::run()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (true)
+            {
+                m_cond.wait(lock, [this]{
+                    return m_failed || (m_ranges.empty() && m_active == 0) || (!m_ranges.empty() && m_active < m_limit);
+                });
+                if (m_failed || m_ranges.empty())
+                    return;
+
+                Range range = std::move(m_ranges.front());
+                m_ranges.pop_front();
+                m_active++;
+                lock.unlock();
+
+                Page page;
+                bool ok = fetch(range, &page);
+
+                lock.lock();
+                m_active--;
+                if (!ok)
+                {
+                    m_failed = true;
+                    m_cond.notify_all();
+                    return;
+                }
+                if (++m_successes >= m_limit)
+                {
+                    m_successes = 0;
+                    m_limit = std::min(m_limit + 1, m_workers);
+                }
+
+                // Keys past the end of the range are the next range's
+                bool done = page.next.empty();
+                if (!range.last.empty())
+                {
+                    auto end = std::upper_bound(page.objects.begin(), page.objects.end(), range.last,
+                                                [](const std::string& last, const Object& o) { return last < o.key; });
+                    done = done || end != page.objects.end() || page.next >= range.last;
+                    page.objects.erase(end, page.objects.end());
+                }
+                if (range.scan != kNoScan)
+                {
+                    // Pages of one scan come one after another, appending keeps them in order
+                    Result& result = (*m_results)[range.scan];
+                    std::move(page.objects.begin(), page.objects.end(), std::back_inserter(result.objects));
+                    std::move(page.prefixes.begin(), page.prefixes.end(), std::back_inserter(result.prefixes));
+                    if (!done && range.pages == 1)
+                    {
+                        result.complete = false;
+                        done = true;
+                    }
+                    if (!done)
+                        m_ranges.push_front(Range{range.prefix, page.next, range.last, range.delimit, range.scan,
+                                                  range.pages == 0 ? 0 : range.pages - 1});
+                    m_cond.notify_all();
+                    continue;
+                }
+
+                if (!page.objects.empty())
+                    m_runs.push_back(std::move(page.objects));
+
+                // Continuations first: the longest range bounds the whole listing
+                if (!done)
+                    m_ranges.push_front(Range{range.prefix, page.next, range.last, range.delimit, kNoScan, 0});
+                for (auto& sub : page.prefixes)
+                {
+                    bool explore = m_ranges.size() < kFanout * m_workers;
+                    m_ranges.push_back(Range{std::move(sub), std::string(), std::string(), explore, kNoScan, 0});
+                }
+                m_cond.notify_all();
+            }
+        }
+
+
+        bool ParallelLister::fetch(const Range& range, Page* page)
+        {
+            for (int attempt = 1; ; attempt++)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_requests++;
+                }
+
+                bool retryable = false;
+                if (m_page(range.prefix, range.marker, range.delimit, page, &retryable))
+                    return true;
+                if (!retryable || attempt == kAttempts)
+                    return false;
+
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_limit = std::max(m_limit / 2, 1);
+                    m_successes = 0;
+                }
+                *page = Page();
+                std::this_thread::sleep_for(std::chrono::milliseconds(250 * attempt));
+            }
+        }
+
+
+        void ParallelLister::merge(std::vector<Object>* objects)
+        {
+            typedef std::pair<size_t, size_t> Cursor;     // run, position
+            auto greater = [this](const Cursor& a, const Cursor& b) {
+                return m_runs[a.first][a.second].key > m_runs[b.first][b.second].key;
+            };
+            std::priority_queue<Cursor, std::vector<Cursor>, decltype(greater)> heads(greater);
+
+            size_t total = 0;
+            for (size_t i = 0; i < m_runs.size(); i++)
+            {
+                total += m_runs[i].size();
+                heads.push(Cursor(i, 0));
+            }
+
+            objects->reserve(objects->size() + total);
+            while (!heads.empty())
+            {
+                Cursor c = heads.top();
+                heads.pop();
+                objects->push_back(std::move(m_runs[c.first][c.second]));
+                if (++c.second < m_runs[c.first].size())
+                    heads.push(c);
+            }
+            m_runs.clear();
+        }
+    } // namespace aux
+} // namespace nx_spl
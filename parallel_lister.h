@@ -0,0 +1,124 @@
+#ifndef __S3_PARALLEL_LISTER_H__
+#define __S3_PARALLEL_LISTER_H__
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace nx_spl
+{
+    namespace aux
+    {
+        // Lists everything under a prefix with several requests in flight. A plain
+        // listing is one page per round trip, following the marker; here the key
+        // space is cut into disjoint ranges that are paged concurrently:
+        //
+        //  - prefix fan-out: a prefix is listed with the "/" delimiter, its files
+        //    are kept and every common prefix becomes a range of its own. Once
+        //    enough ranges wait, further common prefixes are listed flat instead
+        //    of being explored, which costs no extra request per directory.
+        //  - split points: keys known to cut the prefix into even parts, such as a
+        //    sample of the last listing. The ranges between them are listed flat
+        //    right away, with no discovery.
+        //
+        // Every page is a sorted run; the runs are merged into key order at the end.
+        // scan() instead lists a set of given ranges, each with its own result.
+        //
+        // Concurrency starts at the worker count, halves when a request fails
+        // with a retryable error (throttling, network) and grows back by one per
+        // window of successful pages.
+        class ParallelLister
+        {
+        public:
+            struct Object
+            {
+                std::string key;
+                uint64_t    size;
+                std::string etag;
+            };
+
+            struct Page
+            {
+                std::vector<Object>         objects;
+                std::vector<std::string>    prefixes;   // with delimit only
+                std::string                 next;       // marker of the next page, empty - last
+            };
+
+            // One request: keys under prefix greater than marker, grouped by "/"
+            // if delimit. On failure retryable tells whether trying again may help.
+            typedef std::function<bool(const std::string& prefix, const std::string& marker, bool delimit,
+                                       Page* page, bool* retryable)> PageFunc;
+
+            static const int kAttempts = 4;
+
+            ParallelLister(PageFunc page, int workers);
+
+            ParallelLister(const ParallelLister&) = delete;
+            ParallelLister& operator =(const ParallelLister&) = delete;
+
+            // False if a page couldn't be listed, objects is then incomplete.
+            // splits: sorted, may be empty.
+            bool list(const std::string& prefix, const std::vector<std::string>& splits, std::vector<Object>* objects);
+
+            struct Scan
+            {
+                std::string prefix;
+                std::string marker;     // keys after it, empty - from the start
+                size_t      pages;      // at most, 0 - all
+                bool        delimit;
+            };
+
+            struct Result
+            {
+                std::vector<Object>         objects;    // in key order
+                std::vector<std::string>    prefixes;
+                bool                        complete;   // false - stopped by pages, more keys follow
+            };
+
+            // Lists every scan, results[i] is for scans[i]. False if a page couldn't be listed.
+            bool scan(const std::vector<Scan>& scans, std::vector<Result>* results);
+
+        private:
+            static const size_t kNoScan = (size_t) -1;
+
+            // Keys under prefix in (marker, last], last empty - no upper bound
+            struct Range
+            {
+                std::string prefix;
+                std::string marker;
+                std::string last;
+                bool        delimit;
+                size_t      scan;       // index of its scan, kNoScan - part of list()
+                size_t      pages;      // left, 0 - all
+            };
+
+            void reset();
+            bool drain();
+            void run();
+            bool fetch(const Range& range, Page* page);
+            void merge(std::vector<Object>* objects);
+
+        private:
+            const PageFunc                  m_page;
+            const int                       m_workers;
+
+            std::mutex                      m_mutex;
+            std::condition_variable         m_cond;
+            std::deque<Range>               m_ranges;
+            std::vector<std::vector<Object>> m_runs;
+            std::vector<Result>*            m_results;
+            int                             m_limit;    // current concurrency
+            int                             m_active;
+            int                             m_successes;
+            bool                            m_failed;
+            uint64_t                        m_requests;
+        }; // class ParallelLister
+    } // namespace aux
+} // namespace nx_spl
+
+#endif // __S3_PARALLEL_LISTER_H__
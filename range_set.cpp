@@ -0,0 +1,68 @@
+#include "range_set.h"
+
+#include <algorithm>
+#include <iterator>
+
+namespace nx_spl
+{
+    namespace aux
+    {
+        void RangeSet::add(uint64_t from, uint64_t to)
+        {
+            if (from >= to)
+                return;
+
+            auto it = m_ranges.upper_bound(from);
+            if (it != m_ranges.begin())
+            {
+                auto prev = std::prev(it);
+                if (prev->second >= from)
+                {
+                    from = prev->first;
+                    to = std::max(to, prev->second);
+                    it = m_ranges.erase(prev);
+                }
+            }
+
+            while (it != m_ranges.end() && it->first <= to)
+            {
+                to = std::max(to, it->second);
+                it = m_ranges.erase(it);
+            }
+
+            m_ranges[from] = to;
+        }
+
+        bool RangeSet::intersects(uint64_t from, uint64_t to) const
+        {
+            if (from >= to)
+                return false;
+
+            auto it = m_ranges.upper_bound(from);
+            if (it != m_ranges.begin() && std::prev(it)->second > from)
+                return true;
+            return it != m_ranges.end() && it->first < to;
+        }
+
+        std::vector<RangeSet::Range> RangeSet::gaps(uint64_t from, uint64_t to) const
+        {
+            std::vector<Range> result;
+            uint64_t pos = from;
+
+            auto it = m_ranges.upper_bound(from);
+            if (it != m_ranges.begin())
+                pos = std::max(pos, std::prev(it)->second);
+
+            for (; it != m_ranges.end() && it->first < to; ++it)
+            {
+                if (it->first > pos)
+                    result.emplace_back(pos, it->first);
+                pos = std::max(pos, it->second);
+            }
+
+            if (pos < to)
+                result.emplace_back(pos, to);
+            return result;
+        }
+    } // namespace aux
+} // namespace nx_spl
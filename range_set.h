@@ -0,0 +1,33 @@
+#ifndef __S3_RANGE_SET_H__
+#define __S3_RANGE_SET_H__
+
+#include <cstdint>
+#include <map>
+#include <utility>
+#include <vector>
+
+namespace nx_spl
+{
+    namespace aux
+    {
+        // Set of byte ranges [from, to), kept as disjoint, non adjacent intervals.
+        class RangeSet
+        {
+        public:
+            typedef std::pair<uint64_t, uint64_t> Range;
+
+            void add(uint64_t from, uint64_t to);
+            bool intersects(uint64_t from, uint64_t to) const;
+            // Pieces of [from, to) that are not in the set
+            std::vector<Range> gaps(uint64_t from, uint64_t to) const;
+
+            bool empty() const { return m_ranges.empty(); }
+            void clear() { m_ranges.clear(); }
+
+        private:
+            std::map<uint64_t, uint64_t> m_ranges;  // from -> to
+        }; // class RangeSet
+    } // namespace aux
+} // namespace nx_spl
+
+#endif // __S3_RANGE_SET_H__
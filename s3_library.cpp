@@ -6,15 +6,31 @@
 #include <cstdio>
 #include <cassert>
 #include <cstdlib>
+#include <map>
+#include <set>
+#include <condition_variable>
 #include <libs3.h>
 #include "plog/Log.h"
 
 #ifdef __linux__
 #   include <sys/stat.h>
+#   include <fcntl.h>
+#   include <unistd.h>
 #endif
 
 
 #include "s3_library.h"
+#include "worker_pool.h"
+#include "block_cache.h"
+#include "disk_cache.h"
+#include "upload_queue.h"
+#include "token_bucket.h"
+#include "compression.h"
+#include "checksum.h"
+#include "upload_journal.h"
+#include "pack_store.h"
+#include "metadata_index.h"
+#include "parallel_lister.h"
 
 #ifdef _MSC_VER
 #   define NOEXCEPT
@@ -26,6 +42,8 @@ struct BaseContext {
     explicit BaseContext(bool& error, void* child = nullptr) : error(error), child(child){
         static int last_id = 0;
         status = S3StatusOK;
+        content_length = 0;
+        logical_size = 0;
 
         id = last_id++;
         //LOGD << "Create request:" << last_id;
@@ -37,6 +55,12 @@ struct BaseContext {
     int id;
     void* child;
     S3Status status;
+    std::string etag;           // ETag response header, quotes included
+    uint64_t content_length;    // Content-Length response header
+    std::string crc32c;         // x-amz-meta-crc32c and x-amz-meta-crc32c-parts, if the
+    std::string crc32c_parts;   // object was uploaded with them
+    std::string encoding;       // x-amz-meta-encoding and x-amz-meta-logical-size
+    uint64_t logical_size;      // of compressed objects
 };
 
 
@@ -46,6 +70,22 @@ S3Status responsePropertiesCallback(
     /*if(callbackData) {
         LOGD << "Response on request:" << ((BaseContext*)callbackData)->id;
     }*/
+    if(callbackData && properties) {
+        auto context = (BaseContext *) callbackData;
+        if(properties->eTag)
+            context->etag = properties->eTag;
+        context->content_length = properties->contentLength;
+        for (int i = 0; i < properties->metaDataCount; i++) {
+            if (strcmp(properties->metaData[i].name, "crc32c") == 0)
+                context->crc32c = properties->metaData[i].value;
+            else if (strcmp(properties->metaData[i].name, "crc32c-parts") == 0)
+                context->crc32c_parts = properties->metaData[i].value;
+            else if (strcmp(properties->metaData[i].name, "encoding") == 0)
+                context->encoding = properties->metaData[i].value;
+            else if (strcmp(properties->metaData[i].name, "logical-size") == 0)
+                context->logical_size = strtoull(properties->metaData[i].value, nullptr, 10);
+        }
+    }
     return S3StatusOK;
 }
 
@@ -81,6 +121,7 @@ struct MyFileInfo {
     std::string url;
     uint64_t size;
     bool is_dir;
+    std::string etag;
 };
     struct TreeItem {
         MyFileInfo info;
@@ -210,10 +251,12 @@ struct ListServiceContext {
 };
 
 struct IterateFilesContext {
-    IterateFilesContext(std::vector<MyFileInfo>& files, std::string& marker) : files(files), marker(marker) {}
+    IterateFilesContext(std::vector<MyFileInfo>& files, std::string& marker)
+        : files(files), marker(marker), truncated(false) {}
 
     std::vector<MyFileInfo>& files;
     std::string& marker;
+    bool truncated;
 };
 
 static S3Status listServiceCallback(
@@ -269,6 +312,8 @@ static S3Status listBucketCallback(
         file_info.size = content->size;
         file_info.url  = content->key;
         file_info.is_dir = false;
+        if (content->eTag)
+            file_info.etag = content->eTag;
         //LOGD << content->key << ":" <<content->size;
         context->files.push_back(file_info);
     }
@@ -282,9 +327,21 @@ static S3Status listBucketCallback(
         context->files.push_back(file_info);
     }
     //LOGD << contentsCount;
+    context->truncated = isTruncated;
     if(isTruncated){
-        context->marker = nextMarker;
- //       LOGD << "Truncated:" << nextMarker;
+        // S3 sends NextMarker only with a delimiter, otherwise the last key is the marker
+        if (nextMarker && *nextMarker) {
+            context->marker = nextMarker;
+        } else {
+            std::string last;
+            if (contentsCount > 0)
+                last = contents[contentsCount - 1].key;
+            if (commonPrefixesCount > 0 && last < commonPrefixes[commonPrefixesCount - 1])
+                last = commonPrefixes[commonPrefixesCount - 1];
+            if (!last.empty())
+                context->marker = last;
+        }
+ //       LOGD << "Truncated:" << context->marker;
     } else {
         context->marker = "";
     }
@@ -297,6 +354,7 @@ typedef struct put_object_callback_data
 {
     FILE *infile;
     uint64_t contentLength;
+    nx_spl::aux::TokenBucket *throttle;     // may be null
 } put_object_callback_data;
 
 
@@ -328,12 +386,120 @@ static int putObjectDataCallback(int bufferSize, char *buffer, void *callbackDat
     if (data->contentLength) {
         int toRead = ((data->contentLength > (unsigned) bufferSize) ? (unsigned) bufferSize : data->contentLength);
         ret = fread(buffer, 1, toRead, data->infile);
+        if (ret > 0 && data->throttle)
+            data->throttle->consume(ret);
     }
     data->contentLength -= ret;
     return ret;
 }
 
 
+// Upload source for multipart parts and commit XML: memory or a range of a file.
+struct PutBuffer {
+    PutBuffer(const char* data, uint64_t size) : data(data), fd(-1), offset(0), left(size), throttle(nullptr){}
+    PutBuffer(int fd, uint64_t offset, uint64_t size) : data(nullptr), fd(fd), offset(offset), left(size), throttle(nullptr){}
+
+    const char* data;
+    int fd;
+    uint64_t offset;
+    uint64_t left;
+    nx_spl::aux::TokenBucket *throttle;     // may be null
+};
+
+
+static int putBufferDataCallback(int bufferSize, char *buffer, void *callbackData)
+{
+    BaseContext* base_context = (BaseContext*)callbackData;
+    if(!base_context || !base_context->child)
+        return -1;
+
+
+    PutBuffer* context = (PutBuffer*)base_context->child;
+    int toCopy = (context->left > (unsigned) bufferSize) ? bufferSize : (int)context->left;
+    if (context->data) {
+        memcpy(buffer, context->data, toCopy);
+        context->data += toCopy;
+    } else if (toCopy > 0) {
+        ssize_t got = pread(context->fd, buffer, toCopy, context->offset);
+        if (got <= 0)
+            return -1;
+        toCopy = (int) got;
+        context->offset += toCopy;
+    }
+    if (toCopy > 0 && context->throttle)
+        context->throttle->consume(toCopy);
+    context->left -= toCopy;
+    return toCopy;
+}
+
+
+static S3Status multipartInitialCallback(const char *upload_id, void *callbackData)
+{
+    BaseContext* base_context = (BaseContext*)callbackData;
+    if(!base_context || !base_context->child)
+        return S3StatusAbortedByCallback;
+
+
+    *(std::string*)base_context->child = upload_id;
+    return S3StatusOK;
+}
+
+
+struct ListUploadsContext
+{
+    struct Upload
+    {
+        std::string key;
+        std::string upload_id;
+        int64_t     initiated;
+    };
+
+    std::vector<Upload>                 uploads;
+    std::string                         key_marker;
+    std::string                         upload_id_marker;
+    bool                                truncated = false;
+};
+
+
+static S3Status listMultipartUploadsCallback(
+        int isTruncated,
+        const char *nextKeyMarker,
+        const char *nextUploadIdMarker,
+        int uploadsCount,
+        const S3ListMultipartUpload *uploads,
+        int commonPrefixesCount,
+        const char **commonPrefixes,
+        void *callbackData)
+{
+    (void) commonPrefixesCount;
+    (void) commonPrefixes;
+    BaseContext* base_context = (BaseContext*)callbackData;
+    if(!base_context || !base_context->child)
+        return S3StatusAbortedByCallback;
+
+    auto* context = (ListUploadsContext*)base_context->child;
+    for (int i = 0; i < uploadsCount; i++) {
+        if (uploads[i].key && uploads[i].uploadId)
+            context->uploads.push_back({uploads[i].key, uploads[i].uploadId, uploads[i].initiated});
+    }
+
+    context->truncated = isTruncated != 0;
+    context->key_marker = nextKeyMarker ? nextKeyMarker : "";
+    context->upload_id_marker = nextUploadIdMarker ? nextUploadIdMarker : "";
+    return S3StatusOK;
+}
+
+
+static S3Status multipartCommitCallback(const char *location, const char *etag, void *callbackData)
+{
+    (void) location;
+    BaseContext* base_context = (BaseContext*)callbackData;
+    if(base_context && etag)
+        base_context->etag = etag;
+    return S3StatusOK;
+}
+
+
 
 
 
@@ -341,11 +507,14 @@ static int putObjectDataCallback(int bufferSize, char *buffer, void *callbackDat
 namespace nx_spl
 {
     struct GetObject :public BaseContext {
-        explicit GetObject(FILE* file, bool& error) : BaseContext(error), file(file){}
+        explicit GetObject(FILE* file, bool& error, aux::SegmentCrc* crc = nullptr, aux::Md5* md5 = nullptr)
+            : BaseContext(error), file(file), crc(crc), md5(md5){}
         virtual ~GetObject() {};
 
 
         FILE* file;
+        aux::SegmentCrc* crc;   // optional, fed with the bytes as they are written
+        aux::Md5* md5;
     };
     static S3Status getObjectDataCallback(int bufferSize, const char *buffer, void *callbackData)
     {
@@ -355,6 +524,12 @@ namespace nx_spl
         FILE *outfile = context->file;
         size_t wrote = fwrite(buffer, 1, bufferSize, outfile);
 
+        // Verification rides on the bytes while they are in cache anyway
+        if (context->crc)
+            context->crc->update(buffer, wrote);
+        if (context->md5)
+            context->md5->update(buffer, wrote);
+
 
 //        LOGD << "callback write:" << wrote;
         return ((wrote < (size_t) bufferSize) ? S3StatusAbortedByCallback : S3StatusOK);
@@ -367,12 +542,88 @@ namespace nx_spl
                     &getObjectDataCallback
             };
 
-    static void
-    collectFiles(const std::string &access_key, const std::string &secret_key, const std::string &bucket_name,
-                 const std::string &host, std::vector<MyFileInfo> &files, const char *prefix,
-                 const char *delimiter) {
-        S3BucketContext bucketContext;
+    struct GetBuffer :public BaseContext {
+        GetBuffer(char* dst, uint64_t size, bool& error, const std::atomic<bool>* cancelled = nullptr)
+            : BaseContext(error), dst(dst), size(size), filled(0), cancelled(cancelled){}
+        virtual ~GetBuffer() {};
+
+
+        char* dst;
+        uint64_t size;
+        uint64_t filled;
+        const std::atomic<bool>* cancelled;
+    };
+    static S3Status getBufferDataCallback(int bufferSize, const char *buffer, void *callbackData)
+    {
+        GetBuffer* context = (GetBuffer*)callbackData;
+
+
+        if (context->filled + bufferSize > context->size)
+            return S3StatusAbortedByCallback;
+
+        if (context->cancelled && *context->cancelled)
+            return S3StatusAbortedByCallback;
 
+        memcpy(context->dst + context->filled, buffer, bufferSize);
+        context->filled += bufferSize;
+        return S3StatusOK;
+    }
+
+
+    static S3GetObjectHandler getBufferHandler =
+            {
+                    responseHandler,
+                    &getBufferDataCallback
+            };
+
+    struct GetToFile :public BaseContext {
+        GetToFile(int fd, uint64_t offset, uint64_t size, bool& error, uint32_t* crc = nullptr)
+            : BaseContext(error), fd(fd), offset(offset), size(size), filled(0), crc(crc){}
+        virtual ~GetToFile() {};
+
+
+        int fd;
+        uint64_t offset;
+        uint64_t size;
+        uint64_t filled;
+        uint32_t* crc;      // optional, CRC32C continued with every byte written
+    };
+    static S3Status getToFileDataCallback(int bufferSize, const char *buffer, void *callbackData)
+    {
+        GetToFile* context = (GetToFile*)callbackData;
+
+
+        if (context->filled + bufferSize > context->size)
+            return S3StatusAbortedByCallback;
+
+        ssize_t wrote = pwrite(context->fd, buffer, bufferSize, context->offset + context->filled);
+        if (wrote != bufferSize)
+            return S3StatusAbortedByCallback;
+
+        if (context->crc)
+            *context->crc = aux::crc32c(*context->crc, buffer, bufferSize);
+
+        context->filled += bufferSize;
+        return S3StatusOK;
+    }
+
+
+    static S3GetObjectHandler getToFileHandler =
+            {
+                    responseHandler,
+                    &getToFileDataCallback
+            };
+
+    // Smallest part size S3 accepts for all parts but the last one
+    static const uint64_t kMinPartSize = 5 * 1024 * 1024;
+    // Largest object a single PUT may carry
+    static const uint64_t kMaxPutSize = 5ULL * 1024 * 1024 * 1024;
+    // Attempts made for a single multipart request before giving up
+    static const int kMultipartRetries = 3;
+
+    static void fillBucketContext(
+            S3BucketContext &bucketContext, const std::string &access_key, const std::string &secret_key,
+            const std::string &host, const std::string &bucket_name) {
         bucketContext.accessKeyId       = access_key.c_str();
         bucketContext.secretAccessKey   = secret_key.c_str();
         bucketContext.authRegion        = nullptr;
@@ -381,146 +632,1228 @@ namespace nx_spl
         bucketContext.protocol          = S3ProtocolHTTPS;
         bucketContext.uriStyle          = S3UriStylePath;
         bucketContext.securityToken     = nullptr;
+    }
+
+    // x-amz-meta-encoding of objects stored as aux::compressFile() output
+    static const char kCompressedEncoding[] = "zstd-seekable";
+    // Compressed copy of a staged file, next to it
+    static const char kPackedSuffix[] = ".zst";
+    // Prefix of an object that decides whether it compresses
+    static const size_t kCompressSample = 64 * 1024;
+
+    // Content-MD5 (base64) and x-amz-meta-crc32c (hex) of a request, either may be empty
+    // and x-amz-meta-crc32c-parts (aux::ObjectChecksums::formatParts), for downloads to check.
+    // logical: size before compression of a compressed body, 0 - not compressed
+    struct PutChecksums {
+        PutChecksums(const std::string &md5, const std::string &crc32c, const std::string &parts = std::string(),
+                     uint64_t logical = 0)
+            : md5(md5), crc32c(crc32c), parts(parts), logical(logical ? std::to_string(logical) : std::string())
+        {
+            memset(&properties, 0, sizeof(properties));
+            properties.expires = -1;
+            properties.cannedAcl = S3CannedAclPrivate;
+            properties.md5 = this->md5.empty() ? nullptr : this->md5.c_str();
+
+            if (!this->crc32c.empty()) {
+                meta[properties.metaDataCount].name = "crc32c";
+                meta[properties.metaDataCount++].value = this->crc32c.c_str();
+            }
+            if (!this->parts.empty()) {
+                meta[properties.metaDataCount].name = "crc32c-parts";
+                meta[properties.metaDataCount++].value = this->parts.c_str();
+            }
+            if (!this->logical.empty()) {
+                meta[properties.metaDataCount].name = "encoding";
+                meta[properties.metaDataCount++].value = kCompressedEncoding;
+                meta[properties.metaDataCount].name = "logical-size";
+                meta[properties.metaDataCount++].value = this->logical.c_str();
+            }
+            properties.metaData = meta;
+        }
 
+        PutChecksums(const PutChecksums&) = delete;
+        PutChecksums& operator =(const PutChecksums&) = delete;
 
-        S3ListBucketHandler listBucketHandler =
+        std::string md5;
+        std::string crc32c;
+        std::string parts;
+        std::string logical;
+        S3NameValue meta[4];
+        S3PutProperties properties;
+    };
+
+    // Segment CRCs of a finalized digest as x-amz-meta-crc32c-parts
+    static std::string partsValue(const aux::UploadDigest *digest)
+    {
+        if (!digest)
+            return std::string();
+
+        std::vector<uint32_t> crcs;
+        for (size_t i = 0; i < digest->segments(); i++)
+            crcs.push_back(digest->segmentCrc(i));
+        return aux::ObjectChecksums::formatParts(digest->segmentSize(), crcs);
+    }
+
+    // The server checks Content-MD5 itself, the ETag is compared on top of it. Buckets with
+    // SSE-KMS don't return MD5 ETags, so a mismatch is only reported.
+    static void checkEtag(const std::string &key, const std::string &what, const std::string &etag,
+                          const std::string &expected)
+    {
+        if (!expected.empty() && !aux::etagEquals(etag, expected))
+            LOGE << "ETag mismatch on " << what << " of " << key << ": " << etag << ", expected " << expected;
+    }
+
+    static bool initiateMultipart(S3BucketContext &bucketContext, const std::string &key, std::string &upload_id,
+                                  S3PutProperties *properties = nullptr)
+    {
+        S3MultipartInitialHandler handler =
                 {
                         responseHandler,
-                        &listBucketCallback
+                        &multipartInitialCallback
                 };
-        std::string marker;
-        do {
-            bool error = false;
 
-            IterateFilesContext context(files, marker);
-            BaseContext base_context(error, &context);
+        for (int attempt = 0; attempt < kMultipartRetries; attempt++) {
+            bool error = false;
+            upload_id.clear();
+            BaseContext context(error, &upload_id);
 
-            S3_list_bucket(&bucketContext, prefix, marker.empty() ? nullptr : marker.c_str(), delimiter, 1000000, nullptr, 10000, &listBucketHandler,
-                           &base_context);
+            S3_initiate_multipart(&bucketContext, key.c_str(), properties, &handler, nullptr, 60000, &context);
+            if (!error && !upload_id.empty())
+                return true;
 
-            if (error) {
-                LOGE << "Couldn't list bucket";
+            if (!S3_status_is_retryable(context.status))
                 break;
-            }
+        }
 
-            if(marker.empty())
-                break;
-        }while(true);
+        LOGE << "Couldn't initiate multipart upload:" << key;
+        return false;
     }
-    namespace aux
+
+    static bool uploadPart(S3BucketContext &bucketContext, const std::string &key, const std::string &upload_id,
+                           int part_number, const PutBuffer &source, std::string &etag,
+                           const aux::Md5::Digest *md5 = nullptr)
     {
-// Scoped file remover
-        class FileRemover
-        {
-        public:
-            FileRemover(const std::string& fname) :
-                    m_fname(fname)
-            {}
+        PutChecksums checksums(md5 ? aux::Md5::toBase64(*md5) : std::string(), std::string());
 
-            ~FileRemover()
-            {
-                std::remove(m_fname.c_str());
+        S3PutObjectHandler handler =
+                {
+                        responseHandler,
+                        &putBufferDataCallback
+                };
+
+        for (int attempt = 0; attempt < kMultipartRetries; attempt++) {
+            bool error = false;
+            PutBuffer buffer(source);
+            BaseContext context(error, &buffer);
+
+            S3_upload_part(&bucketContext, key.c_str(), &checksums.properties, &handler, part_number, upload_id.c_str(),
+                           (int) source.left, nullptr, 120000, &context);
+            if (!error && !context.etag.empty()) {
+                etag = context.etag;
+                if (md5)
+                    checkEtag(key, "part " + std::to_string(part_number), etag, aux::Md5::toHex(*md5));
+                return true;
             }
-        private:
-            std::string m_fname;
-        };
 
-// Generates pseudo-random string for use as unique file name
-// Strictly speaking, the uniquness is not guaranteed, so delete files as soon as possible.
-        std::string getRandomFileName()
-        {
-            std::stringstream randomStringStream;
-            randomStringStream << std::hex << std::rand() << std::rand();
+            if (!S3_status_is_retryable(context.status))
+                break;
+        }
 
+        LOGE << "Couldn't upload part " << part_number << " of " << key;
+        return false;
+    }
 
-            return randomStringStream.str();
+    // UploadPartCopy: the part is taken from [start, start + size) of the current
+    // version of key on the server, nothing goes over the wire
+    static bool copyPart(S3BucketContext &bucketContext, const std::string &key, const std::string &upload_id,
+                         int part_number, uint64_t start, uint64_t size, std::string &etag)
+    {
+        for (int attempt = 0; attempt < kMultipartRetries; attempt++) {
+            bool error = false;
+            BaseContext context(error);
+            char etag_buf[256] = {};
+
+            S3_copy_object_range(&bucketContext, key.c_str(), bucketContext.bucketName, key.c_str(),
+                                 part_number, upload_id.c_str(), (unsigned long) start, (unsigned long) size,
+                                 nullptr, nullptr, sizeof(etag_buf), etag_buf, nullptr, 120000,
+                                 &responseHandler, &context);
+            if (!error && etag_buf[0]) {
+                etag = etag_buf;
+                return true;
+            }
+
+            if (!S3_status_is_retryable(context.status))
+                break;
         }
 
+        LOGE << "Couldn't copy part " << part_number << " of " << key;
+        return false;
+    }
+
+    // expected: ETag the object should get, aux::multipartEtag() of the part MD5s, if known
+    static bool completeMultipart(S3BucketContext &bucketContext, const std::string &key,
+                                  const std::string &upload_id, const std::vector<std::string> &etags,
+                                  const std::string &expected = std::string())
+    {
+        std::string xml = "<CompleteMultipartUpload>";
+        for (size_t i = 0; i < etags.size(); i++)
+            xml += "<Part><PartNumber>" + std::to_string(i + 1) + "</PartNumber><ETag>" + etags[i] + "</ETag></Part>";
+        xml += "</CompleteMultipartUpload>";
 
-// Cut dir name from file name and return both.
-        void dirFromUri(
-                const std::string   &uri, // In
-                std::string         *dir, // Out. directory name
-                std::string         *file // Out. file name
-        )
-        {
-            std::string::size_type pos;
-            if ((pos = uri.rfind('/')) == std::string::npos)
-            {   // Here we think that '/' is the only path separator.
-                // Maybe generally it is not very reliable.
-                *dir = ".";
-                *file = uri;
-            }
-            else
-            {
-                dir->assign(uri.begin(), uri.begin() + pos);
-                if (pos < uri.size() - 1) // if file name is not empty
-                    file->assign(uri.begin() + pos + 1, uri.end());
+        S3MultipartCommitHandler handler =
+                {
+                        responseHandler,
+                        &putBufferDataCallback,
+                        &multipartCommitCallback
+                };
+
+        for (int attempt = 0; attempt < kMultipartRetries; attempt++) {
+            bool error = false;
+            PutBuffer buffer(xml.data(), xml.size());
+            BaseContext context(error, &buffer);
+
+            S3_complete_multipart_upload(&bucketContext, key.c_str(), &handler, upload_id.c_str(),
+                                         (int) xml.size(), nullptr, 120000, &context);
+            if (!error) {
+                checkEtag(key, "completion", context.etag, expected);
+                return true;
             }
+
+            if (!S3_status_is_retryable(context.status))
+                break;
         }
 
+        LOGE << "Couldn't complete multipart upload:" << key;
+        return false;
+    }
 
+    // Ranged GET of [start, start + size) into dst. Short bodies count as failures.
+    // etag, if known, pins the range with If-Match: an object overwritten since fails the read.
+    static bool getRange(const S3BucketContext &bucketContext, const std::string &key, const std::string &etag,
+                         uint64_t start, uint64_t size, char *dst,
+                         const std::atomic<bool> *cancelled = nullptr)
+    {
+        S3GetConditions conditions;
+        conditions.ifModifiedSince      = -1;
+        conditions.ifNotModifiedSince   = -1;
+        conditions.ifMatchETag          = etag.c_str();
+        conditions.ifNotMatchETag       = nullptr;
 
+        for (int attempt = 0; attempt < kMultipartRetries; attempt++) {
+            bool error = false;
+            GetBuffer context(dst, size, error, cancelled);
 
-// Checks if remote file exists. Bases on MLSD command response parsing.
-/*        bool remoteFileExists(const std::string& access_key, const std::string& secret_key, const std::string& host, const std::string& bucket_name, const std::string& uri)
-        {
-            LOGD << "Check if remote exists";
-            std::string file = url2key(uri);
-            file = removePostfix(file);
+            S3_get_object(&bucketContext, key.c_str(), etag.empty() ? nullptr : &conditions, start, size, nullptr,
+                          60000, &getBufferHandler, &context);
+            if (!error && context.filled == size)
+                return true;
+
+            if (!error) {
+                LOGE << "Short read " << context.filled << " of " << size << " at " << start << " from " << key;
+            } else if (context.status == S3StatusErrorPreconditionFailed) {
+                LOGE << "Object changed since it was opened:" << key;
+                break;
+            } else if (!S3_status_is_retryable(context.status)) {
+                break;
+            }
+        }
 
+        return false;
+    }
 
-            std::vector<MyFileInfo> files;
-            collectFiles(access_key, secret_key, bucket_name, host, files, nullptr);
+    // Ranged GET of [start, start + size) written at the same offset of fd.
+    // A retry resumes where the previous attempt stopped; If-Match keeps all ranges on one version.
+    // crc, if given, gets the CRC32C of the range as received
+    static bool getRangeToFile(const S3BucketContext &bucketContext, const std::string &key, const std::string &etag,
+                               uint64_t start, uint64_t size, int fd, uint32_t *crc = nullptr)
+    {
+        if (crc)
+            *crc = 0;
 
+        S3GetConditions conditions;
+        conditions.ifModifiedSince      = -1;
+        conditions.ifNotModifiedSince   = -1;
+        conditions.ifMatchETag          = etag.empty() ? nullptr : etag.c_str();
+        conditions.ifNotMatchETag       = nullptr;
 
+        uint64_t done = 0;
+        for (int attempt = 0; attempt < kMultipartRetries && done < size; attempt++) {
+            bool error = false;
+            GetToFile context(fd, start + done, size - done, error, crc);
 
+            S3_get_object(&bucketContext, key.c_str(), &conditions, start + done, size - done, nullptr, 120000,
+                          &getToFileHandler, &context);
+            done += context.filled;
 
-            std::string dir;
+            if (error && !S3_status_is_retryable(context.status))
+                break;
+        }
 
+        return done == size;
+    }
 
-            if(files.empty()) {
-                return 0;
+    // [0, size) of the object into fd as chunk sized ranges pulled by up to `workers` threads.
+    // crcs, if given, gets the CRC32C of every chunk.
+    static bool parallelDownload(const S3BucketContext &bucketContext, const std::string &key, const std::string &etag,
+                                 uint64_t size, int fd, uint64_t chunk, int workers,
+                                 std::vector<uint32_t> *crcs = nullptr)
+    {
+        if (crcs)
+            crcs->assign((size + chunk - 1) / chunk, 0);
+
+        std::atomic<uint64_t> next(0);
+        std::atomic<bool> failed(false);
+
+        auto worker = [&] {
+            while (!failed) {
+                uint64_t start = next.fetch_add(chunk);
+                if (start >= size)
+                    break;
+
+                uint32_t *crc = crcs ? &(*crcs)[start / chunk] : nullptr;
+                if (!getRangeToFile(bucketContext, key, etag, start, std::min(chunk, size - start), fd, crc)) {
+                    LOGE << "Couldn't get range at " << start << " of " << key;
+                    failed = true;
+                }
             }
+        };
 
+        uint64_t chunks = (size + chunk - 1) / chunk;
+        std::vector<std::thread> threads;
+        for (uint64_t i = 1; i < std::min<uint64_t>(workers, chunks); i++)
+            threads.emplace_back(worker);
+        worker();
 
+        for (auto &t : threads)
+            t.join();
+        return !failed;
+    }
 
+    // Compares the CRCs taken while [0, size) was downloaded into fd, one per segment,
+    // with the ones the object was uploaded with. Segments that don't match are fetched
+    // again on their own; with only the whole object CRC known, everything is.
+    static bool verifyDownload(const S3BucketContext &bucketContext, const std::string &key, const std::string &etag,
+                               uint64_t size, int fd, const aux::ObjectChecksums &expected, uint64_t segment,
+                               const std::vector<uint32_t> &crcs)
+    {
+        uint64_t count = (size + segment - 1) / segment;
 
-            auto result = std::find_if(files.begin(), files.end(), [file](const MyFileInfo& info){
-                return info.url == file;
-            });
-            return result != files.end();
-        }
-*/
-// set error code to initial state (NoError generally if storage is available)
-        error::code_t checkECode(
-                int            *checked,                // ecode to set
-                const int       avail,                  // pass result of getAvail here
-                error::code_t   toSet = error::NoError  // default ecode
-        )
-        {
-            if (checked)
-                *checked = error::NoError;
+        if (!expected.segmentCrcs.empty() && expected.segmentSize == segment) {
+            if (expected.segmentCrcs.size() != count) {
+                LOGE << "crc32c-parts doesn't fit the size of " << key << ", not verified";
+                return true;
+            }
 
+            for (uint64_t i = 0; i < count; i++) {
+                if (i < crcs.size() && crcs[i] == expected.segmentCrcs[i])
+                    continue;
 
-            if (!avail)
-            {
-                if (checked)
-                    *checked = error::StorageUnavailable;
-                return error::StorageUnavailable;
+                uint64_t start = i * segment;
+                uint64_t len = std::min(segment, size - start);
+                LOGE << "CRC32C mismatch at " << start << " of " << key << ", fetching " << len << " bytes again";
+
+                bool ok = false;
+                for (int attempt = 0; attempt < kMultipartRetries && !ok; attempt++) {
+                    uint32_t crc;
+                    ok = getRangeToFile(bucketContext, key, etag, start, len, fd, &crc)
+                         && crc == expected.segmentCrcs[i];
+                }
+                if (!ok)
+                    return false;
             }
-            else if (checked)
-                *checked = toSet;
+            return true;
+        }
 
+        if (!expected.hasCrc)
+            return true;
 
-            return (error::code_t)*checked;
+        uint32_t total = 0;
+        for (uint64_t i = 0; i < crcs.size(); i++)
+            total = aux::crc32cCombine(total, crcs[i], std::min(segment, size - i * segment));
+        if (crcs.size() == count && total == expected.crc)
+            return true;
+
+        LOGE << "CRC32C mismatch on " << key << ", fetching it again";
+        for (int attempt = 0; attempt < kMultipartRetries; attempt++) {
+            uint32_t crc;
+            if (getRangeToFile(bucketContext, key, etag, 0, size, fd, &crc) && crc == expected.crc)
+                return true;
         }
+        return false;
+    }
 
+    // libs3 has no status of its own for 304, it reports the code as S3StatusHttpErrorUnknown
+    // and hides the code itself. A 304 has no body and repeats the ETag if it sends one;
+    // any other failure is a miss.
+    static bool notModified(const BaseContext &context, uint64_t received, const std::string &etag)
+    {
+        return context.error && context.status == S3StatusHttpErrorUnknown && received == 0
+               && (context.etag.empty() || context.etag == etag);
+    }
 
-// get local file size by it's name
-        long long getFileSize(const char *fname)
-        {
-#ifdef _WIN32
+    static void abortMultipart(S3BucketContext &bucketContext, const std::string &key, const std::string &upload_id)
+    {
+        S3AbortMultipartUploadHandler handler =
+                {
+                        responseHandler
+                };
+
+        LOGD << "Abort multipart upload:" << key;
+        S3_abort_multipart_upload(&bucketContext, key.c_str(), upload_id.c_str(), 20000, &handler);
+    }
+
+    // Parts of upload_id that have no ETag in etags yet, uploaded by up to `workers` threads,
+    // then the completion. Every acknowledged part goes to the journal record, if any.
+    static bool uploadParts(S3BucketContext &bucketContext, const std::string &key, const std::string &upload_id,
+                            int fd, uint64_t size, uint64_t part_size, int workers,
+                            const std::vector<aux::Md5::Digest> &md5s, std::vector<std::string> &etags,
+                            const std::string &record, aux::TokenBucket *throttle)
+    {
+        uint64_t parts = etags.size();
+        std::atomic<uint64_t> next(0);
+        std::atomic<bool> failed(false);
+
+        auto worker = [&] {
+            while (!failed) {
+                uint64_t part = next++;
+                if (part >= parts)
+                    break;
+                if (!etags[part].empty())
+                    continue;
+
+                uint64_t offset = part * part_size;
+                PutBuffer source(fd, offset, std::min(part_size, size - offset));
+                source.throttle = throttle;
+                if (!uploadPart(bucketContext, key, upload_id, (int) part + 1, source, etags[part],
+                                md5s.empty() ? nullptr : &md5s[part]))
+                    failed = true;
+                else if (!record.empty())
+                    UploadJournal::instance().partDone(record, (int) part + 1, etags[part]);
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (uint64_t i = 1; i < std::min<uint64_t>(workers, parts); i++)
+            threads.emplace_back(worker);
+        worker();
+
+        for (auto &t : threads)
+            t.join();
+
+        return !failed && completeMultipart(bucketContext, key, upload_id, etags,
+                                            md5s.empty() ? std::string() : aux::multipartEtag(md5s));
+    }
+
+    // Multipart upload of [0, size) of fd, parts uploaded by up to `workers` threads.
+    // Every part is retried on its own; the upload is aborted only if one still fails.
+    // path: the file behind fd; an upload of it cut short by a restart is resumed from
+    // the journal, and a new one is journaled.
+    // digest: checksums collected while the file was written, may be null
+    // throttle: limits the upload rate, may be null
+    // logical: size before compression if fd is compressed, 0 otherwise
+    static bool parallelUpload(S3BucketContext &bucketContext, const std::string &key, const std::string &path,
+                               int fd, uint64_t size, uint64_t part_size, int workers,
+                               const aux::UploadDigest *digest = nullptr, aux::TokenBucket *throttle = nullptr,
+                               uint64_t logical = 0)
+    {
+        UploadJournal &journal = UploadJournal::instance();
+
+        UploadJournal::Entry resumed;
+        if (journal.find(bucketContext.hostName, bucketContext.bucketName, key, path, size, &resumed)) {
+            uint64_t parts = (size + resumed.partSize - 1) / resumed.partSize;
+            std::vector<std::string> etags(parts);
+            for (const auto &part : resumed.parts)
+                if (part.first >= 1 && (uint64_t) part.first <= parts)
+                    etags[part.first - 1] = part.second;
+
+            LOGD << "Resuming multipart upload of " << key << ", " << resumed.parts.size() << " of " << parts
+                 << " parts done";
+            // Parts sent before the restart had no digest to go by
+            if (journal.resume(resumed)
+                && uploadParts(bucketContext, key, resumed.uploadId, fd, size, resumed.partSize, workers,
+                               std::vector<aux::Md5::Digest>(), etags, resumed.id, throttle)) {
+                journal.finish(resumed.id);
+                return true;
+            }
+
+            // Most likely aborted or expired on the server meanwhile: start over
+            LOGE << "Couldn't resume multipart upload of " << key << ", starting over";
+            abortMultipart(bucketContext, key, resumed.uploadId);
+            journal.finish(resumed.id);
+        }
+
+        // S3 allows at most 10000 parts
+        part_size = std::max(part_size, (size + 9999) / 10000);
+        uint64_t parts = (size + part_size - 1) / part_size;
+
+        // Per part MD5s only help if the parts are the digest's segments
+        std::vector<aux::Md5::Digest> md5s;
+        if (digest && digest->segmentSize() == part_size && digest->segments() == parts)
+            for (uint64_t part = 0; part < parts; part++)
+                md5s.push_back(digest->segmentMd5(part));
+
+        PutChecksums checksums(std::string(), digest ? aux::crc32cToHex(digest->crc32c()) : std::string(),
+                               partsValue(digest), logical);
+        std::string upload_id;
+        if (!initiateMultipart(bucketContext, key, upload_id, &checksums.properties))
+            return false;
+
+        std::string record = journal.begin(bucketContext.hostName, bucketContext.bucketName, key, path, size,
+                                           part_size, upload_id);
+
+        std::vector<std::string> etags(parts);
+        bool ok = uploadParts(bucketContext, key, upload_id, fd, size, part_size, workers, md5s, etags, record,
+                              throttle);
+        if (!ok)
+            abortMultipart(bucketContext, key, upload_id);
+        journal.finish(record);
+        return ok;
+    }
+
+    // Aborts multipart uploads of the bucket that no journal record knows of and that
+    // were initiated more than max_age seconds ago: left over by crashes before the
+    // journal existed, or by records lost with their staging files.
+    static void abortStaleUploads(S3BucketContext &bucketContext, time_t max_age)
+    {
+        std::set<std::string> known;
+        for (const auto &entry : UploadJournal::instance().entries(bucketContext.hostName, bucketContext.bucketName))
+            known.insert(entry.uploadId);
+
+        S3ListMultipartUploadsHandler handler =
+                {
+                        responseHandler,
+                        &listMultipartUploadsCallback
+                };
+
+        ListUploadsContext context;
+        do {
+            bool error = false;
+            BaseContext base_context(error, &context);
+            std::string key_marker = context.key_marker, upload_id_marker = context.upload_id_marker;
+
+            S3_list_multipart_uploads(&bucketContext, nullptr,
+                                      key_marker.empty() ? nullptr : key_marker.c_str(),
+                                      upload_id_marker.empty() ? nullptr : upload_id_marker.c_str(),
+                                      nullptr, nullptr, 1000, nullptr, 30000, &handler, &base_context);
+            if (error) {
+                LOGE << "Couldn't list multipart uploads";
+                return;
+            }
+        } while (context.truncated && !context.key_marker.empty());
+
+        time_t now = time(nullptr);
+        for (const auto &upload : context.uploads) {
+            if (known.count(upload.upload_id) || upload.initiated > now - max_age)
+                continue;
+
+            LOGD << "Stale multipart upload of " << upload.key << " from " << upload.initiated;
+            abortMultipart(bucketContext, upload.key, upload.upload_id);
+        }
+    }
+
+    // One PUT straight from memory, checksummed on the way
+    // logical: size before compression if data is compressed, 0 otherwise
+    static bool putBuffer(S3BucketContext &bucketContext, const std::string &key, const char *data, uint64_t size,
+                          uint64_t logical = 0)
+    {
+        aux::Md5 md5;
+        md5.update(data, size);
+        aux::Md5::Digest digest = md5.digest();
+        PutChecksums checksums(aux::Md5::toBase64(digest), aux::crc32cToHex(aux::crc32c(0, data, size)),
+                               std::string(), logical);
+
+        bool error = false;
+        PutBuffer buffer(data, size);
+        BaseContext base_context(error, &buffer);
+        S3PutObjectHandler putObjectHandler =
+                {
+                        responseHandler,
+                        &putBufferDataCallback
+                };
+
+        S3_put_object(&bucketContext, key.c_str(), size, &checksums.properties, NULL, 0, &putObjectHandler, &base_context);
+        if (!error)
+            checkEtag(key, "PUT", base_context.etag, aux::Md5::toHex(digest));
+        return !error;
+    }
+
+    // Objects of the types listed in compress_ext, or whose sample (a prefix of
+    // them) compresses well: database backups and metadata, never video
+    static bool shouldCompress(const std::string &key, const char *sample, size_t sample_size, uint64_t size,
+                               const S3Options &options)
+    {
+        if (!options.compress || size == 0 || !aux::compressionAvailable())
+            return false;
+
+        size_t dot = key.rfind('.');
+        if (dot != std::string::npos && key.find('/', dot) == std::string::npos) {
+            std::string ext = key.substr(dot + 1);
+            std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+            for (const auto &listed : split(options.compress_ext, ','))
+                if (listed == ext)
+                    return true;
+        }
+        return aux::compressible(sample, sample_size, options.compress_level);
+    }
+
+    // One PUT of an object staged in RAM, compressed if that pays off
+    static bool putObject(S3BucketContext &bucketContext, const std::string &key, const char *data, uint64_t size,
+                          const S3Options &options)
+    {
+        std::vector<char> packed;
+        if (shouldCompress(key, data, (size_t) std::min<uint64_t>(size, kCompressSample), size, options)
+            && aux::compressBuffer(data, size, options.read_block_size, options.compress_level, &packed))
+            return putBuffer(bucketContext, key, packed.data(), packed.size(), size);
+        return putBuffer(bucketContext, key, data, size);
+    }
+
+    // Seek table of a compressed object of `stored` bytes, read from its tail
+    static bool fetchSeekTable(const S3BucketContext &bucketContext, const std::string &key, const std::string &etag,
+                               uint64_t stored, aux::SeekTable *table)
+    {
+        char footer[aux::SeekTable::kFooterSize];
+        if (stored < sizeof(footer)
+            || !getRange(bucketContext, key, etag, stored - sizeof(footer), sizeof(footer), footer))
+            return false;
+
+        uint64_t size = aux::SeekTable::tableSize(footer);
+        if (size == 0 || size > stored)
+            return false;
+
+        std::vector<char> data((size_t) size);
+        return getRange(bucketContext, key, etag, stored - size, size, data.data())
+               && table->parse(data.data(), data.size());
+    }
+
+    // Uploads the file at path as key as it is: one PUT, or a parallel multipart upload for big files
+    // digest: checksums of the file from UploadDigest::finalize(), may be null
+    // throttle: limits the upload rate, may be null
+    // logical: size before compression if the file is compressed, 0 otherwise
+    static bool uploadStored(S3BucketContext &bucketContext, const std::string &key, const std::string &path,
+                             uint64_t size, const S3Options &options, const aux::UploadDigest *digest,
+                             aux::TokenBucket *throttle, uint64_t logical)
+    {
+        if (size >= options.multipart_threshold) {
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd == -1)
+                return false;
+
+            bool ok = parallelUpload(bucketContext, key, path, fd, size, options.part_size, options.upload_concurrency,
+                                     digest, throttle, logical);
+            close(fd);
+            return ok;
+        }
+
+        put_object_callback_data data;
+        data.contentLength = size;
+        data.throttle = throttle;
+        if (!(data.infile = fopen(path.c_str(), "r"))) {
+            LOGE << "Couldn't open:" << path;
+            return false;
+        }
+
+        bool error = false;
+        PutObject context(data);
+        BaseContext base_context(error, &context);
+        S3PutObjectHandler putObjectHandler =
+                {
+                        responseHandler,
+                        &putObjectDataCallback
+                };
+
+        bool md5 = digest && digest->hasMd5();
+        PutChecksums checksums(md5 ? aux::Md5::toBase64(digest->md5()) : std::string(),
+                               digest ? aux::crc32cToHex(digest->crc32c()) : std::string(), partsValue(digest),
+                               logical);
+
+        S3_put_object(&bucketContext, key.c_str(), size, &checksums.properties, NULL, 0, &putObjectHandler, &base_context);
+        fclose(data.infile);
+        if (!error && md5)
+            checkEtag(key, "PUT", base_context.etag, aux::Md5::toHex(digest->md5()));
+        return !error;
+    }
+
+    // Uploads the file at path as key, compressed if shouldCompress() says so.
+    // The compressed copy gets checksums of its own, digest describes the file as it is.
+    static bool uploadFile(S3BucketContext &bucketContext, const std::string &key, const std::string &path,
+                           uint64_t size, const S3Options &options, const aux::UploadDigest *digest,
+                           aux::TokenBucket *throttle = nullptr)
+    {
+        int fd = options.compress ? open(path.c_str(), O_RDONLY) : -1;
+        std::vector<char> sample((size_t) std::min<uint64_t>(size, kCompressSample));
+        bool compress = fd != -1 && pread(fd, sample.data(), sample.size(), 0) == (ssize_t) sample.size()
+                        && shouldCompress(key, sample.data(), sample.size(), size, options);
+        if (!compress) {
+            if (fd != -1)
+                close(fd);
+            return uploadStored(bucketContext, key, path, size, options, digest, throttle, 0);
+        }
+
+        // Same input, same output: an interrupted upload of the packed copy can resume from the journal
+        std::string packed = path + kPackedSuffix;
+        int out = open(packed.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        uint64_t stored = 0;
+        bool ok = out != -1 && aux::compressFile(fd, size, out, options.read_block_size, options.compress_level,
+                                                 options.upload_concurrency, &stored);
+        close(fd);
+
+        aux::UploadDigest packed_digest(options.part_size);
+        auto read = [out](uint64_t offset, char *dst, size_t n) {
+            return pread(out, dst, n, (off_t) offset) == (ssize_t) n;
+        };
+        ok = ok && packed_digest.finalize(stored, read, stored < options.multipart_threshold);
+        if (out != -1)
+            close(out);
+
+        if (ok) {
+            LOGD << "Compressed " << key << ": " << size << " -> " << stored;
+            ok = uploadStored(bucketContext, key, packed, stored, options, &packed_digest, throttle, size);
+        } else {
+            LOGE << "Couldn't compress, uploading as is:" << key;
+            ok = uploadStored(bucketContext, key, path, size, options, digest, throttle, 0);
+        }
+        remove(packed.c_str());
+        return ok;
+    }
+
+    // Shared by all lazy devices of the process, never destroyed so that
+    // late tasks don't race with static destructors at unload.
+    static aux::WorkerPool& readAheadPool(int threads)
+    {
+        static aux::WorkerPool* pool = new aux::WorkerPool(threads);
+        return *pool;
+    }
+
+    // Block fetcher of a lazy device. Blocks come from the shared BlockCache when
+    // possible; blocks ahead of a sequential reader are fetched on the shared pool,
+    // a jump cancels everything outside the new window.
+    class ReadAhead : public std::enable_shared_from_this<ReadAhead>
+    {
+    public:
+        typedef BlockCache::BlockPtr BlockPtr;
+
+        // table: of a compressed object, its frames are the blocks then; object_size is the logical size
+        ReadAhead(const std::string &access_key, const std::string &secret_key, const std::string &host,
+                  const std::string &bucket_name, const std::string &key, const std::string &etag,
+                  uint64_t object_size, const S3Options &options,
+                  const std::shared_ptr<const aux::SeekTable> &table = nullptr)
+            : m_access_key(access_key), m_secret_key(secret_key), m_host(host), m_bucket_name(bucket_name),
+              m_key(key), m_etag(etag), m_objectSize(object_size),
+              m_blockSize(table ? table->frameSize() : options.read_block_size),
+              m_depth(options.readahead), m_table(table),
+              m_pool(options.readahead > 0 ? &readAheadPool(options.readahead_threads) : nullptr),
+              m_lastBlock(UINT64_MAX)
+        {}
+
+        uint64_t blockSize() const { return m_blockSize; }
+
+        // Reader is at block, sequential tells whether it continued the previous read
+        void advance(uint64_t block, bool sequential)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            uint64_t window_end = sequential ? block + m_depth : block;
+
+            for (auto it = m_slots.begin(); it != m_slots.end();) {
+                if (it->first < block || it->first > window_end) {
+                    *it->second.cancelled = true;
+                    it = m_slots.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+
+            if (!m_pool)
+                return;
+
+            for (uint64_t b = block + 1; b <= window_end && b * m_blockSize < m_objectSize; b++) {
+                if (m_slots.count(b) == 0 && !(cacheable() && BlockCache::instance().contains(cacheKey(b))))
+                    schedule(b);
+            }
+        }
+
+        // Block data: cache, ready or in-flight prefetch, or a fetch right here. Null on failure.
+        BlockPtr get(uint64_t block)
+        {
+            // Repeated small reads inside one block must not count as cache accesses
+            if (block == m_lastBlock)
+                return m_lastData;
+
+            BlockPtr data = cacheable() ? BlockCache::instance().get(cacheKey(block)) : BlockPtr();
+
+            std::unique_lock<std::mutex> lock(m_mutex);
+            auto it = m_slots.find(block);
+            if (!data && it != m_slots.end()) {
+                m_cond.wait(lock, [&it]{ return it->second.done; });
+                data = it->second.data;
+                if (!data)
+                    m_slots.erase(it);
+            }
+            lock.unlock();
+
+            if (!data) {
+                bool pinned = false;
+                data = fetch(block, nullptr, &pinned);
+                if (!data)
+                    return BlockPtr();
+
+                if (pinned)
+                    BlockCache::instance().put(cacheKey(block), data);
+            }
+
+            m_lastBlock = block;
+            m_lastData = data;
+            return data;
+        }
+
+        void cancelAll()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (auto& slot : m_slots)
+                *slot.second.cancelled = true;
+            m_slots.clear();
+        }
+
+    private:
+        // Without an ETag there is no way to tell versions apart
+        bool cacheable() const { return !m_etag.empty(); }
+
+        std::string cacheKey(uint64_t block) const
+        {
+            return BlockCache::makeKey(m_bucket_name, m_key, m_etag, block);
+        }
+
+        struct Slot {
+            Slot() : done(false), cancelled(std::make_shared<std::atomic<bool>>(false)) {}
+
+            bool done;
+            BlockPtr data;
+            std::shared_ptr<std::atomic<bool>> cancelled;
+        };
+
+        // Disk cache first, then the bucket. Blocks fetched from the bucket are kept on disk.
+        // pinned tells whether the block is known to be of version m_etag: read under If-Match
+        // or from the cache keyed by it. Only such blocks may be cached under m_etag.
+        BlockPtr fetch(uint64_t block, const std::atomic<bool> *cancelled, bool *pinned) const
+        {
+            *pinned = false;
+            if (cacheable()) {
+                BlockPtr cached = DiskCache::instance().get(m_bucket_name, m_key, m_etag, block);
+                if (cached) {
+                    *pinned = true;
+                    return cached;
+                }
+            }
+
+            uint64_t start = block * m_blockSize;
+            uint64_t size = std::min(m_blockSize, m_objectSize - start);
+
+            S3BucketContext bucketContext;
+            fillBucketContext(bucketContext, m_access_key, m_secret_key, m_host, m_bucket_name);
+
+            auto data = std::make_shared<std::vector<char>>(size);
+            if (m_table) {
+                const aux::SeekTable::Frame &frame = m_table->frame(block);
+                std::vector<char> packed(frame.size);
+                if (frame.logicalSize != size
+                    || !getRange(bucketContext, m_key, m_etag, frame.offset, frame.size, packed.data(), cancelled)
+                    || !aux::decompressFrame(frame, packed.data(), data->data()))
+                    return BlockPtr();
+            } else if (!getRange(bucketContext, m_key, m_etag, start, size, data->data(), cancelled)) {
+                return BlockPtr();
+            }
+
+            // getRange sends If-Match exactly when the ETag is known
+            *pinned = cacheable();
+            if (*pinned)
+                DiskCache::instance().put(m_bucket_name, m_key, m_etag, block, data);
+            return data;
+        }
+
+        // m_mutex must be held
+        void schedule(uint64_t block)
+        {
+            auto self = shared_from_this();
+            auto cancelled = m_slots[block].cancelled;
+
+            m_pool->post([self, block, cancelled]{
+                bool pinned = false;
+                BlockPtr data = *cancelled ? BlockPtr() : self->fetch(block, cancelled.get(), &pinned);
+                bool ok = (bool) data;
+                if (ok && pinned)
+                    BlockCache::instance().put(self->cacheKey(block), data);
+
+                std::lock_guard<std::mutex> lock(self->m_mutex);
+                auto it = self->m_slots.find(block);
+                if (it == self->m_slots.end() || it->second.cancelled != cancelled)
+                    return;
+
+                it->second.done = true;
+                if (ok)
+                    it->second.data = data;
+                self->m_cond.notify_all();
+            });
+        }
+
+    private:
+        const std::string   m_access_key;
+        const std::string   m_secret_key;
+        const std::string   m_host;
+        const std::string   m_bucket_name;
+        const std::string   m_key;
+        const std::string   m_etag;
+        const uint64_t      m_objectSize;
+        const uint64_t      m_blockSize;
+        const uint64_t      m_depth;
+        const std::shared_ptr<const aux::SeekTable> m_table;
+        aux::WorkerPool    *m_pool;
+
+        std::mutex                  m_mutex;
+        std::condition_variable     m_cond;
+        std::map<uint64_t, Slot>    m_slots;
+
+        // reader thread only
+        uint64_t                    m_lastBlock;
+        BlockPtr                    m_lastData;
+    }; // class ReadAhead
+
+    // False if a page couldn't be listed, files has what came before it
+    static bool
+    collectFiles(const std::string &access_key, const std::string &secret_key, const std::string &bucket_name,
+                 const std::string &host, std::vector<MyFileInfo> &files, const char *prefix,
+                 const char *delimiter) {
+        S3BucketContext bucketContext;
+
+        bucketContext.accessKeyId       = access_key.c_str();
+        bucketContext.secretAccessKey   = secret_key.c_str();
+        bucketContext.authRegion        = nullptr;
+        bucketContext.bucketName        = bucket_name.c_str();
+        bucketContext.hostName          = host.c_str();
+        bucketContext.protocol          = S3ProtocolHTTPS;
+        bucketContext.uriStyle          = S3UriStylePath;
+        bucketContext.securityToken     = nullptr;
+
+
+        S3ListBucketHandler listBucketHandler =
+                {
+                        responseHandler,
+                        &listBucketCallback
+                };
+        std::string marker;
+        do {
+            bool error = false;
+
+            IterateFilesContext context(files, marker);
+            BaseContext base_context(error, &context);
+
+            S3_list_bucket(&bucketContext, prefix, marker.empty() ? nullptr : marker.c_str(), delimiter, 1000000, nullptr, 10000, &listBucketHandler,
+                           &base_context);
+
+            if (error) {
+                LOGE << "Couldn't list bucket";
+                return false;
+            }
+
+            if(marker.empty())
+                break;
+        }while(true);
+        return true;
+    }
+
+    // One page of a listing for aux::ParallelLister
+    static bool listPage(const std::string &access_key, const std::string &secret_key, const std::string &bucket_name,
+                         const std::string &host, const std::string &prefix, const std::string &marker, bool delimit,
+                         aux::ParallelLister::Page *page, bool *retryable) {
+        S3BucketContext bucketContext;
+        fillBucketContext(bucketContext, access_key, secret_key, host, bucket_name);
+        S3ListBucketHandler listBucketHandler = { responseHandler, &listBucketCallback };
+
+        bool error = false;
+        std::vector<MyFileInfo> files;
+        std::string next;
+        IterateFilesContext context(files, next);
+        BaseContext base_context(error, &context);
+        // S3 answers at most 1000 keys per page whatever is asked
+        S3_list_bucket(&bucketContext, prefix.c_str(), marker.empty() ? nullptr : marker.c_str(),
+                       delimit ? "/" : nullptr, 1000, nullptr, 10000, &listBucketHandler, &base_context);
+        if (error) {
+            *retryable = S3_status_is_retryable(base_context.status);
+            return false;
+        }
+        // A truncated page with nothing to continue from would end the range silently
+        if (context.truncated && next.empty()) {
+            LOGE << "Truncated listing page without a marker, prefix:" << prefix;
+            *retryable = false;
+            return false;
+        }
+
+        for (auto &f : files) {
+            if (f.is_dir)
+                page->prefixes.push_back(std::move(f.url));
+            else
+                page->objects.push_back(aux::ParallelLister::Object{std::move(f.url), f.size, std::move(f.etag)});
+        }
+        page->next = std::move(next);
+        return true;
+    }
+
+    static aux::ParallelLister::PageFunc
+    pageFunc(const std::string &access_key, const std::string &secret_key, const std::string &bucket_name,
+             const std::string &host) {
+        return [access_key, secret_key, bucket_name, host](const std::string &prefix, const std::string &marker,
+                                                           bool delimit, aux::ParallelLister::Page *page,
+                                                           bool *retryable) {
+            return listPage(access_key, secret_key, bucket_name, host, prefix, marker, delimit, page, retryable);
+        };
+    }
+
+    // Every object under prefix, in key order, with up to workers requests in flight.
+    // splits: sorted keys cutting the prefix into even ranges, may be empty.
+    static bool
+    listObjects(const std::string &access_key, const std::string &secret_key, const std::string &bucket_name,
+                const std::string &host, std::vector<MyFileInfo> &files, const std::string &prefix, int workers,
+                const std::vector<std::string> &splits = std::vector<std::string>()) {
+        if (workers <= 1)
+            return collectFiles(access_key, secret_key, bucket_name, host, files, prefix.empty() ? nullptr : prefix.c_str(),
+                                nullptr);
+
+        aux::ParallelLister lister(pageFunc(access_key, secret_key, bucket_name, host), workers);
+        std::vector<aux::ParallelLister::Object> objects;
+        if (!lister.list(prefix, splits, &objects))
+            return false;
+
+        files.reserve(files.size() + objects.size());
+        for (auto &o : objects)
+            files.push_back(MyFileInfo{std::move(o.key), o.size, false, std::move(o.etag)});
+        return true;
+    }
+
+    // Shared by all directory iterators of the process, never destroyed for the
+    // same reason as the read-ahead pool.
+    static aux::WorkerPool& listingPool()
+    {
+        static aux::WorkerPool* pool = new aux::WorkerPool(4);
+        return *pool;
+    }
+
+    // Pages of one delimited directory listing for S3FileInfoIterator. While the
+    // caller walks a page, the next one is fetched on the listing pool. Tasks hold
+    // the pager, so an iterator released mid-listing leaves nothing dangling.
+    class DirPager : public std::enable_shared_from_this<DirPager>
+    {
+    public:
+        DirPager(const std::string &access_key, const std::string &secret_key, const std::string &bucket_name,
+                 const std::string &host, const std::string &prefix)
+            : m_fetch(pageFunc(access_key, secret_key, bucket_name, host)), m_prefix(prefix),
+              m_pending(false), m_ready(false), m_end(false), m_error(false)
+        {}
+
+        // Starts fetching the first page
+        void start()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            prefetch();
+        }
+
+        // Waits for the next page; false at the end or if it couldn't be listed (error() tells)
+        bool next(std::vector<MyFileInfo> *page)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [this]{ return !m_pending; });
+            if (!m_ready)
+                return false;
+
+            page->swap(m_page);
+            m_page.clear();
+            m_ready = false;
+            if (m_marker.empty())
+                m_end = true;
+            else
+                prefetch();
+            return true;
+        }
+
+        bool error() const
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_error;
+        }
+
+    private:
+        // Under the lock
+        void prefetch()
+        {
+            if (m_pending || m_end || m_error)
+                return;
+            m_pending = true;
+            auto self = shared_from_this();
+            listingPool().post([self]{ self->fetch(); });
+        }
+
+        void fetch()
+        {
+            std::string marker;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                marker = m_marker;
+            }
+
+            aux::ParallelLister::Page page;
+            bool ok = false;
+            for (int attempt = 1; !ok && attempt <= aux::ParallelLister::kAttempts; attempt++) {
+                bool retryable = false;
+                page = aux::ParallelLister::Page();
+                ok = m_fetch(m_prefix, marker, true, &page, &retryable);
+                if (!ok && !retryable)
+                    break;
+            }
+
+            std::vector<MyFileInfo> files;
+            files.reserve(page.objects.size() + page.prefixes.size());
+            for (auto &o : page.objects)
+                files.push_back(MyFileInfo{std::move(o.key), o.size, false, std::move(o.etag)});
+            for (auto &p : page.prefixes)
+                files.push_back(MyFileInfo{std::move(p), 0, true, std::string()});
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pending = false;
+            if (ok) {
+                m_page.swap(files);
+                m_marker = std::move(page.next);
+                m_ready = true;
+            } else {
+                LOGE << "Couldn't list dir:" << m_prefix;
+                m_error = true;
+            }
+            m_cond.notify_all();
+        }
+
+    private:
+        const aux::ParallelLister::PageFunc m_fetch;
+        const std::string                   m_prefix;
+
+        mutable std::mutex                  m_mutex;
+        std::condition_variable             m_cond;
+        std::string                         m_marker;   // of the page to fetch next
+        std::vector<MyFileInfo>             m_page;     // fetched, not yet taken
+        bool                                m_pending;
+        bool                                m_ready;
+        bool                                m_end;
+        bool                                m_error;
+    }; // class DirPager
+    namespace aux
+    {
+// Scoped file remover
+        class FileRemover
+        {
+        public:
+            FileRemover(const std::string& fname) :
+                    m_fname(fname)
+            {}
+
+            ~FileRemover()
+            {
+                std::remove(m_fname.c_str());
+            }
+        private:
+            std::string m_fname;
+        };
+
+// Generates pseudo-random string for use as unique file name
+// Strictly speaking, the uniquness is not guaranteed, so delete files as soon as possible.
+        std::string getRandomFileName()
+        {
+            std::stringstream randomStringStream;
+            randomStringStream << std::hex << std::rand() << std::rand();
+
+
+            return randomStringStream.str();
+        }
+
+
+// Cut dir name from file name and return both.
+        void dirFromUri(
+                const std::string   &uri, // In
+                std::string         *dir, // Out. directory name
+                std::string         *file // Out. file name
+        )
+        {
+            std::string::size_type pos;
+            if ((pos = uri.rfind('/')) == std::string::npos)
+            {   // Here we think that '/' is the only path separator.
+                // Maybe generally it is not very reliable.
+                *dir = ".";
+                *file = uri;
+            }
+            else
+            {
+                dir->assign(uri.begin(), uri.begin() + pos);
+                if (pos < uri.size() - 1) // if file name is not empty
+                    file->assign(uri.begin() + pos + 1, uri.end());
+            }
+        }
+
+
+
+
+// Checks if remote file exists. Bases on MLSD command response parsing.
+/*        bool remoteFileExists(const std::string& access_key, const std::string& secret_key, const std::string& host, const std::string& bucket_name, const std::string& uri)
+        {
+            LOGD << "Check if remote exists";
+            std::string file = url2key(uri);
+            file = removePostfix(file);
+
+
+            std::vector<MyFileInfo> files;
+            collectFiles(access_key, secret_key, bucket_name, host, files, nullptr);
+
+
+
+
+            std::string dir;
+
+
+            if(files.empty()) {
+                return 0;
+            }
+
+
+
+
+            auto result = std::find_if(files.begin(), files.end(), [file](const MyFileInfo& info){
+                return info.url == file;
+            });
+            return result != files.end();
+        }
+*/
+// set error code to initial state (NoError generally if storage is available)
+        error::code_t checkECode(
+                int            *checked,                // ecode to set
+                const int       avail,                  // pass result of getAvail here
+                error::code_t   toSet = error::NoError  // default ecode
+        )
+        {
+            if (checked)
+                *checked = error::NoError;
+
+
+            if (!avail)
+            {
+                if (checked)
+                    *checked = error::StorageUnavailable;
+                return error::StorageUnavailable;
+            }
+            else if (checked)
+                *checked = toSet;
+
+
+            return (error::code_t)*checked;
+        }
+
+
+// get local file size by it's name
+        long long getFileSize(const char *fname)
+        {
+#ifdef _WIN32
 
 
             HANDLE hFile = CreateFileA(
@@ -568,13 +1901,21 @@ namespace nx_spl
 
 // FileInfo Iterator
 S3FileInfoIterator::S3FileInfoIterator(
-    FileListType      &&fileList
+    FileListType      &&fileList,
+    const std::shared_ptr<DirPager> &pager
 )
     :
         m_fileList(std::move(fileList)),
-        m_curFile(m_fileList.cbegin())
+        m_curFile(0),
+        m_pager(pager),
+        m_paging(false)
 {
         //LOGD << "File iterator has:" << m_fileList.size();
+    if (m_pager) {
+        for (const auto &f : m_fileList)
+            if (f.is_dir)
+                m_listedDirs.insert(f.url);
+    }
 }
 
 
@@ -587,21 +1928,35 @@ FileInfo* STORAGE_METHOD_CALL S3FileInfoIterator::next(int* ecode) const
     if (ecode)
         *ecode = nx_spl::error::NoError;
 
-    if (m_curFile != m_fileList.cend())
+    while (true)
     {
+        // The previous entry may go with its page now, the caller is done with it
+        while (m_curFile == m_fileList.size() && m_pager && m_pager->next(&m_fileList)) {
+            m_curFile = 0;
+            m_paging = true;
+        }
+
+        if (m_curFile == m_fileList.size())
+            break;
+
+        const MyFileInfo &file = m_fileList[m_curFile++];
+        // Directories given up front may come again in the listing
+        if (m_paging && file.is_dir && m_listedDirs.count(file.url))
+            continue;
+
         FileInfo info;
-        info.url = m_curFile->url.c_str();
-        info.type = m_curFile->is_dir ? isDir : isFile;
-        info.size = m_curFile->size;
+        info.url = file.url.c_str();
+        info.type = file.is_dir ? isDir : isFile;
+        info.size = file.size;
 
-        //LOGD << "Name:" << m_curFile->url << ", " << (m_curFile->is_dir ? "dir" : "file") << " , size:" << m_curFile->size;
+        //LOGD << "Name:" << file.url << ", " << (file.is_dir ? "dir" : "file") << " , size:" << file.size;
 
         m_info = info;
-        ++m_curFile;
-
         return &m_info;
     }
 
+    if (m_pager && m_pager->error() && ecode)
+        *ecode = nx_spl::error::UnknownError;
     return nullptr;
 }
 
@@ -637,12 +1992,204 @@ unsigned int S3FileInfoIterator::releaseRef()
 
 
 
+// S3 Options
+S3Options::S3Options()
+    : streaming_upload(false),
+      part_size(8 * 1024 * 1024),
+      read_block_size(1024 * 1024),
+      readahead(0),
+      readahead_threads(8),
+      block_cache_size(0),
+      disk_cache_size(10ULL * 1024 * 1024 * 1024),
+      download_concurrency(4),
+      parallel_download_threshold(32 * 1024 * 1024),
+      upload_concurrency(4),
+      multipart_threshold(64 * 1024 * 1024),
+      upload_workers(0),
+      list_workers(1),
+      upload_queue_size(1024 * 1024 * 1024),
+      memory_staging_size(0),
+      journal_dir(),
+      stale_upload_age(0),
+      spool_dir(),
+      spool_size(10ULL * 1024 * 1024 * 1024),
+      drain_rate(0),
+      compress(false),
+      compress_ext("nxdb,txt,xml,json,log,ini"),
+      compress_level(3),
+      local_dir(),
+      local_ext("nxdb"),
+      local_sync_interval(300),
+      pack_threshold(0),
+      pack_size(4 * 1024 * 1024),
+      pack_age(30),
+      pack_min_live(50),
+      pack_dir(),
+      pack_prefix(".packs/"),
+      meta_index(false),
+      meta_staleness(600),
+      meta_reconcile(300),
+      meta_incremental(false),
+      meta_dir()
+{}
+
+
+// State directories must not depend on where the server happens to be started
+static std::string absoluteDir(const std::string &name, const std::string &value)
+{
+    if (value.empty() || value[0] == '/')
+        return value;
+    LOGE << name << " must be an absolute path, ignored:" << value;
+    return std::string();
+}
+
+
+void S3Options::parse(const std::string& query)
+{
+    for (const auto& item : split(query, '&')) {
+        if (item.empty())
+            continue;
+
+        size_t eq_pos = item.find('=');
+        std::string name = item.substr(0, eq_pos);
+        std::string value = eq_pos == std::string::npos ? "1" : item.substr(eq_pos + 1);
+        given.insert(name);
+
+        try {
+            if (name == "streaming_upload")
+                streaming_upload = std::stoi(value) != 0;
+            else if (name == "part_size")
+                part_size = std::max<uint64_t>(std::stoull(value), kMinPartSize);
+            else if (name == "read_block_size")
+                read_block_size = std::max<uint64_t>(std::stoull(value), 4096);
+            else if (name == "readahead")
+                readahead = std::max(std::stoi(value), 0);
+            else if (name == "readahead_threads")
+                readahead_threads = std::max(std::stoi(value), 1);
+            else if (name == "block_cache_size")
+                block_cache_size = std::stoull(value);
+            else if (name == "disk_cache_dir")
+                disk_cache_dir = absoluteDir(name, value);
+            else if (name == "disk_cache_size")
+                disk_cache_size = std::stoull(value);
+            else if (name == "download_concurrency")
+                download_concurrency = std::max(std::stoi(value), 1);
+            else if (name == "parallel_download_threshold")
+                parallel_download_threshold = std::stoull(value);
+            else if (name == "upload_concurrency")
+                upload_concurrency = std::max(std::stoi(value), 1);
+            else if (name == "multipart_threshold")
+                multipart_threshold = std::min<uint64_t>(std::stoull(value), kMaxPutSize);
+            else if (name == "upload_workers")
+                upload_workers = std::max(std::stoi(value), 0);
+            else if (name == "list_workers")
+                list_workers = std::max(std::stoi(value), 1);
+            else if (name == "upload_queue_size")
+                upload_queue_size = std::stoull(value);
+            else if (name == "memory_staging_size")
+                memory_staging_size = std::min<uint64_t>(std::stoull(value), aux::BufferPool::kMaxSize);
+            else if (name == "journal_dir")
+                journal_dir = absoluteDir(name, value);
+            else if (name == "stale_upload_age")
+                stale_upload_age = std::max(std::stoi(value), 0);
+            else if (name == "spool_dir")
+                spool_dir = absoluteDir(name, value);
+            else if (name == "spool_size")
+                spool_size = std::stoull(value);
+            else if (name == "drain_rate")
+                drain_rate = std::stoull(value);
+            else if (name == "compress")
+                compress = std::stoi(value) != 0;
+            else if (name == "compress_ext")
+                compress_ext = value;
+            else if (name == "compress_level")
+                compress_level = std::min(std::max(std::stoi(value), 1), 19);
+            else if (name == "local_dir")
+                local_dir = absoluteDir(name, value);
+            else if (name == "local_ext")
+                local_ext = value;
+            else if (name == "local_sync_interval")
+                local_sync_interval = std::max(std::stoi(value), 1);
+            else if (name == "pack_threshold")
+                pack_threshold = std::stoull(value);
+            else if (name == "pack_size")
+                pack_size = std::stoull(value);
+            else if (name == "pack_age")
+                pack_age = std::max(std::stoi(value), 1);
+            else if (name == "pack_min_live")
+                pack_min_live = std::min(std::max(std::stoi(value), 0), 100);
+            else if (name == "pack_dir")
+                pack_dir = absoluteDir(name, value);
+            else if (name == "pack_prefix")
+                pack_prefix = value;
+            else if (name == "meta_index")
+                meta_index = std::stoi(value) != 0;
+            else if (name == "meta_staleness")
+                meta_staleness = std::max(std::stoi(value), 1);
+            else if (name == "meta_reconcile")
+                meta_reconcile = std::max(std::stoi(value), 1);
+            else if (name == "meta_incremental")
+                meta_incremental = std::stoi(value) != 0;
+            else if (name == "meta_dir")
+                meta_dir = absoluteDir(name, value);
+            else
+                LOGE << "Unknown option:" << name;
+        } catch (const std::exception&) {
+            LOGE << "Bad option value:" << item;
+        }
+    }
+}
+
+
+
+
+// The caches and the upload journal serve every storage of the process. The first URL
+// giving a setting fixes it; later URLs can neither change it nor reset it to the default.
+static void configureShared(const S3Options &options)
+{
+    static std::mutex mutex;
+    static std::map<std::string, std::string> fixed;   // setting -> value some URL gave
+
+    std::lock_guard<std::mutex> lock(mutex);
+    // true if this storage sets it: given first, or nothing was given so far
+    auto apply = [](const std::string &name, bool given, const std::string &value) {
+        auto it = fixed.find(name);
+        if (it == fixed.end()) {
+            if (given)
+                fixed[name] = value;
+            return true;
+        }
+        if (given && it->second != value)
+            LOGE << name << " is process-wide and kept at " << it->second << ", ignored:" << value;
+        return false;
+    };
+
+    if (apply("block_cache_size", options.given.count("block_cache_size") != 0,
+              std::to_string(options.block_cache_size)))
+        BlockCache::instance().setCapacity(options.block_cache_size);
+    if (apply("disk_cache", options.given.count("disk_cache_dir") || options.given.count("disk_cache_size"),
+              options.disk_cache_dir + ", " + std::to_string(options.disk_cache_size)))
+        DiskCache::instance().configure(options.disk_cache_dir, options.disk_cache_size);
+    if (apply("journal_dir", options.given.count("journal_dir") != 0, options.journal_dir))
+        UploadJournal::instance().configure(options.journal_dir);
+}
+
+
 // S3 Storage
-//s3://login:password@host/bucket
-S3Storage::S3Storage(const std::string& url)
-    : m_available(false), m_max_size(0)
+//s3://login:password@host/bucket[@size][?options]
+S3Storage::S3Storage(const std::string& storage_url)
+    : retriesG(0), m_retrySleep(1), m_available(false), m_max_size(0), m_verifyNext(0)
 {
-    LOGD << "Create storage for url:" << url;
+    LOGD << "Create storage for url:" << storage_url;
+
+
+    std::string url = storage_url;
+    size_t query_pos = url.find('?');
+    if (query_pos != std::string::npos) {
+        m_options.parse(url.substr(query_pos + 1));
+        url.resize(query_pos);
+    }
+    configureShared(m_options);
 
 
     size_t login_password_sep_pos = url.find(':', 5);
@@ -761,86 +2308,287 @@ S3Storage::S3Storage(const std::string& url)
     m_available = true;
 
 
-    terminate_thread = false;
-    t = std::make_shared<std::thread>([this]{
-        LOGD << "=====================:" << terminate_thread;
-       int counter = 2 * 3600 * 2;
-        while(!terminate_thread){
-           usleep(500000);
-           if(counter++ > 2 * 3600 * 2){
-               counter = 0;
-               std::vector<MyFileInfo> files;
-               collectFiles(m_access_key, m_secret_key, m_bucket_name, m_host, files, nullptr, nullptr);
+    if (!m_options.local_dir.empty()) {
+        // Snapshots left by the last run are dropped here, before the spool could queue them:
+        // every copy found is synced again anyway
+        mkdir(m_options.local_dir.c_str(), 0755);
+        m_local = std::make_shared<LocalStore>(
+                m_options.local_dir + "/" + m_bucket_name + "@" + m_host, m_options.local_ext,
+                [this](const std::string& key, const std::string& path, uint64_t size) {
+                    if (m_uploads)
+                        return m_uploads->push(key, path, size, UploadQueue::Digest());
+
+                    S3BucketContext bucketContext;
+                    fillBucketContext(bucketContext, m_access_key, m_secret_key, m_host, m_bucket_name);
+                    if (!uploadFile(bucketContext, key, path, size, m_options, nullptr))
+                        return false;
+                    remove(path.c_str());
+                    return true;
+                });
+        if (!m_local->valid())
+            m_local.reset();
+    }
 
+    if (m_options.pack_threshold > 0 && !m_options.pack_dir.empty() && !m_options.pack_prefix.empty()) {
+        // Copies again: devices may read packs a bit longer than the storage lives
+        std::string access_key = m_access_key, secret_key = m_secret_key, host = m_host, bucket_name = m_bucket_name;
+        std::string prefix = m_options.pack_prefix;
+        auto remove_object = [access_key, secret_key, host, bucket_name, prefix](const std::string& name) {
+            S3BucketContext bucketContext;
+            fillBucketContext(bucketContext, access_key, secret_key, host, bucket_name);
+            bool error = false;
+            BaseContext context(error);
+            S3_delete_object(&bucketContext, (prefix + name).c_str(), nullptr, 20000, &responseHandler, &context);
+            return !error;
+        };
 
-               uint64_t used_space = 0;
+        mkdir(m_options.pack_dir.c_str(), 0755);
+        m_packs = std::make_shared<PackStore>(
+                m_options.pack_dir + "/" + m_bucket_name + "@" + m_host, m_options.pack_size, m_options.pack_age,
+                m_options.pack_min_live / 100.0,
+                [access_key, secret_key, host, bucket_name, prefix](const std::string& name, const char* data, uint64_t size) {
+                    S3BucketContext bucketContext;
+                    fillBucketContext(bucketContext, access_key, secret_key, host, bucket_name);
+                    return putBuffer(bucketContext, prefix + name, data, size);
+                },
+                [access_key, secret_key, host, bucket_name, prefix](const std::string& name, uint64_t offset,
+                                                                    uint64_t size, char* dst) {
+                    S3BucketContext bucketContext;
+                    fillBucketContext(bucketContext, access_key, secret_key, host, bucket_name);
+                    return getRange(bucketContext, prefix + name, std::string(), offset, size, dst);
+                },
+                remove_object);
+
+        // Without the index every packed object would look deleted, so an unreadable one turns packing off
+        S3BucketContext bucketContext;
+        fillBucketContext(bucketContext, m_access_key, m_secret_key, m_host, m_bucket_name);
+        std::string index_key = prefix + PackStore::kIndexName;
+        bool error = false;
+        BaseContext base_context(error);
+        S3_head_object(&bucketContext, index_key.c_str(), nullptr, 0, &responseHandler, &base_context);
+        bool missing = error && (base_context.status == S3StatusHttpErrorNotFound
+                                 || base_context.status == S3StatusErrorNoSuchKey);
+
+        std::string index;
+        if (!error) {
+            index.resize(base_context.content_length);
+            if (!index.empty() && !getRange(bucketContext, index_key, std::string(), 0, index.size(), &index[0]))
+                error = true;
+        }
+        if ((error && !missing) || !m_packs->load(index)) {
+            LOGE << "Couldn't load pack index, packing is off";
+            m_packs.reset();
+        } else {
+            // Packs a crash left unreferenced
+            std::vector<MyFileInfo> objects;
+            collectFiles(m_access_key, m_secret_key, m_bucket_name, m_host, objects, prefix.c_str(), nullptr);
+            for (const auto& object : objects) {
+                std::string name = object.url.substr(std::min(prefix.size(), object.url.size()));
+                if (!object.is_dir && !m_packs->referenced(name) && remove_object(name))
+                    LOGD << "Removed orphaned pack:" << object.url;
+            }
+        }
+    }
 
+    if (m_options.meta_index) {
+        // The last listing is mapped from disk, so lookups are answered before the first one finishes
+        std::string meta_dir;
+        if (!m_options.meta_dir.empty()) {
+            mkdir(m_options.meta_dir.c_str(), 0755);
+            meta_dir = m_options.meta_dir + "/" + m_bucket_name + "@" + m_host;
+        }
+        m_meta = std::make_shared<MetadataIndex>(m_options.meta_staleness, meta_dir);
+        if (!meta_dir.empty() && !m_meta->load())
+            LOGE << "Metadata index is kept in memory only";
+    }
 
-               for (const auto &f : files) {
-                   used_space += f.size;
-               }
-                LOGD << "Used space:" << used_space;
-               std::string str = aux::getRandomFileName();
-               time_t time_now = time(nullptr);
-               FILE* f = fopen(str.c_str(), "w");
-               fprintf(f, "%d\n%llu\n", time_now, used_space);
-               fclose(f);
+    if (m_options.upload_workers > 0) {
+        // Credentials are copied: devices may hold the queue a bit longer than the storage lives
+        std::string access_key = m_access_key, secret_key = m_secret_key, host = m_host, bucket_name = m_bucket_name;
+        S3Options options = m_options;
+        std::shared_ptr<MetadataIndex> meta = m_meta;
+
+        // One spool per bucket, closed objects wait there while the bucket is unreachable
+        std::string spool_dir;
+        struct stat st;
+        if (!m_options.spool_dir.empty()) {
+            spool_dir = m_options.spool_dir + "/" + m_bucket_name + "@" + m_host;
+            mkdir(m_options.spool_dir.c_str(), 0755);
+            if (mkdir(spool_dir.c_str(), 0755) == -1 && (stat(spool_dir.c_str(), &st) == -1 || !S_ISDIR(st.st_mode))) {
+                LOGE << "Couldn't create spool dir:" << spool_dir;
+                spool_dir.clear();
+            }
+        }
 
+        m_uploads = std::make_shared<UploadQueue>(
+                [access_key, secret_key, host, bucket_name, options, meta](const std::string& key, const std::string& path,
+                                                                           uint64_t size, const UploadQueue::Digest& digest,
+                                                                           aux::TokenBucket* throttle) {
+                    S3BucketContext bucketContext;
+                    fillBucketContext(bucketContext, access_key, secret_key, host, bucket_name);
+                    if (!uploadFile(bucketContext, key, path, size, options, digest.get(), throttle))
+                        return false;
+                    if (meta)
+                        meta->put(key, size);
+                    return true;
+                },
+                m_options.upload_workers, m_options.upload_queue_size,
+                spool_dir, m_options.spool_size, m_options.drain_rate);
+    }
 
-               f = fopen(str.c_str(), "r");
+    // Uploads an earlier run didn't finish. Queued ones go ahead of anything devices push
+    // later for the same key; without the queue they are taken up by the thread below.
+    std::vector<UploadJournal::Entry> interrupted;
+    for (const auto& entry : UploadJournal::instance().entries(m_host, m_bucket_name)) {
+        if (entry.active)
+            continue;
 
+        // A compressed copy is made again from its staging file, the same bytes let the upload resume
+        UploadJournal::Entry source = entry;
+        size_t suffix = entry.path.size() - std::min(entry.path.size(), sizeof(kPackedSuffix) - 1);
+        bool packed = entry.path.compare(suffix, std::string::npos, kPackedSuffix) == 0;
+        if (packed)
+            source.path = entry.path.substr(0, suffix);
+
+        struct stat st;
+        bool gone = stat(source.path.c_str(), &st) == -1;
+        if (!gone && packed)
+            source.size = (uint64_t) st.st_size;
+        if (gone || (uint64_t) st.st_size != source.size) {
+            LOGE << "Staging file of interrupted upload is gone:" << entry.key;
+            S3BucketContext bucketContext;
+            fillBucketContext(bucketContext, m_access_key, m_secret_key, m_host, m_bucket_name);
+            abortMultipart(bucketContext, entry.key, entry.uploadId);
+            UploadJournal::instance().finish(entry.id);
+            if (packed)
+                remove(entry.path.c_str());
+        } else if (m_uploads && m_uploads->pendingSize(entry.key, nullptr)) {
+            // Restored from the spool, the queue resumes it
+        } else if (m_uploads) {
+            LOGD << "Queueing interrupted upload:" << entry.key;
+            m_uploads->push(source.key, source.path, source.size, UploadQueue::Digest());
+        } else {
+            interrupted.push_back(source);
+        }
+    }
 
-               put_object_callback_data data;
 
+    terminate_thread = false;
+    t = std::make_shared<std::thread>([this, interrupted]{
+        LOGD << "=====================:" << terminate_thread;
+        for (const auto& entry : interrupted) {
+            if (terminate_thread)
+                break;
 
-               struct stat statbuf;
-               if (stat(str.c_str(), &statbuf) == -1) {
-                   LOGE << "Culdn't get file size:" << str;
-                   return;
+            LOGD << "Resuming interrupted upload:" << entry.key;
+            S3BucketContext bucketContext;
+            fillBucketContext(bucketContext, m_access_key, m_secret_key, m_host, m_bucket_name);
+            if (uploadFile(bucketContext, entry.key, entry.path, entry.size, m_options, nullptr))
+                remove(entry.path.c_str());
+        }
+       int counter = 2 * 3600 * 2;
+       int stats_counter = 0;
+       int probe_counter = 0;
+       int sync_counter = 0;
+       int pack_counter = 0;
+       int meta_counter = 2 * m_options.meta_reconcile;
+       uint64_t last_uploaded = 0;
+        while(!terminate_thread){
+           usleep(500000);
+           // While the queue is offline the bucket is probed every 5 s
+           if (m_uploads && !m_uploads->online() && ++probe_counter >= 2 * 5) {
+               probe_counter = 0;
+               if (test_bucket(false))
+                   m_uploads->setOnline(true);
+           }
+           if (m_local && ++sync_counter >= 2 * m_options.local_sync_interval) {
+               sync_counter = 0;
+               m_local->sync(false);
+           }
+           if (m_packs && ++pack_counter >= 2 * 5) {
+               pack_counter = 0;
+               m_packs->seal(false);
+           }
+           // The first full listing builds the index, the later ones catch changes by other writers.
+           // While the index is fresh an incremental rescan can do instead.
+           if (m_meta && ++meta_counter >= 2 * m_options.meta_reconcile) {
+               meta_counter = 0;
+               time_t listed = m_meta->listedAt();
+               std::vector<MyFileInfo> files;
+               if (m_options.meta_incremental && listed != 0 && time(nullptr) - listed <= m_options.meta_staleness) {
+                   rescanIndex();
+               } else {
+                   m_meta->beginReconcile();
+                   // The last listing tells where to cut the bucket into even ranges
+                   std::vector<std::string> splits = m_meta->splitPoints(4 * (size_t) m_options.list_workers);
+                   if (listObjects(m_access_key, m_secret_key, m_bucket_name, m_host, files, std::string(),
+                                   m_options.list_workers, splits)) {
+                       MetadataIndex::Listing objects;
+                       objects.reserve(files.size());
+                       for (auto &f : files)
+                           objects.push_back(aux::IndexSnapshot::Object{std::move(f.url), f.size, std::move(f.etag)});
+                       m_meta->finishReconcile(std::move(objects));
+                   } else {
+                       m_meta->abortReconcile();
+                   }
                }
-
-
-               int contentLength = statbuf.st_size;
-               data.contentLength = contentLength;
-
-
-               if (!(data.infile = f)) {
-                   LOGE << "Couldn't open:" << str;
-                   return;
+           }
+           if(++stats_counter >= 2 * 600){
+               stats_counter = 0;
+               BlockCache::Stats stats = BlockCache::instance().stats();
+               LOGD << "Block cache: hits " << stats.hits << ", misses " << stats.misses
+                    << ", evictions " << stats.evictions << ", rejections " << stats.rejections
+                    << ", bytes " << stats.bytes << " of " << stats.capacity;
+
+               DiskCache::Stats disk_stats = DiskCache::instance().stats();
+               if (disk_stats.capacity)
+                   LOGD << "Disk cache: hits " << disk_stats.hits << ", misses " << disk_stats.misses
+                        << ", evictions " << disk_stats.evictions
+                        << ", bytes " << disk_stats.bytes << " of " << disk_stats.capacity;
+
+               if (m_uploads) {
+                   UploadQueue::Stats queue_stats = m_uploads->stats();
+                   LOGD << "Upload queue: " << (queue_stats.online ? (queue_stats.draining ? "draining" : "online") : "offline")
+                        << ", jobs " << queue_stats.jobs << ", bytes " << queue_stats.bytes
+                        << ", rate " << (queue_stats.uploaded - last_uploaded) / 600 << " B/s"
+                        << ", failures " << queue_stats.failures << ", dropped " << queue_stats.dropped;
+                   last_uploaded = queue_stats.uploaded;
                }
+           }
+           if(counter++ > 2 * 3600 * 2){
+               counter = 0;
+               uint64_t used_space = 0;
+               if (!m_meta || !m_meta->totalSize(&used_space)) {
+                   std::vector<MyFileInfo> files;
+                   listObjects(m_access_key, m_secret_key, m_bucket_name, m_host, files, std::string(),
+                               m_options.list_workers);
 
 
-               bool error = false;
-
-
-               PutObject context(data);
-               BaseContext base_context(error, &context);
-               S3PutObjectHandler putObjectHandler =
-                       {
-                               responseHandler,
-                               &putObjectDataCallback
-                       };
+                   for (const auto &f : files) {
+                       used_space += f.size;
+                   }
+               }
+                LOGD << "Used space:" << used_space;
+               time_t time_now = time(nullptr);
+               char buf[64];
+               int contentLength = snprintf(buf, sizeof(buf), "%d\n%llu\n", (int) time_now, (unsigned long long) used_space);
 
 
                S3BucketContext bucketContext;
+               fillBucketContext(bucketContext, m_access_key, m_secret_key, m_host, m_bucket_name);
 
 
-               bucketContext.accessKeyId       = m_access_key.c_str();
-               bucketContext.secretAccessKey   = m_secret_key.c_str();
-               bucketContext.authRegion        = nullptr;
-               bucketContext.bucketName        = m_bucket_name.c_str();
-               bucketContext.hostName          = m_host.c_str();
-               bucketContext.protocol          = S3ProtocolHTTPS;
-               bucketContext.uriStyle          = S3UriStylePath;
-               bucketContext.securityToken     = nullptr;
+               LOGD << "Put object:" << ".size" << ", " << contentLength;
 
 
-               LOGD << "Put object:" << ".size" << ", " << contentLength;
+               if (!putBuffer(bucketContext, ".size", buf, contentLength))
+                   LOGE << "Couldn't put object:" << ".size";
 
+               if (m_options.stale_upload_age > 0)
+                   abortStaleUploads(bucketContext, m_options.stale_upload_age);
 
-               S3_put_object(&bucketContext, ".size", contentLength, NULL, NULL, 0, &putObjectHandler, &base_context);
-               fclose(f);
-               remove(str.c_str());
+               if (m_packs && m_packs->collect() > 0)
+                   m_packs->seal(false);
            }
        }
     });
@@ -854,7 +2602,16 @@ S3Storage::~S3Storage()
 {
         LOGD << "Destroy storage";
         terminate_thread = true;
-        t->join();
+        if (t)
+            t->join();
+    // Last snapshots of the local copies, ahead of the drain
+    if (m_local && m_local->sync(true) > 0)
+        LOGE << "Local copies not synced, they go with the next run";
+    if (m_packs && !m_packs->seal(true))
+        LOGE << "Packs not uploaded, they go with the next run";
+    // Spooled uploads wait for the next run
+    if (m_uploads && !m_uploads->spooling())
+        m_uploads->drain();
     S3_deinitialize();
 }
 
@@ -873,6 +2630,10 @@ int STORAGE_METHOD_CALL S3Storage::isAvailable() const
 
 uint64_t S3Storage::getUsedSpace() const {
       //  LOGD << "Get used space";
+    uint64_t used_space = 0;
+    if (m_meta && m_meta->totalSize(&used_space))
+        return used_space;
+
     bool error = false;
     BaseContext base_context(error);
     S3BucketContext bucketContext;
@@ -886,33 +2647,23 @@ uint64_t S3Storage::getUsedSpace() const {
     bucketContext.uriStyle          = S3UriStylePath;
     bucketContext.securityToken     = nullptr;
 
-    std::string temp_file = aux::getRandomFileName();
-
-
-    FILE *f = fopen(temp_file.c_str(), "wb");
-    if (f == NULL) {
-        //throw std::runtime_error("Couldn't open file for writing");
-        return 0;
-    }
+    char buf[64] = {};
 
     error = false;
-    GetObject context(f, error);
+    GetBuffer context(buf, sizeof(buf) - 1, error);
     //LOGD << "Get object";
 
-    S3_get_object(&bucketContext, ".size", NULL, 0, 0, NULL, 120000, &getObjectHandler, &context);
-    fclose(f);
+    S3_get_object(&bucketContext, ".size", NULL, 0, 0, NULL, 120000, &getBufferHandler, &context);
 
     if(error)
         return 0;
 
-    f = fopen(temp_file.c_str(), "r");
     char time_buf[32];
     char size_buf[32];
 
-    fscanf(f, "%s%s", time_buf, size_buf);
+    if (sscanf(buf, "%31s%31s", time_buf, size_buf) != 2)
+        return 0;
 
-    fclose(f);
-    remove(temp_file.c_str());
     char* end;
     return std::strtoull(size_buf, &end, 10);
 }
@@ -969,7 +2720,6 @@ int STORAGE_METHOD_CALL S3Storage::getCapabilities() const
 //    LOGD << "get cap";
 
     std::string fileName(aux::getRandomFileName());
-    aux::FileRemover fr(fileName);
 
 
     bool error = false;
@@ -1005,54 +2755,9 @@ int STORAGE_METHOD_CALL S3Storage::getCapabilities() const
     else
         return ret;
   //  LOGD << "get cap";
-    FILE* ofs = fopen(fileName.c_str(), "wb");
     // write file
-    if (ofs)
-    {
-        fwrite("1", 1, 2, ofs);
-        fclose(ofs);
-
-        put_object_callback_data data;
-
-
-        struct stat statbuf;
-        if (stat(fileName.c_str(), &statbuf) == -1) {
-            LOGE << "Culdn't get file size:" << fileName;
-            return ret;
-        }
-
-        int contentLength = statbuf.st_size;
-        data.contentLength = contentLength;
-
-        if (!(data.infile = fopen(fileName.c_str(), "r"))) {
-            LOGE << "Couldn't open:" << fileName;
-            return ret;
-        }
-
-        bool error = false;
-
-        PutObject context(data);
-        BaseContext base_context(error, &context);
-        S3PutObjectHandler putObjectHandler =
-                {
-                        responseHandler,
-                        &putObjectDataCallback
-                };
-
-
-        S3_put_object(&bucketContext, fileName.c_str(), contentLength, NULL, NULL, 0, &putObjectHandler, &base_context);
-    //    LOGD << "Put complete";
-        fclose(data.infile);
-
-        if(!error)
-        {
-            ret |= cap::WriteFile;
-        }
-    }
-    else {
-      //  LOGD << "get cap";
-        return ret;
-    }
+    if (putBuffer(bucketContext, fileName, "1", 2))
+        ret |= cap::WriteFile;
     error = false;
 
     S3_head_object(&bucketContext, fileName.c_str(), nullptr, 0, &responseHandler, &base_context);
@@ -1098,6 +2803,16 @@ void STORAGE_METHOD_CALL S3Storage::removeFile(
         return;
 
 
+    if (m_packs && m_packs->remove(url2key(url)))
+        return;
+
+    if (m_local && m_local->handles(url2key(url)))
+        m_local->remove(url2key(url));
+
+    if (m_uploads)
+        m_uploads->cancel(url2key(url));
+
+
     S3BucketContext bucketContext;
     bucketContext.accessKeyId       = m_access_key.c_str();
     bucketContext.secretAccessKey   = m_secret_key.c_str();
@@ -1118,6 +2833,8 @@ void STORAGE_METHOD_CALL S3Storage::removeFile(
                    nullptr,
                    0,
                    &responseHandler, &context);
+    if (m_meta)
+        m_meta->remove(url2key(url));
 
 
 }
@@ -1153,6 +2870,25 @@ void STORAGE_METHOD_CALL S3Storage::renameFile(
     LOGD << "**************************************  Rename file:" << oldUrl << ", " << newUrl;
 
 
+    // A packed object is renamed in the index only
+    if (m_packs && m_packs->rename(url2key(oldUrl), url2key(newUrl)))
+        return;
+
+    // The bucket may be behind a local copy: either it moves, or it is synced before the copy below
+    bool local_old = m_local && m_local->handles(url2key(oldUrl));
+    if (local_old && m_local->handles(url2key(newUrl)) && m_local->rename(url2key(oldUrl), url2key(newUrl)))
+        local_old = false;
+    else if (local_old)
+        m_local->sync(true);
+
+    if (m_uploads && !m_uploads->waitFor(url2key(oldUrl))) {
+        LOGE << "Couldn't rename, not uploaded yet:" << oldUrl;
+        if (ecode)
+            *ecode = error::UnknownError;
+        return;
+    }
+
+
     S3BucketContext bucketContext;
     bucketContext.accessKeyId       = m_access_key.c_str();
     bucketContext.secretAccessKey   = m_secret_key.c_str();
@@ -1179,6 +2915,10 @@ void STORAGE_METHOD_CALL S3Storage::renameFile(
 
 
     S3_delete_object(&bucketContext, url2key(oldUrl).c_str(), nullptr, 20000, &responseHandler, &context);
+    if (local_old)
+        m_local->remove(url2key(oldUrl));
+    if (m_meta)
+        m_meta->rename(url2key(oldUrl), url2key(newUrl));
     /*if (m_impl->Rename(oldUrl, newUrl) == 0 && ecode)
         *ecode = error::UnknownError;*/
 }
@@ -1200,9 +2940,35 @@ FileInfoIterator* STORAGE_METHOD_CALL S3Storage::getFileIterator(
  //   LOGD << key_dir;
 
     std::vector<MyFileInfo> files;
-    collectFiles(m_access_key, m_secret_key, m_bucket_name, m_host, files, key_dir.c_str(), "/");
+    MetadataIndex::Objects indexed;
+    std::set<std::string> indexed_dirs;
+    std::shared_ptr<DirPager> pager;
+    if (m_meta && m_meta->list(key_dir, &indexed, &indexed_dirs)) {
+        for (const auto &o : indexed)
+            files.push_back(MyFileInfo{o.first, o.second, false, std::string()});
+        for (const auto &d : indexed_dirs)
+            files.push_back(MyFileInfo{d, 0, true, std::string()});
+    } else {
+        // Paged as the caller iterates: a camera dir may hold hundreds of thousands of chunks
+        pager = std::make_shared<DirPager>(m_access_key, m_secret_key, m_bucket_name, m_host, key_dir);
+        pager->start();
+    }
+
+    if (m_packs) {
+        // Packed objects, and directories nothing but packed objects live in
+        std::vector<std::pair<std::string, PackStore::Entry>> packed;
+        std::set<std::string> dirs;
+        m_packs->list(key_dir, &packed, &dirs);
+        for (const auto &f : files)
+            if (f.is_dir)
+                dirs.erase(f.url);
+        for (const auto &p : packed)
+            files.push_back(MyFileInfo{p.first, p.second.size, false, std::string()});
+        for (const auto &d : dirs)
+            files.push_back(MyFileInfo{d, 0, true, std::string()});
+    }
 
-    return new S3FileInfoIterator(std::move(files));
+    return new S3FileInfoIterator(std::move(files), pager);
 }
 
 
@@ -1237,6 +3003,15 @@ int STORAGE_METHOD_CALL S3Storage::fileExists(
 
 
     std::string file_name = removePostfix(url2key(url));
+    if (m_local && m_local->handles(file_name) && m_local->exists(file_name, nullptr))
+        return 1;
+    if (m_packs && m_packs->find(file_name, nullptr))
+        return 1;
+    if (m_uploads && m_uploads->pendingSize(file_name, nullptr))
+        return 1;
+    if (m_meta && m_meta->find(file_name, &fileExists, nullptr))
+        return fileExists;
+
     S3_head_object(&bucketContext, file_name.c_str(), nullptr, 0, &responseHandler, &base_context);
     fileExists = !error;
 
@@ -1251,7 +3026,23 @@ int STORAGE_METHOD_CALL S3Storage::dirExists(
     int         *ecode
 ) const
 {
-    return 0;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(aux::checkECode(ecode, getAvail()) != nx_spl::error::NoError)
+        return 0;
+
+    // Only the index knows, without it directories are reported missing as before
+    bool exists = false;
+    if (!m_meta || !m_meta->dirExists(url2key(url), &exists))
+        return 0;
+
+    if (!exists && m_packs) {
+        std::vector<std::pair<std::string, PackStore::Entry>> packed;
+        std::set<std::string> dirs;
+        std::string prefix = url2key(url) + "/";
+        m_packs->list(prefix, &packed, &dirs);
+        exists = !packed.empty() || !dirs.empty();
+    }
+    return exists;
 }
 
 
@@ -1264,22 +3055,41 @@ uint64_t STORAGE_METHOD_CALL S3Storage::fileSize(
     if(aux::checkECode(ecode, getAvail()) != nx_spl::error::NoError)
         return 0;
     //LOGD << "Get file size" << url << ", " << url2key(url);
-    std::vector<MyFileInfo> files;
-    collectFiles(m_access_key, m_secret_key, m_bucket_name, m_host, files, url2key(url).c_str(), nullptr);
-
-    if(files.empty())
-        return 0;
-
-    auto result = std::find_if(files.begin(), files.end(), [url](const MyFileInfo& info){
-        return info.url == url;
-    });
+    uint64_t pending_size = 0;
+    if (m_local && m_local->handles(url2key(url)) && m_local->exists(url2key(url), &pending_size))
+        return pending_size;
+    PackStore::Entry packed;
+    if (m_packs && m_packs->find(url2key(url), &packed))
+        return packed.size;
+    if (m_uploads && m_uploads->pendingSize(url2key(url), &pending_size))
+        return pending_size;
+
+    bool exists = false;
+    uint64_t size = 0;
+    if (m_meta && m_meta->find(url2key(url), &exists, &size)) {
+        if (!exists) {
+            LOGD << "Couldn't get file size";
+            return unknown_size;
+        }
+        // Listings only know the stored size
+        if (!m_options.compress)
+            return size;
+    }
 
-    if(result == files.end()) {
-        LOGD << "Couldn't get file size";
+    // One key is one HEAD, no listing needed
+    bool error = false;
+    BaseContext base_context(error);
+    S3BucketContext bucketContext;
+    fillBucketContext(bucketContext, m_access_key, m_secret_key, m_host, m_bucket_name);
+    S3_head_object(&bucketContext, url2key(url).c_str(), nullptr, 0, &responseHandler, &base_context);
+    if (error) {
+        LOGD << "Couldn't get file size, status:" << (int) base_context.status;
         return unknown_size;
     }
-    LOGD << "Size:" << result->size;
-    return result->size;
+
+    size = base_context.encoding == kCompressedEncoding ? base_context.logical_size : base_context.content_length;
+    LOGD << "Size:" << size;
+    return size;
 }
 
 IODevice* STORAGE_METHOD_CALL S3Storage::open(
@@ -1303,7 +3113,8 @@ IODevice* STORAGE_METHOD_CALL S3Storage::open(
 
     try {
         ret = new S3IODevice(
-                uri_safe.c_str(), flags, "", m_access_key, m_secret_key, m_host, m_bucket_name
+                uri_safe.c_str(), flags, "", m_access_key, m_secret_key, m_host, m_bucket_name, m_options, m_uploads,
+                m_local, m_packs, m_meta
         );
     }catch (const std::exception& e){
         LOGE << e.what();
@@ -1348,19 +3159,118 @@ unsigned int S3Storage::releaseRef()
 // test bucket ---------------------------------------------------------------
     int S3Storage::should_retry() const
     {
-        if (retriesG--) {
-            // Sleep before next retry; start out with a 1 second sleep
-            static int retrySleepInterval = 1;
-            sleep(retrySleepInterval);
-            // Next sleep 1 second longer
-            retrySleepInterval++;
+        if (retriesG-- > 0) {
+            // Sleep before next retry; start out with a 1 second sleep, next sleep 1 second longer
+            sleep(m_retrySleep++);
             return 1;
         }
 
         return 0;
     }
 
-bool S3Storage::test_bucket() const
+namespace {
+    MetadataIndex::Listing toListing(std::vector<aux::ParallelLister::Object> &objects) {
+        MetadataIndex::Listing listing;
+        listing.reserve(objects.size());
+        for (auto &o : objects)
+            listing.push_back(aux::IndexSnapshot::Object{std::move(o.key), o.size, std::move(o.etag)});
+        return listing;
+    }
+}
+
+// Incremental reconcile of the metadata index. Every stream is listed from its last
+// key on, and its first page is compared as a cheap check for deletions: retention
+// and lifecycle rules remove the oldest chunks. One stream per pass is verified in
+// full, so changes in the middle are caught too, just later. The directories above
+// the streams are listed one level deep, which finds new and removed subtrees and
+// keys of no stream.
+bool S3Storage::rescanIndex()
+{
+    typedef aux::ParallelLister::Scan Scan;
+
+    m_meta->beginReconcile();
+    std::vector<MetadataIndex::Stream> streams;
+    std::set<std::string> parents;
+    m_meta->streams(&streams, &parents);
+
+    std::vector<Scan> scans;
+    for (const auto &parent : parents)
+        scans.push_back(Scan{parent, std::string(), 0, true});
+    size_t verify = streams.empty() ? 0 : m_verifyNext++ % streams.size();
+    for (size_t i = 0; i < streams.size(); i++) {
+        scans.push_back(Scan{streams[i].prefix, streams[i].last, 0, false});
+        scans.push_back(Scan{streams[i].prefix, std::string(), i == verify ? (size_t) 0 : 1, false});
+    }
+
+    aux::ParallelLister lister(pageFunc(m_access_key, m_secret_key, m_bucket_name, m_host), m_options.list_workers);
+    std::vector<aux::ParallelLister::Result> results;
+    if (!lister.scan(scans, &results)) {
+        m_meta->abortReconcile();
+        return false;
+    }
+
+    // A partial result only covers keys up to its last one, an empty partial one nothing
+    auto bound = [](const aux::ParallelLister::Result &result, std::string *last) {
+        last->clear();
+        if (!result.complete && !result.objects.empty())
+            *last = result.objects.back().key;
+        return result.complete || !last->empty();
+    };
+
+    size_t changed = 0;
+    size_t r = 0;
+    std::string last;
+    std::vector<Scan> subtrees;
+    for (const auto &parent : parents) {
+        auto &result = results[r++];
+        if (!result.complete) {
+            LOGE << "Incomplete listing of " << parent << ", left as it is";
+            continue;
+        }
+        std::set<std::string> known;
+        changed += m_meta->mergeLevel(parent, toListing(result.objects), &known);
+
+        std::set<std::string> listed(result.prefixes.begin(), result.prefixes.end());
+        for (const auto &dir : known) {
+            if (!listed.count(dir))
+                changed += m_meta->mergeRange(dir, std::string(), std::string(), MetadataIndex::Listing());
+        }
+        for (const auto &dir : listed) {
+            // New directories inside a stream are found by its own scan
+            bool inStream = std::any_of(streams.begin(), streams.end(), [&dir](const MetadataIndex::Stream &stream) {
+                return dir.compare(0, stream.prefix.size(), stream.prefix) == 0;
+            });
+            if (!known.count(dir) && !inStream)
+                subtrees.push_back(Scan{dir, std::string(), 0, false});
+        }
+    }
+    for (const auto &stream : streams) {
+        auto &added = results[r++];
+        auto &head = results[r++];
+        if (bound(head, &last))
+            changed += m_meta->mergeRange(stream.prefix, std::string(), last, toListing(head.objects));
+        if (bound(added, &last))
+            changed += m_meta->mergeRange(stream.prefix, stream.last, last, toListing(added.objects));
+    }
+
+    if (!subtrees.empty()) {
+        if (!lister.scan(subtrees, &results)) {
+            m_meta->abortReconcile();
+            return false;
+        }
+        for (size_t i = 0; i < subtrees.size(); i++) {
+            if (bound(results[i], &last))
+                changed += m_meta->mergeRange(subtrees[i].prefix, std::string(), last, toListing(results[i].objects));
+        }
+    }
+
+    m_meta->finishIncremental();
+    LOGD << "Metadata index rescan: " << streams.size() << " streams, " << parents.size() << " directories, "
+         << subtrees.size() << " new subtrees, " << changed << " keys changed";
+    return true;
+}
+
+bool S3Storage::test_bucket(bool retry) const
     {
         S3ResponseHandler responseHandler =
                 {
@@ -1378,9 +3288,10 @@ bool S3Storage::test_bucket() const
             S3_test_bucket(S3ProtocolHTTPS, S3UriStylePath, m_access_key.c_str(), m_secret_key.c_str(), nullptr,
                            m_host.c_str(), m_bucket_name.c_str(), nullptr, sizeof(locationConstraint),
                            locationConstraint, nullptr, 20000, &responseHandler, &context);
-        } while (S3_status_is_retryable(context.status) && should_retry());
-
+        } while (retry && S3_status_is_retryable(context.status) && should_retry());
 
+        if (!error)
+            m_retrySleep = 1;
         LOGD << "Test bucket:" << !error;
         return !error;
     }
@@ -1489,17 +3400,40 @@ S3IODevice::S3IODevice(
         const std::string  &access_key,
         const std::string  &secret_key,
         const std::string  &host,
-        const std::string  &bucket_name
+        const std::string  &bucket_name,
+        const S3Options    &options,
+        const std::shared_ptr<UploadQueue> &uploads,
+        const std::shared_ptr<LocalStore> &local,
+        const std::shared_ptr<PackStore> &packs,
+        const std::shared_ptr<MetadataIndex> &meta
 )
     : m_mode(mode),
         m_pos(0),
         m_uri(uri),
         m_altered(false),
         m_localsize(0),
+        m_hasBase(false),
+        m_baseSize(0),
         m_access_key(access_key),
         m_secret_key(secret_key),
         m_host(host),
-        m_bucket_name(bucket_name)
+        m_bucket_name(bucket_name),
+        m_options(options),
+        m_uploads(uploads),
+        m_streaming(false),
+        m_streamFailed(false),
+        m_shipped(options.part_size),
+        m_lastPartStart(0),
+        m_lastPartDirty(false),
+        m_lazy(false),
+        m_readEnd(0),
+        m_sparse(false),
+        m_remoteSize(0),
+        m_local(local),
+        m_packs(packs),
+        m_packed(false),
+        m_packable(false),
+        m_meta(meta)
 {
     //  If file opened for read-only and no such file uri in storage throw BadUrl
     //  If file opened for write and no such file uri in stor - create it.
@@ -1519,6 +3453,52 @@ S3IODevice::S3IODevice(
     m_localfile = aux::getRandomFileName() + "_" + remoteFile;
     bool fileExists = false;
 
+    if (m_local && m_local->handles(m_uri))
+    {
+        // No round trip: all I/O goes to the primary copy, the bucket gets snapshots of it
+        m_localfile = m_local->path(m_uri);
+        bool write = (mode & io::WriteOnly) != 0;
+        m_localCopy = m_local->open(m_uri, write);
+
+        std::lock_guard<std::mutex> primary(m_localCopy->lock);
+        if ((!m_local->exists(m_uri, nullptr) && !fetchPrimary(mode)) || !m_staging.open(m_localfile)) {
+            m_local->close(m_uri, m_localCopy, write);
+            throw std::runtime_error("Couldn't open local copy:" + m_uri);
+        }
+        return;
+    }
+
+
+    uint64_t pending_size = 0;
+    if (m_uploads && m_uploads->pendingSize(m_uri, &pending_size)) {
+        // The newest data hasn't reached the bucket yet, start from the staged copy
+        if (!m_uploads->snapshot(m_uri, m_localfile, (mode & io::WriteOnly) != 0)
+            || !m_staging.open(m_localfile))
+            throw std::runtime_error("Couldn't take pending copy:" + m_uri);
+        return;
+    }
+
+
+    if (m_packs && m_packs->find(m_uri, nullptr))
+    {
+        // Small object: one ranged GET of its pack, staged in RAM
+        std::vector<char> data;
+        m_staging.openMemory(m_localfile, std::max(m_options.memory_staging_size, m_options.pack_threshold));
+        char *dst = m_packs->read(m_uri, &data) ? m_staging.prepare(data.size()) : nullptr;
+        if (!dst)
+            throw std::runtime_error("Couldn't read packed object:" + m_uri);
+        memcpy(dst, data.data(), data.size());
+
+        aux::Md5 md5;
+        md5.update(dst, data.size());
+        m_baseMd5 = md5.digest();
+        m_baseSize = data.size();
+        m_hasBase = true;
+        m_packed = true;
+        m_packable = true;
+        return;
+    }
+
 
     bool error = false;
     BaseContext base_context(error);
@@ -1537,271 +3517,997 @@ S3IODevice::S3IODevice(
     bucketContext.securityToken     = nullptr;
 
 
-    S3_head_object(&bucketContext, m_uri.c_str(), nullptr, 0, &responseHandler, &base_context);
+    // New recordings during an outage go to the spool, no use waiting for HEAD to time out
+    bool offline = m_uploads && m_uploads->spooling() && !m_uploads->online() && !(mode & io::ReadOnly);
+    if (offline)
+        error = true;
+    else
+        S3_head_object(&bucketContext, m_uri.c_str(), nullptr, 0, &responseHandler, &base_context);
 
 
     fileExists = !error;
+    // Offline a plain object may exist, a packed one would hide it
+    m_packable = m_packs && !fileExists && !offline;
+
+    // Compressed objects are staged and read by their logical size
+    bool compressed = fileExists && base_context.encoding == kCompressedEncoding;
+    uint64_t logical_size = compressed ? base_context.logical_size : base_context.content_length;
+    if (compressed && !aux::compressionAvailable())
+        throw std::runtime_error("Compressed object, built without zstd:" + m_uri);
+
+    // Unreachable isn't missing: a copy that may have to be merged with the object can't be made blind
+    if (error && !offline && (mode & io::ReadOnly) && S3_status_is_retryable(base_context.status))
+        throw std::runtime_error("Bucket unreachable:" + m_uri);
+
+
+//    LOGD << "Head complete, mode:" << mode << ", error:" << error;
+
+
+    if (mode & io::WriteOnly)
+    {
+//        LOGD << "Open write:" << mode;
+        if (!fileExists && m_options.streaming_upload && !(mode & io::ReadOnly))
+        {
+            // Nothing to merge with, so data goes to the bucket straight from write().
+            // Multipart upload is started with the second full part, part 1 waits in
+            // memory for header patches, small objects end up as a single PUT in flush().
+            m_streaming = true;
+            return;
+        }
+
+        if (!fileExists && m_options.memory_staging_size > 0)
+        {
+            // Most new objects are tiny, the file appears only if this one outgrows RAM
+            m_staging.openMemory(m_localfile, m_options.memory_staging_size);
+            return;
+        }
+
+        if (fileExists && !compressed && base_context.content_length >= m_options.multipart_threshold)
+        {
+            // Nothing is fetched up front: read() pulls the ranges it touches and
+            // flush() copies untouched parts server side
+            m_sparse = true;
+            m_etag = base_context.etag;
+            m_remoteSize = base_context.content_length;
+
+            int fd = ::open(m_localfile.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            bool ok = fd != -1 && ftruncate(fd, m_remoteSize) == 0;
+            if (fd != -1)
+                ::close(fd);
+
+            if (!ok || !m_staging.open(m_localfile)) {
+                remove(m_localfile.c_str());
+                throw std::runtime_error("Couldn't create sparse copy:" + m_uri);
+            }
+            return;
+        }
+
+        if (fileExists && logical_size <= m_options.memory_staging_size)
+        {
+            uint64_t size = logical_size;
+            m_staging.openMemory(m_localfile, m_options.memory_staging_size);
+
+            char *dst = m_staging.prepare(size);
+            if (compressed) {
+                std::vector<char> packed(base_context.content_length), data;
+                if (!dst || !getRange(bucketContext, m_uri, base_context.etag, 0, packed.size(), packed.data())
+                    || !aux::decompressBuffer(packed.data(), packed.size(), &data) || data.size() != size)
+                    throw std::runtime_error("Couldn't download file");
+                memcpy(dst, data.data(), size);
+            } else if (!dst || (size && !getRange(bucketContext, m_uri, base_context.etag, 0, size, dst))) {
+                throw std::runtime_error("Couldn't download file");
+            }
+
+            aux::Md5 md5;
+            md5.update(dst, size);
+            m_baseMd5 = md5.digest();
+            m_baseSize = size;
+            m_hasBase = true;
+            return;
+        }
+
+        if (!fileExists)
+        {
+            FILE *f = fopen(m_localfile.c_str(), "wb");
+            if (f == NULL) {
+                throw std::runtime_error("Couldn't open file for writing");
+                return;
+            }
+
+
+            fclose(f);
+
+
+            /*m_altered = true;
+            put_object_callback_data data;
+
+
+            data.contentLength = 0;
+            S3PutObjectHandler putObjectHandler =
+                    {
+                            responseHandler,
+                            &putObjectDataCallback
+                    };
+
+
+            S3BucketContext bucketContext;
+            bool error = false;
+            PutObject context(data, error);
+
+
+            bucketContext.accessKeyId       = m_access_key.c_str();
+            bucketContext.secretAccessKey   = m_secret_key.c_str();
+            bucketContext.authRegion        = nullptr;
+            bucketContext.bucketName        = m_bucket_name.c_str();
+            bucketContext.hostName          = m_host.c_str();
+            bucketContext.protocol          = S3ProtocolHTTPS;
+            bucketContext.uriStyle
+             = S3UriStylePath;
+            bucketContext.securityToken     = nullptr;
+
+
+            S3_put_object(&bucketContext, m_uri.c_str(), 0, NULL, NULL, 0, &putObjectHandler, &context);
+            fclose(data.infile);
+
+
+            if(error) {
+                LOGE << "Couldn't put empty file:" << m_uri;
+            }*/
+        }
+        else
+        {
+            FILE *f = fopen(m_localfile.c_str(), "wb");
+            if (f == NULL) {
+                throw std::runtime_error("Couldn't open file for writing");
+                return;
+            }
+
+
+            aux::ObjectChecksums checksums;
+            checksums.parse(base_context.crc32c, base_context.crc32c_parts);
+            bool ok = compressed
+                      ? downloadPacked(f, base_context.etag, base_context.content_length, logical_size, checksums)
+                      : download(f, base_context.etag, base_context.content_length, checksums);
+            if(!ok){
+                fclose(f);
+                remove(m_localfile.c_str());
+                throw std::runtime_error("Couldn't download file");
+                return;
+            }
+
+
+            fclose(f);
+            m_hasBase = true;
+        }
+    }
+    else if (mode & io::ReadOnly)
+    {
+        if(!fileExists){
+            throw std::runtime_error("Open readonly file but it doesn't exists:" + m_uri);
+            return;
+        }
+
+        // HEAD above is all we need, read() fetches ranges on demand
+        m_lazy = true;
+        m_etag = base_context.etag;
+
+        std::string cached_etag = DiskCache::instance().etag(m_bucket_name, m_uri);
+        if (!cached_etag.empty() && cached_etag != m_etag)
+            DiskCache::instance().invalidate(m_bucket_name, m_uri);
+
+        std::shared_ptr<aux::SeekTable> table;
+        if (compressed) {
+            // Every frame decompresses on its own, ranges are mapped through the seek table
+            table = std::make_shared<aux::SeekTable>();
+            if (!fetchSeekTable(bucketContext, m_uri, base_context.etag, base_context.content_length, table.get())
+                || table->logicalSize() != logical_size)
+                throw std::runtime_error("Couldn't read seek table:" + m_uri);
+        }
+
+        m_localsize = logical_size;
+        m_readAhead = std::make_shared<ReadAhead>(
+                m_access_key, m_secret_key, m_host, m_bucket_name, m_uri, m_etag, m_localsize, m_options, table);
+        return;
+    }
+
+
+     if (!m_staging.open(m_localfile)) {
+         remove(m_localfile.c_str());
+         throw std::runtime_error("Couldn't open local copy:" + m_uri);
+     }
+
+    // One more pass over a copy that is small enough for a single PUT anyway
+    m_baseSize = m_staging.size();
+    if (m_hasBase && !stagedMd5(0, m_baseSize, &m_baseMd5))
+        m_hasBase = false;
+
+
+}
+
+
+// Checksums are of the stored bytes, so those land in a file of their own first
+bool S3IODevice::downloadPacked(FILE *f, const std::string &etag, uint64_t stored, uint64_t logical,
+                                const aux::ObjectChecksums &expected)
+{
+    std::string packed = aux::getRandomFileName() + kPackedSuffix;
+    FILE *p = fopen(packed.c_str(), "wb+");
+    uint64_t unpacked = 0;
+    bool ok = p && download(p, etag, stored, expected, false)
+              && fflush(p) == 0
+              && aux::decompressFile(fileno(p), stored, fileno(f), &unpacked)
+              && unpacked == logical;
+    if (p)
+        fclose(p);
+    remove(packed.c_str());
+    return ok;
+}
+
+
+bool S3IODevice::fetchPrimary(int mode)
+{
+    bool error = false;
+    BaseContext base_context(error);
+    S3BucketContext bucketContext;
+    fillBucketContext(bucketContext, m_access_key, m_secret_key, m_host, m_bucket_name);
+    S3_head_object(&bucketContext, m_uri.c_str(), nullptr, 0, &responseHandler, &base_context);
+
+    // A new database is created locally, but not over one the bucket couldn't be asked about
+    if (error && (!(mode & io::WriteOnly) || S3_status_is_retryable(base_context.status)))
+        return false;
+
+    std::string partial = m_local->partialPath(m_uri);
+    FILE *f = fopen(partial.c_str(), "wb+");
+    bool ok = f != nullptr;
+    if (ok && !error) {
+        aux::ObjectChecksums checksums;
+        checksums.parse(base_context.crc32c, base_context.crc32c_parts);
+        if (base_context.encoding == kCompressedEncoding)
+            ok = aux::compressionAvailable()
+                 && downloadPacked(f, base_context.etag, base_context.content_length, base_context.logical_size,
+                                   checksums);
+        else
+            ok = download(f, base_context.etag, base_context.content_length, checksums, false);
+    }
+    if (f)
+        ok = fclose(f) == 0 && ok;
+
+    if (ok && rename(partial.c_str(), m_localfile.c_str()) == 0) {
+        LOGD << "Local copy made primary:" << m_uri;
+        return true;
+    }
+    remove(partial.c_str());
+    return false;
+}
+
+
+// Whole object into f. When every block of the current ETag is in the disk cache
+// a conditional GET revalidates them and the copy is assembled from disk.
+// Large objects are fetched as concurrent ranges.
+bool S3IODevice::download(FILE *f, const std::string &etag, uint64_t size, const aux::ObjectChecksums &expected,
+                          bool cacheable)
+{
+    DiskCache& disk = DiskCache::instance();
+    uint64_t block_size = m_options.read_block_size;
+    uint64_t blocks = (size + block_size - 1) / block_size;
+    bool cached = cacheable && !etag.empty() && disk.hasBlocks(m_bucket_name, m_uri, etag, blocks);
+
+    S3BucketContext bucketContext;
+    fillBucketContext(bucketContext, m_access_key, m_secret_key, m_host, m_bucket_name);
+
+    // CRCs are taken per segment of the upload, so a mismatch costs one segment only
+    uint64_t segment = expected.segmentCrcs.empty() ? m_options.part_size : expected.segmentSize;
+    // Objects uploaded without checksums still have their MD5 as a plain ETag
+    bool check_md5 = !expected.hasCrc && aux::isMd5Etag(etag);
+
+    std::string got_etag;
+    std::vector<uint32_t> crcs;
+    uint64_t received_bytes = size;
+    bool whole_body = true;
+    if (cached) {
+        S3GetConditions conditions;
+        conditions.ifModifiedSince      = -1;
+        conditions.ifNotModifiedSince   = -1;
+        conditions.ifMatchETag          = nullptr;
+        conditions.ifNotMatchETag       = etag.c_str();
+
+        bool error = false;
+        aux::SegmentCrc received(segment);
+        aux::Md5 md5;
+        GetObject context(f, error, &received, check_md5 ? &md5 : nullptr);
+        S3_get_object(&bucketContext, m_uri.c_str(), &conditions, 0, 0, NULL, 120000, &getObjectHandler, &context);
+
+        if (notModified(context, ftell(f), etag)) {
+            for (uint64_t block = 0; block < blocks; block++) {
+                auto data = disk.get(m_bucket_name, m_uri, etag, block);
+                if (!data || fwrite(data->data(), 1, data->size(), f) != data->size()) {
+                    // lost a block meanwhile, go the long way
+                    LOGD << "Disk cache incomplete for:" << m_uri;
+                    disk.invalidate(m_bucket_name, m_uri);
+                    return fseek(f, 0, SEEK_SET) == 0 && download(f, etag, size, expected, cacheable);
+                }
+            }
+            LOGD << "Not modified, taken from disk cache:" << m_uri;
+            return true;
+        }
+
+        if (error) {
+            // Anything but a 304 is a miss, the object is fetched as if nothing was cached
+            LOGD << "Revalidation failed, status " << (int) context.status << ", fetching:" << m_uri;
+            cached = false;
+        } else {
+            got_etag = context.etag;
+            crcs = received.crcs();
+            received_bytes = received.bytes();
+            if (check_md5 && !aux::etagEquals(got_etag, aux::Md5::toHex(md5.digest())))
+                whole_body = false;
+        }
+    }
+
+    if (!cached) {
+        bool done = false;
+        if (size >= m_options.parallel_download_threshold && m_options.download_concurrency > 1 && fflush(f) == 0) {
+            done = ftruncate(fileno(f), size) == 0
+                   && parallelDownload(bucketContext, m_uri, etag, size, fileno(f),
+                                       segment, m_options.download_concurrency, &crcs);
+            if (done)
+                got_etag = etag;
+            else
+                LOGE << "Parallel download failed, retry in one piece:" << m_uri;
+        }
+
+        for (int attempt = 0; !done && attempt < kMultipartRetries; attempt++) {
+            if (ftruncate(fileno(f), 0) != 0 || fseek(f, 0, SEEK_SET) != 0)
+                return false;
+
+            bool error = false;
+            aux::SegmentCrc received(segment);
+            aux::Md5 md5;
+            GetObject context(f, error, &received, check_md5 ? &md5 : nullptr);
+            S3_get_object(&bucketContext, m_uri.c_str(), NULL, 0, 0, NULL, 120000, &getObjectHandler, &context);
+            if (error)
+                return false;
+            got_etag = context.etag;
+            crcs = received.crcs();
+            received_bytes = received.bytes();
+
+            // A whole body MD5 can only be fixed by fetching the body again
+            done = !check_md5 || aux::etagEquals(got_etag, aux::Md5::toHex(md5.digest()));
+            if (!done)
+                LOGE << "MD5 mismatch on " << m_uri << ", fetching it again";
+        }
+        whole_body = done;
+    }
+
+    if (!whole_body || fflush(f) != 0)
+        return false;
+
+    // A body cut short without an error; checksums below refetch what is missing,
+    // without them the tail is fetched here
+    if (received_bytes < size) {
+        LOGE << "Short body " << received_bytes << " of " << size << " for " << m_uri;
+        if (!expected.hasCrc && expected.segmentCrcs.empty()
+            && !getRangeToFile(bucketContext, m_uri, got_etag, received_bytes, size - received_bytes, fileno(f)))
+            return false;
+    }
+
+    if (!verifyDownload(bucketContext, m_uri, got_etag, size, fileno(f), expected, segment, crcs))
+        return false;
+
+    // Keep this version for the next open
+    if (cacheable && disk.enabled() && !got_etag.empty() && fflush(f) == 0) {
+        FILE *in = fopen(m_localfile.c_str(), "rb");
+        for (uint64_t block = 0; in; block++) {
+            auto data = std::make_shared<std::vector<char>>(block_size);
+            size_t got = fread(data->data(), 1, block_size, in);
+            if (got == 0)
+                break;
+            data->resize(got);
+            disk.put(m_bucket_name, m_uri, got_etag, block, data);
+        }
+        if (in)
+            fclose(in);
+    }
+    return true;
+}
+
+
+S3IODevice::~S3IODevice()
+{
+   LOGD << "Close IODevice:" << m_uri << ", " << m_pos;
+
+
+    if (m_readAhead)
+        m_readAhead->cancelAll();
+
+    if (m_localCopy) {
+        // The primary copy stays, writes are on disk already
+        m_staging.close();
+        m_local->close(m_uri, m_localCopy, (m_mode & io::WriteOnly) != 0);
+        return;
+    }
+
+    if (m_altered && unchanged()) {
+        LOGD << "Same bytes written back, not uploaded:" << m_uri;
+        m_altered = false;
+    }
+
+    // Small objects go into a pack instead of a PUT of their own
+    if (m_altered && m_packable && !m_streaming && m_staging.size() < m_options.pack_threshold && packObject()) {
+        remove(m_localfile.c_str());
+        return;
+    }
+    // Outgrew the pack, goes up as a plain object from here on
+    if (m_altered && m_packed)
+        m_packs->remove(m_uri);
+
+    // Objects staged in RAM or sparsely are flushed right here, an older queued copy must not win.
+    // While the bucket is unreachable RAM staged ones go to the spool like files.
+    bool spool = m_uploads && m_uploads->spooling() && !m_streaming && !m_sparse;
+    bool flushHere = m_streaming || m_sparse || (m_staging.inMemory() && !(spool && !m_uploads->online()));
+    if (m_uploads && m_altered && flushHere && !m_streaming)
+        m_uploads->cancel(m_uri);
+
+    // Write-behind: the queue takes the staged file over and uploads it later
+    if (m_uploads && m_altered && !flushHere) {
+        uint64_t size = m_staging.size();
+        auto digest = finishDigest();
+        if (m_staging.persist() && m_staging.close()) {
+            if (m_uploads->push(m_uri, m_localfile, size, digest))
+                return;
+            // Spool full: one last try right here
+            if (!m_staging.open(m_localfile))
+                LOGE << "Couldn't reopen staged copy:" << m_uri;
+        }
+    }
+
+    // A PUT that failed as the bucket went away still has the spool
+    bool flushed = flush();
+    if (flushed && m_altered && m_meta)
+        m_meta->put(m_uri, m_streaming ? (uint64_t) m_localsize : m_staging.size());
+    if (!flushed && spool && m_staging.inMemory()) {
+        uint64_t size = m_staging.size();
+        if (m_staging.persist() && m_staging.close() && m_uploads->push(m_uri, m_localfile, size, nullptr))
+            return;
+    }
+    remove(m_localfile.c_str());
+    //m_impl->Quit();
+}
+
+
+bool S3IODevice::packObject()
+{
+    if (m_staging.inMemory())
+        return m_packs->add(m_uri, m_staging.data(), m_staging.size());
+
+    std::vector<char> data(m_staging.size());
+    return m_staging.read(0, data.data(), data.size()) == (long long) data.size()
+           && m_packs->add(m_uri, data.data(), data.size());
+}
+
+
+// Since there is no explicit 'close' function,
+// synchronization attempt is made in this function and
+// this function is called from destructor.
+// That's why all possible errors are discarded.
+bool S3IODevice::flush()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
 
 
-//    LOGD << "Head complete, mode:" << mode << ", error:" << error;
+    if (m_streaming) {
+        if (m_altered && !m_streamFailed && !finishStreaming()) {
+            LOGE << "Streaming upload failed:" << m_uri;
+            return false;
+        }
+        return !m_streamFailed;
+    }
 
+    if (m_altered && m_sparse) {
+        if (!sparseUpload()) {
+            LOGE << "Couldn't upload:" << m_uri;
+            return false;
+        }
+        return true;
+    }
 
-    if (mode & io::WriteOnly)
-    {
-//        LOGD << "Open write:" << mode;
-        if (!fileExists)
-        {
-            FILE *f = fopen(m_localfile.c_str(), "wb");
-            if (f == NULL) {
-                throw std::runtime_error("Couldn't open file for writing");
-                return;
-            }
+    if (m_altered && m_staging.inMemory()) {
+        S3BucketContext bucketContext;
+        fillBucketContext(bucketContext, m_access_key, m_secret_key, m_host, m_bucket_name);
 
+        if (!putObject(bucketContext, m_uri, m_staging.data(), m_staging.size(), m_options)) {
+            LOGE << "Couldn't put object:" << m_uri;
+            return false;
+        }
+        return true;
+    }
 
-            fclose(f);
+    if(m_altered) {
+        S3BucketContext bucketContext;
+        fillBucketContext(bucketContext, m_access_key, m_secret_key, m_host, m_bucket_name);
 
+        auto digest = finishDigest();
+        if (!m_staging.flush() || !uploadFile(bucketContext, m_uri, m_localfile, m_staging.size(), m_options, digest.get())) {
+            LOGE << "Couldn't upload:" << m_uri;
+            return false;
+        }
+    }
+    return true;
+}
 
-            /*m_altered = true;
-            put_object_callback_data data;
 
+uint32_t STORAGE_METHOD_CALL S3IODevice::write(
+    const void     *src,
+    const uint32_t  size,
+    int            *ecode
+)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (ecode)
+        *ecode = error::NoError;
 
-            data.contentLength = 0;
-            S3PutObjectHandler putObjectHandler =
-                    {
-                            responseHandler,
-                            &putObjectDataCallback
-                    };
 
+    //LOGD << "********** Write:" << size << " to" << m_uri << ", m_pos:" << m_pos;
 
-            S3BucketContext bucketContext;
-            bool error = false;
-            PutObject context(data, error);
 
+    if (!(m_mode & io::WriteOnly))
+    {
+        *ecode = error::WriteNotSupported;
+        return 0;
+    }
 
-            bucketContext.accessKeyId       = m_access_key.c_str();
-            bucketContext.secretAccessKey   = m_secret_key.c_str();
-            bucketContext.authRegion        = nullptr;
-            bucketContext.bucketName        = m_bucket_name.c_str();
-            bucketContext.hostName          = m_host.c_str();
-            bucketContext.protocol          = S3ProtocolHTTPS;
-            bucketContext.uriStyle
-             = S3UriStylePath;
-            bucketContext.securityToken     = nullptr;
 
+    if (m_streaming && !m_streamFailed && !streamReachable(m_pos, size))
+    {
+        LOGD << "write: part at " << m_pos << " is in the bucket already, staging " << m_uri;
+        if (!leaveStreaming())
+            m_streamFailed = true;
+    }
 
-            S3_put_object(&bucketContext, m_uri.c_str(), 0, NULL, NULL, 0, &putObjectHandler, &context);
-            fclose(data.infile);
+    if (m_streaming)
+    {
+        if (m_streamFailed || !streamWrite(m_pos, (const char*) src, size))
+        {
+            LOGE << "write: streaming upload failed at " << m_pos << " to " << m_uri;
+            if (!m_streamFailed)
+                abortStreaming();
+            if (ecode)
+                *ecode = error::UnknownError;
+            return 0;
+        }
 
+        m_pos += size;
+        if (m_localsize < m_pos)
+            m_localsize = m_pos;
+        m_altered = true;
+        return size;
+    }
 
-            if(error) {
-                LOGE << "Couldn't put empty file:" << m_uri;
-            }*/
-        }
-        else
-        {
-            FILE *f = fopen(m_localfile.c_str(), "wb");
-            if (f == NULL) {
-                throw std::runtime_error("Couldn't open file for writing");
-                return;
-            }
+    if (m_sparse)
+        keepPartBase(m_pos, size);
 
+    // A snapshot of the primary copy sees a write whole or not at all
+    std::unique_lock<std::mutex> primary;
+    if (m_localCopy)
+        primary = std::unique_lock<std::mutex>(m_localCopy->lock);
 
-            bool error = false;
-            GetObject context(f, error);
-            //LOGD << "Get object";
-            S3_get_object(&bucketContext, m_uri.c_str(), NULL, 0, 0, NULL, 120000, &getObjectHandler, &context);
-//            LOGD << "Get object end";
-            if(error){
-                fclose(f);
-                remove(m_localfile.c_str());
-                throw std::runtime_error("Couldn't download file");
-                return;
-            }
+    if (!m_staging.write(m_pos, src, size) || (m_localCopy && !m_staging.flush()))
+    {
+        LOGE << "write:error";
+        if (ecode)
+            *ecode = error::UnknownError;
+        return 0;
+    }
 
 
-            fclose(f);
-        }
+    if (m_localCopy)
+    {
+        m_localCopy->generation++;
+        m_localCopy->changed = time(nullptr);
     }
-    else if (mode & io::ReadOnly)
+    else if (m_sparse)
     {
-        if(!fileExists){
-            throw std::runtime_error("Open readonly file but it doesn't exists:" + m_uri);
-            return;
-        }
-
-        FILE *f = fopen(m_localfile.c_str(), "wb");
-        if(!f){
-            throw std::runtime_error("Couldn't open file for reading:" + m_uri);
-            return;
-        }
+        m_dirty.add(m_pos, m_pos + size);
+        m_present.add(m_pos, m_pos + size);
+    }
+    else if (!m_staging.inMemory())
+    {   // hashed while the bytes are at hand, flush() needn't read the copy again
+        if (!m_digest)
+            m_digest = std::make_shared<aux::UploadDigest>(m_options.part_size);
+        m_digest->update(m_pos, src, size);
+    }
+    m_pos += size;
+    m_altered = true;
+    return size;
+}
 
 
-        bool error = false;
+// Checksums of the staged copy for its upload. Only what writes out of order
+// made stale is hashed again from the copy. Null if that read fails.
+std::shared_ptr<aux::UploadDigest> S3IODevice::finishDigest()
+{
+    if (!m_digest)
+        m_digest = std::make_shared<aux::UploadDigest>(m_options.part_size);
 
+    uint64_t size = m_staging.size();
+    auto read = [this](uint64_t offset, char *dst, size_t n) {
+        return m_staging.read(offset, dst, n) == (long long) n;
+    };
 
-        GetObject context(f, error);
-        S3BucketContext bucketContext;
+    if (!m_digest->finalize(size, read, size < m_options.multipart_threshold)) {
+        LOGE << "Couldn't checksum staged copy of " << m_uri;
+        return nullptr;
+    }
+    return m_digest;
+}
 
 
-        bucketContext.accessKeyId       = access_key.c_str();
-        bucketContext.secretAccessKey   = secret_key.c_str();
-        bucketContext.authRegion        = nullptr;
-        bucketContext.bucketName        = bucket_name.c_str();
-        bucketContext.hostName          = host.c_str();
-        bucketContext.protocol          = S3ProtocolHTTPS;
-        bucketContext.uriStyle          = S3UriStylePath;
-        bucketContext.securityToken     = nullptr;
+// Sparse mode: makes [pos, pos + size) of the staged copy valid by fetching
+// the read_block_size aligned pieces it doesn't have yet.
+bool S3IODevice::fillRange(uint64_t pos, uint64_t size) const
+{
+    uint64_t block_size = m_options.read_block_size;
+    uint64_t from = pos / block_size * block_size;
+    uint64_t to = std::min(m_remoteSize, (pos + size + block_size - 1) / block_size * block_size);
+    if (from >= to)
+        return true;
 
+    auto gaps = m_present.gaps(from, to);
+    if (gaps.empty())
+        return true;
 
-        S3_get_object(&bucketContext, m_uri.c_str(), NULL, 0, 0, NULL, 120000, &getObjectHandler, &context);
+    S3BucketContext bucketContext;
+    fillBucketContext(bucketContext, m_access_key, m_secret_key, m_host, m_bucket_name);
 
-        if(error){
-            fclose(f);
-            remove(m_localfile.c_str());
-            throw std::runtime_error("Couldn't download file");
-            return;
+    for (const auto &gap : gaps) {
+        if (!getRangeToFile(bucketContext, m_uri, m_etag, gap.first, gap.second - gap.first, m_staging.fd())) {
+            LOGE << "Couldn't fetch range at " << gap.first << " of " << m_uri;
+            return false;
         }
-        fclose(f);
+        m_present.add(gap.first, gap.second);
     }
+    return true;
+}
 
 
-     // calculate local file size
-     if ((m_localsize = aux::getFileSize(m_localfile.c_str())) == -1){
-         LOGE << "Couldn't calculate file size:" << m_localsize;
-         return;//throw aux::InternalErrorException("local file calculate size failed");
-     }
+// MD5 of [pos, pos + size) of the staged copy
+bool S3IODevice::stagedMd5(uint64_t pos, uint64_t size, aux::Md5::Digest *digest) const
+{
+    aux::Md5 md5;
+    std::vector<char> chunk((size_t) std::min<uint64_t>(size, 1024 * 1024));
+    for (uint64_t done = 0; done < size;) {
+        size_t n = (size_t) std::min<uint64_t>(chunk.size(), size - done);
+        if (m_staging.read(pos + done, chunk.data(), n) != (long long) n)
+            return false;
+        md5.update(chunk.data(), n);
+        done += n;
+    }
+    *digest = md5.digest();
+    return true;
+}
 
 
-//     LOGD << "m_localsize:" << m_localsize;
+// Whether the staged copy still holds exactly what was downloaded at open.
+// Sparse copies are compared part by part in sparseUpload() instead.
+bool S3IODevice::unchanged()
+{
+    if (!m_hasBase || m_streaming || m_sparse || m_staging.size() != m_baseSize)
+        return false;
 
+    if (m_staging.inMemory()) {
+        aux::Md5 md5;
+        md5.update(m_staging.data(), m_baseSize);
+        return md5.digest() == m_baseMd5;
+    }
 
+    auto digest = finishDigest();
+    return digest && digest->hasMd5() && digest->md5() == m_baseMd5;
 }
 
 
-S3IODevice::~S3IODevice()
+// Sparse mode: before [pos, pos + size) is first written, the remote parts it
+// touches are fetched and hashed, so sparseUpload() can tell a rewrite of the
+// same bytes from a change. Those parts would be fetched by the upload anyway.
+void S3IODevice::keepPartBase(uint64_t pos, uint64_t size)
 {
-   LOGD << "Close IODevice:" << m_uri << ", " << m_pos;
-
+    uint64_t part_size = m_options.part_size;
+    for (uint64_t part = pos / part_size; part * part_size < std::min(pos + size, m_remoteSize); part++) {
+        uint64_t start = part * part_size;
+        uint64_t len = std::min(part_size, m_remoteSize - start);
+        if (m_partBase.count(part) || m_dirty.intersects(start, start + len))
+            continue;
 
-    flush();
-    remove(m_localfile.c_str());
-    //m_impl->Quit();
+        aux::Md5::Digest md5;
+        if (fillRange(start, len) && stagedMd5(start, len, &md5))
+            m_partBase[part] = md5;
+    }
 }
 
 
-// Since there is no explicit 'close' function,
-// synchronization attempt is made in this function and
-// this function is called from destructor.
-// That's why all possible errors are discarded.
-void S3IODevice::flush()
+// Sparse mode: rebuilds the object as a multipart upload where parts without
+// changes are copied from the current version server side.
+bool S3IODevice::sparseUpload()
 {
-    std::lock_guard<std::mutex> lock(m_mutex);
+    S3BucketContext bucketContext;
+    fillBucketContext(bucketContext, m_access_key, m_secret_key, m_host, m_bucket_name);
+
+    uint64_t size = m_staging.size();
+    // S3 allows at most 10000 parts
+    uint64_t part_size = std::max<uint64_t>(m_options.part_size, (size + 9999) / 10000);
+
+    uint64_t parts = (size + part_size - 1) / part_size;
+    std::vector<bool> changed(parts);
+    for (uint64_t part = 0; part < parts; part++) {
+        uint64_t start = part * part_size;
+        uint64_t end = std::min(size, start + part_size);
+        changed[part] = end > m_remoteSize || m_dirty.intersects(start, end);
+
+        // Changed parts are uploaded whole, so they need every byte locally
+        if (changed[part] && !fillRange(start, end - start))
+            return false;
+
+        // Written, but with the bytes that were there
+        auto base = m_partBase.find(part);
+        aux::Md5::Digest md5;
+        if (changed[part] && end <= m_remoteSize && part_size == m_options.part_size && base != m_partBase.end()
+            && stagedMd5(start, end - start, &md5) && md5 == base->second)
+            changed[part] = false;
+    }
+
+    if (size == m_remoteSize && std::find(changed.begin(), changed.end(), true) == changed.end()) {
+        LOGD << "Same bytes written back, not uploaded:" << m_uri;
+        return true;
+    }
 
+    if (!m_staging.flush())
+        return false;
+
+    std::string upload_id;
+    if (!initiateMultipart(bucketContext, m_uri, upload_id))
+        return false;
+
+    std::vector<std::string> etags(parts);
+    std::atomic<uint64_t> next(0);
+    std::atomic<bool> failed(false);
+    int fd = m_staging.fd();
+
+    auto worker = [&] {
+        S3BucketContext context = bucketContext;
+        for (uint64_t part; !failed && (part = next++) < parts;) {
+            uint64_t start = part * part_size;
+            uint64_t len = std::min(size, start + part_size) - start;
+
+            bool ok = changed[part]
+                      ? uploadPart(context, m_uri, upload_id, (int) part + 1, PutBuffer(fd, start, len), etags[part])
+                      : copyPart(context, m_uri, upload_id, (int) part + 1, start, len, etags[part]);
+            if (!ok)
+                failed = true;
+        }
+    };
 
-    if(m_altered) {
-        put_object_callback_data data;
+    std::vector<std::thread> threads;
+    for (uint64_t i = 1; i < std::min<uint64_t>(m_options.upload_concurrency, parts); i++)
+        threads.emplace_back(worker);
+    worker();
 
+    for (auto &t : threads)
+        t.join();
 
-        struct stat statbuf;
-        if (stat(m_localfile.c_str(), &statbuf) == -1) {
-            LOGE << "Culdn't get file size:" << m_localfile;
-            return;
+    // libs3 can't make UploadPartCopy conditional, so the source is checked once the copies
+    // are done: parts of a version that replaced ours since open must not be completed with
+    // our ranges
+    if (!failed && std::find(changed.begin(), changed.end(), false) != changed.end()) {
+        bool error = false;
+        BaseContext head(error);
+        S3_head_object(&bucketContext, m_uri.c_str(), nullptr, 0, &responseHandler, &head);
+        if (error || head.etag != m_etag) {
+            LOGE << "Object changed since it was opened, upload aborted:" << m_uri;
+            failed = true;
         }
+    }
 
+    if (failed || !completeMultipart(bucketContext, m_uri, upload_id, etags)) {
+        abortMultipart(bucketContext, m_uri, upload_id);
+        return false;
+    }
+    return true;
+}
 
-        int contentLength = statbuf.st_size;
-        data.contentLength = contentLength;
 
+// Part 1 lives in m_head, everything from m_shipped on in m_partBuf, and the
+// latest shipped part is kept in m_lastPart. Parts in between can't be patched.
+bool S3IODevice::streamReachable(uint64_t pos, size_t size) const
+{
+    uint64_t from = std::max<uint64_t>(pos, m_options.part_size);
+    uint64_t to = std::min<uint64_t>(pos + size, m_shipped);
 
-        if (!(data.infile = fopen(m_localfile.c_str(), "r"))) {
-            LOGE << "Couldn't open:" << m_localfile;
-            return;
-        }
+    return from >= to || (from >= m_lastPartStart && to <= m_lastPartStart + m_lastPart.size());
+}
 
 
-        bool error = false;
+bool S3IODevice::streamWrite(uint64_t pos, const char *src, size_t size)
+{
+    uint64_t part_size = m_options.part_size;
 
+    while (size > 0)
+    {
+        size_t n;
+        if (pos < part_size)
+        {
+            n = (size_t) std::min<uint64_t>(size, part_size - pos);
+            if (m_head.size() < pos + n)
+                m_head.resize(pos + n);
+            memcpy(m_head.data() + pos, src, n);
+        }
+        else if (pos >= m_shipped)
+        {
+            n = size;
+            size_t offset = (size_t)(pos - m_shipped);
+            if (m_partBuf.size() < offset + n)
+                m_partBuf.resize(offset + n);
+            memcpy(m_partBuf.data() + offset, src, n);
+        }
+        else
+        {   // streamReachable() made sure it is the kept part
+            n = (size_t) std::min<uint64_t>(size, m_lastPartStart + m_lastPart.size() - pos);
+            memcpy(m_lastPart.data() + (pos - m_lastPartStart), src, n);
+            m_lastPartDirty = true;
+        }
 
-        PutObject context(data);
-        BaseContext base_context(error, &context);
-        S3PutObjectHandler putObjectHandler =
-                {
-                        responseHandler,
-                        &putObjectDataCallback
-                };
+        pos += n;
+        src += n;
+        size -= n;
+    }
 
+    // Only complete parts are shipped here, the tail waits for more data or flush()
+    while (m_partBuf.size() > part_size)
+    {
+        if (!shipPart(part_size))
+            return false;
+    }
+    return true;
+}
 
-        S3BucketContext bucketContext;
 
+bool S3IODevice::shipPart(size_t len)
+{
+    S3BucketContext bucketContext;
+    fillBucketContext(bucketContext, m_access_key, m_secret_key, m_host, m_bucket_name);
 
-        bucketContext.accessKeyId       = m_access_key.c_str();
-        bucketContext.secretAccessKey   = m_secret_key.c_str();
-        bucketContext.authRegion        = nullptr;
-        bucketContext.bucketName        = m_bucket_name.c_str();
-        bucketContext.hostName          = m_host.c_str();
-        bucketContext.protocol          = S3ProtocolHTTPS;
-        bucketContext.uriStyle          = S3UriStylePath;
-        bucketContext.securityToken     = nullptr;
+    if (m_uploadId.empty() && !initiateMultipart(bucketContext, m_uri, m_uploadId))
+        return false;
 
+    // The kept part is about to be replaced, its patches go first
+    if (!reshipLastPart())
+        return false;
 
+    int part_number = (int)(m_shipped / m_options.part_size) + 1;
+    if (m_partEtags.size() < (size_t) part_number) {
+        m_partEtags.resize(part_number);
+        m_partMd5s.resize(part_number);
+    }
 
+    aux::Md5 md5;
+    md5.update(m_partBuf.data(), len);
+    m_partMd5s[part_number - 1] = md5.digest();
 
-        S3_put_object(&bucketContext, m_uri.c_str(), contentLength, NULL, NULL, 0, &putObjectHandler, &base_context);
-        fclose(data.infile);
-    }
+    if (!uploadPart(bucketContext, m_uri, m_uploadId, part_number, PutBuffer(m_partBuf.data(), len),
+                    m_partEtags[part_number - 1], &m_partMd5s[part_number - 1]))
+        return false;
+
+    m_lastPart.assign(m_partBuf.begin(), m_partBuf.begin() + len);
+    m_lastPartStart = m_shipped;
+    m_lastPartDirty = false;
+
+    m_partBuf.erase(m_partBuf.begin(), m_partBuf.begin() + len);
+    m_shipped += len;
+    return true;
 }
 
 
-uint32_t STORAGE_METHOD_CALL S3IODevice::write(
-    const void     *src,
-    const uint32_t  size,
-    int            *ecode
-)
+bool S3IODevice::reshipLastPart()
 {
-        int res;
-    std::lock_guard<std::mutex> lock(m_mutex);
-    if (ecode)
-        *ecode = error::NoError;
+    if (!m_lastPartDirty)
+        return true;
 
+    S3BucketContext bucketContext;
+    fillBucketContext(bucketContext, m_access_key, m_secret_key, m_host, m_bucket_name);
 
-    //LOGD << "********** Write:" << size << " to" << m_uri << ", m_pos:" << m_pos;
+    int part_number = (int)(m_lastPartStart / m_options.part_size) + 1;
+    aux::Md5 md5;
+    md5.update(m_lastPart.data(), m_lastPart.size());
+    m_partMd5s[part_number - 1] = md5.digest();
 
+    if (!uploadPart(bucketContext, m_uri, m_uploadId, part_number, PutBuffer(m_lastPart.data(), m_lastPart.size()),
+                    m_partEtags[part_number - 1], &m_partMd5s[part_number - 1]))
+        return false;
 
-    if (!(m_mode & io::WriteOnly))
-    {
-        *ecode = error::WriteNotSupported;
-        return 0;
-    }
+    m_lastPartDirty = false;
+    return true;
+}
 
 
-    FILE * f = fopen(m_localfile.c_str(), "r+b");
-    if (f == NULL)
-        goto bad_end;
+// Uploads what is still in memory and completes the object
+bool S3IODevice::finishStreaming()
+{
+    S3BucketContext bucketContext;
+    fillBucketContext(bucketContext, m_access_key, m_secret_key, m_host, m_bucket_name);
+
+    if (m_uploadId.empty()) {
+        // Whole object fits into one PUT, a small one into a pack
+        std::vector<char> whole;
+        const std::vector<char> *body = &m_head;
+        if (!m_partBuf.empty()) {
+            whole = m_head;
+            whole.resize(m_shipped);
+            whole.insert(whole.end(), m_partBuf.begin(), m_partBuf.end());
+            body = &whole;
+        }
+        if (m_packable && body->size() < m_options.pack_threshold)
+            return m_packs->add(m_uri, body->data(), body->size());
+        return putBuffer(bucketContext, m_uri, body->data(), body->size());
+    }
 
+    // Part 2 starts at part_size: a head written only in places is zero padded up to it,
+    // but only when something past it was written. Otherwise the head is the whole object.
+    if (m_shipped + m_partBuf.size() > m_options.part_size)
+        m_head.resize(m_options.part_size);
+    aux::Md5 md5;
+    md5.update(m_head.data(), m_head.size());
+    m_partMd5s[0] = md5.digest();
+
+    if (!reshipLastPart()
+        || (!m_partBuf.empty() && !shipPart(m_partBuf.size()))
+        || !uploadPart(bucketContext, m_uri, m_uploadId, 1, PutBuffer(m_head.data(), m_head.size()),
+                       m_partEtags[0], &m_partMd5s[0])
+        || !completeMultipart(bucketContext, m_uri, m_uploadId, m_partEtags, aux::multipartEtag(m_partMd5s))) {
+        abortStreaming();
+        return false;
+    }
 
-    if (fseek(f, (int)m_pos, SEEK_SET) != 0)
-        goto bad_end;
+    m_uploadId.clear();
+    return true;
+}
 
 
-    res = fwrite(src, 1, size, f);
-    m_pos += size;
-    m_localsize += size;
-    m_altered = true;
-    fclose(f);
-    //LOGD << "Write returns:" << res;
-    return size;
+// A write went to a part that is in the bucket and not kept in memory:
+// complete the object and carry on with a staged copy of it.
+bool S3IODevice::leaveStreaming()
+{
+    if (!finishStreaming())
+        return false;
 
+    m_streaming = false;
+    std::vector<char>().swap(m_head);
+    std::vector<char>().swap(m_partBuf);
+    std::vector<char>().swap(m_lastPart);
 
-bad_end:
-    if (f != NULL)
+    FILE *f = fopen(m_localfile.c_str(), "wb");
+    bool ok = f && download(f, "", m_localsize, aux::ObjectChecksums());
+    if (f)
         fclose(f);
 
+    if (!ok || !m_staging.open(m_localfile)) {
+        m_streaming = true;
+        return false;
+    }
+    return true;
+}
 
-    LOGE << "write:error";
 
+void S3IODevice::abortStreaming()
+{
+    m_streamFailed = true;
+
+    if (!m_uploadId.empty()) {
+        S3BucketContext bucketContext;
+        fillBucketContext(bucketContext, m_access_key, m_secret_key, m_host, m_bucket_name);
+        abortMultipart(bucketContext, m_uri, m_uploadId);
+        m_uploadId.clear();
+    }
 
-    *ecode = error::UnknownError;
-    return 0;
+    std::vector<char>().swap(m_head);
+    std::vector<char>().swap(m_partBuf);
+    std::vector<char>().swap(m_lastPart);
 }
 
 
@@ -1828,32 +4534,58 @@ uint32_t STORAGE_METHOD_CALL S3IODevice::read(
     }
 
 
-    FILE * f = fopen(m_localfile.c_str(), "rb");
-    if (f == NULL)
-        goto bad_end;
+    if (m_lazy)
+    {
+        if (m_pos >= m_localsize)
+            return 0;
 
+        readSize = (uint32_t)(m_pos + size > m_localsize ? m_localsize - m_pos : size);
+        uint64_t block_size = m_readAhead->blockSize();
+        m_readAhead->advance(m_pos / block_size, (uint64_t) m_pos == m_readEnd);
 
-    readSize = (uint32_t)(m_pos + size > m_localsize ? m_localsize - m_pos : size);
+        uint32_t copied = 0;
+        while (copied < readSize)
+        {
+            uint64_t block = m_pos / block_size;
+            auto data = m_readAhead->get(block);
+            uint64_t offset = m_pos - block * block_size;
+            if (!data || data->size() <= offset)
+            {
+                LOGE << "Couldn't get block " << block << " of " << m_uri;
+                if (ecode)
+                    *ecode = error::UnknownError;
+                return copied;
+            }
 
+            uint32_t chunk = (uint32_t) std::min<uint64_t>(readSize - copied, data->size() - offset);
+            memcpy((char*) dst + copied, data->data() + offset, chunk);
+            copied += chunk;
+            m_pos += chunk;
+        }
 
-    if (fseek(f, (int)m_pos, SEEK_SET) != 0)
-        goto bad_end;
+        m_readEnd = m_pos;
+        return readSize;
+    }
 
+    if (m_sparse && !fillRange(m_pos, size))
+    {
+        if (ecode)
+            *ecode = error::UnknownError;
+        return 0;
+    }
 
-    fread(dst, 1, readSize, f);
-    m_pos += readSize;
-    fclose(f);
+    long long got = m_staging.read(m_pos, dst, size);
+    if (got < 0)
+    {
+        if (ecode)
+            *ecode = error::UnknownError;
+        return 0;
+    }
 
 
+    m_pos += got;
 //LOGD << "read return:" <<readSize;
-    return readSize;
-
-
-bad_end:
-    if (f != NULL)
-        fclose(f);
-    *ecode = error::UnknownError;
-    return 0;
+    return (uint32_t) got;
 }
 
 
@@ -1888,20 +4620,11 @@ uint32_t STORAGE_METHOD_CALL S3IODevice::size(int* ecode) const
         *ecode = error::NoError;
 
 
+    if (m_streaming || m_lazy)
+        return static_cast<uint32_t>(m_localsize);
 
 
-
-
-    long long ret;
-    if ((ret = aux::getFileSize(m_localfile.c_str())) == -1)
-    {
-        LOGE << "Couldn't get file size";
-        if (ecode)
-            *ecode = error::UnknownError;
-        return 0;
-    }
-    //LOGD << "********** Get size:" << m_uri << ", " << ret;
-    return static_cast<uint32_t>(ret);
+    return static_cast<uint32_t>(m_staging.size());
 }
 
 
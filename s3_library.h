@@ -2,13 +2,21 @@
 #define __FTP_THIRD_PARTY_LIBRARY_H__
 
 #include <vector>
+#include <map>
+#include <set>
 #include <string>
 #include <memory>
 #include <stdexcept>
 #include <cstdint>
+#include <cstdio>
 #include <mutex>
 #include <thread>
+#include <atomic>
 #include "plugins/storage/third_party/third_party_storage.h"
+#include "staging_file.h"
+#include "range_set.h"
+#include "checksum.h"
+#include "local_store.h"
 //#include "impl/s3lib.h"
 
 /*! \mainpage
@@ -100,7 +108,64 @@ namespace nx_spl
         }; // class NonCopyable
     } //namespace aux
 
+    // Tunables parsed from the optional query part of the storage url:
+    // s3://login:password@host/bucket@size?streaming_upload=1&part_size=8388608
+    struct S3Options
+    {
+        // Defaults keep the plain behaviour: no background work, no RAM staging and
+        // no state on disk until the URL asks for it. Directories must be absolute.
+        S3Options();
+        // parse "name=value&name=value", unknown names are logged and skipped
+        void parse(const std::string& query);
+
+        bool        streaming_upload;   // multipart upload straight from write()
+        uint64_t    part_size;          // multipart part size, at least 5 MiB
+        uint64_t    read_block_size;    // ranged GET granularity for read-only devices
+        int         readahead;          // blocks prefetched ahead of sequential readers, 0 - off
+        int         readahead_threads;  // process-wide prefetch pool size, fixed at first use
+        uint64_t    block_cache_size;   // process-wide BlockCache budget in bytes, 0 - off, fixed by the first URL giving it
+        std::string disk_cache_dir;     // process-wide DiskCache location, empty - off, fixed like block_cache_size
+        uint64_t    disk_cache_size;    // DiskCache budget in bytes
+        int         download_concurrency;           // ranged GETs in flight for a whole-object fetch
+        uint64_t    parallel_download_threshold;    // smaller objects are fetched in one request
+        int         upload_concurrency;             // parts in flight for a multipart flush
+        uint64_t    multipart_threshold;            // smaller objects are flushed with one PUT
+        int         upload_workers;                 // write-behind uploaders, 0 - upload on close
+        int         list_workers;                   // concurrent requests of a full bucket listing, 1 - one page at a time
+        uint64_t    upload_queue_size;              // staged bytes queued before close blocks
+        uint64_t    memory_staging_size;            // smaller objects are staged in RAM, 0 - never
+        std::string journal_dir;                    // process-wide multipart upload journal location, empty - off, fixed like block_cache_size
+        int         stale_upload_age;               // unjournaled uploads older than this (s) are aborted, 0 - never
+        std::string spool_dir;                      // closed objects wait here through outages, empty - off
+        uint64_t    spool_size;                     // bytes spooled while the bucket is unreachable
+        uint64_t    drain_rate;                     // bytes/s for uploads of a spooled backlog, 0 - unlimited
+        bool        compress;                       // zstd for compressible objects, needs S3_WITH_ZSTD
+        std::string compress_ext;                   // extensions always compressed, others if a sample compresses
+        int         compress_level;                 // zstd level, 1..19
+        std::string local_dir;                      // primary copies of local_ext objects, empty - off
+        std::string local_ext;                      // extensions kept on local disk, synced as snapshots
+        int         local_sync_interval;            // seconds between snapshot uploads of changed copies
+        uint64_t    pack_threshold;                 // new objects smaller than this go into packs, 0 - off
+        uint64_t    pack_size;                      // a pack is uploaded once it is this big
+        int         pack_age;                       // ... or its first object is this old (s)
+        int         pack_min_live;                  // packs with less live data (percent) are rewritten
+        std::string pack_dir;                       // packs being filled and the index log, empty - packing off
+        std::string pack_prefix;                    // key prefix of pack objects and their index
+        bool        meta_index;                     // answer metadata calls from an in-memory bucket index
+        int         meta_staleness;                 // index answers while its last full listing finished this recently (s)
+        int         meta_reconcile;                 // seconds between background listings, full or incremental
+        bool        meta_incremental;               // rescan from each stream's last key instead of relisting
+        std::string meta_dir;                       // index snapshot and change log, empty - memory only
+
+        std::set<std::string> given;                // names parse() saw, the rest are defaults
+    };
+
     class S3Storage;
+    class ReadAhead;
+    class UploadQueue;
+    class PackStore;
+    class MetadataIndex;
+    class DirPager;
     // At construction phase we synchronise remote file with local one.
     // During destruction synchronisation attempt is repeated.
     // All intermediate actions (read/write/seek) are made with the local copy.
@@ -118,7 +183,12 @@ namespace nx_spl
             const std::string  &access_key,
             const std::string  &secret_key,
             const std::string  &host,
-            const std::string  &bucket_name
+            const std::string  &bucket_name,
+            const S3Options    &options,
+            const std::shared_ptr<UploadQueue> &uploads,
+            const std::shared_ptr<LocalStore> &local,
+            const std::shared_ptr<PackStore> &packs,
+            const std::shared_ptr<MetadataIndex> &meta
         );
 
         virtual uint32_t STORAGE_METHOD_CALL write(
@@ -148,8 +218,35 @@ namespace nx_spl
         virtual unsigned int releaseRef() override;
 
     private:
-        // synchronize localfile with remote one
-        void flush();
+        // synchronize localfile with remote one, false if the upload failed
+        bool flush();
+        // fetch the whole remote object into f, revalidating the disk cache
+        // cacheable: false for bytes that aren't the object's content, e.g. compressed ones
+        bool download(FILE *f, const std::string &etag, uint64_t size, const aux::ObjectChecksums &expected,
+                      bool cacheable = true);
+        // download() of a compressed object, decompressed into f
+        bool downloadPacked(FILE *f, const std::string &etag, uint64_t stored, uint64_t logical,
+                            const aux::ObjectChecksums &expected);
+        // local-first mode: makes the object, or an empty file if there is none, the primary copy
+        bool fetchPrimary(int mode);
+        // hands the staged copy of a small object to m_packs
+        bool packObject();
+        // checksums of the staged copy for its upload, null if it can't be read
+        std::shared_ptr<aux::UploadDigest> finishDigest();
+        bool fillRange(uint64_t pos, uint64_t size) const;
+        bool stagedMd5(uint64_t pos, uint64_t size, aux::Md5::Digest *digest) const;
+        bool unchanged();
+        void keepPartBase(uint64_t pos, uint64_t size);
+        bool sparseUpload();
+        bool streamReachable(uint64_t pos, size_t size) const;
+        bool streamWrite(uint64_t pos, const char *src, size_t size);
+        // streaming mode: upload m_partBuf head as the next multipart part
+        bool shipPart(size_t len);
+        bool reshipLastPart();
+        bool finishStreaming();
+        bool leaveStreaming();
+        void abortStreaming();
+
         // delete only via releaseRef()
         ~S3IODevice();
 
@@ -158,8 +255,14 @@ namespace nx_spl
         mutable int64_t     m_pos;
         std::string         m_uri; //file URI
         std::string         m_localfile;
+        mutable aux::StagingFile m_staging;   // m_localfile, held open
+        std::shared_ptr<aux::UploadDigest> m_digest;  // of m_staging, fed by write()
         bool                m_altered;
         long long           m_localsize;
+        // MD5 of the copy as downloaded: writing the same bytes back uploads nothing
+        bool                m_hasBase;
+        uint64_t            m_baseSize;
+        aux::Md5::Digest    m_baseMd5;
         mutable
         std::mutex          m_mutex;
         std::string         m_implurl;
@@ -170,6 +273,52 @@ namespace nx_spl
         std::string m_secret_key;
         std::string m_host;
         std::string m_bucket_name;
+        S3Options   m_options;
+        std::shared_ptr<UploadQueue> m_uploads;   // null - flush on close
+
+        // Streaming mode: no local file, data goes to the bucket part by part.
+        // Part 1 waits in m_head until close, so header patches are free.
+        // m_partBuf holds bytes [m_shipped, m_shipped + m_partBuf.size()),
+        // m_lastPart is the latest shipped part, kept for patches of the tail.
+        bool                        m_streaming;
+        bool                        m_streamFailed;
+        std::vector<char>           m_head;
+        std::vector<char>           m_partBuf;
+        uint64_t                    m_shipped;
+        std::vector<char>           m_lastPart;
+        uint64_t                    m_lastPartStart;
+        bool                        m_lastPartDirty;
+        std::string                 m_uploadId;
+        std::vector<std::string>    m_partEtags;    // by part number - 1, part 1 is set at close
+        std::vector<aux::Md5::Digest> m_partMd5s;   // same order, for Content-MD5 and the final ETag
+
+        // Lazy mode (read-only): object is never downloaded as a whole,
+        // read() fetches read_block_size aligned blocks on demand.
+        bool                        m_lazy;
+        std::string                 m_etag;
+        std::shared_ptr<ReadAhead>  m_readAhead;
+        mutable uint64_t            m_readEnd;  // where the previous read stopped
+
+        // Sparse mode (existing object opened for write): the staged copy has only
+        // the ranges in m_present, fetched on read or written; m_dirty are written.
+        bool                        m_sparse;
+        uint64_t                    m_remoteSize;
+        mutable aux::RangeSet       m_present;
+        aux::RangeSet               m_dirty;
+        // MD5 of remote parts (part_size) taken before their first write
+        std::map<uint64_t, aux::Md5::Digest> m_partBase;
+
+        // Local-first mode: m_localfile is the primary copy kept by m_local, written
+        // through and never uploaded on close; the store syncs snapshots of it.
+        std::shared_ptr<LocalStore>         m_local;
+        std::shared_ptr<LocalStore::File>   m_localCopy;
+
+        // Small objects: m_packed - opened from a pack, m_packable - new or packed,
+        // goes into a pack on close if it stays below pack_threshold
+        std::shared_ptr<PackStore>          m_packs;
+        bool                                m_packed;
+        bool                                m_packable;
+        std::shared_ptr<MetadataIndex>      m_meta;     // told about what close uploads
     }; // class S3IODevice
 
     // Fileinfo list is obtained from the server at construction phase.
@@ -183,10 +332,11 @@ namespace nx_spl
         friend class aux::PluginRefCounter<S3FileInfoIterator>;
 
         typedef std::vector<MyFileInfo>        FileListType;
-        typedef FileListType::const_iterator    FileListIteratorType;
     public:
+        // fileList: entries known up front; pager: the rest, fetched page by page as next() gets there
         S3FileInfoIterator(
-            FileListType       &&fileList // caller doesn't really need this list after Iterator is constructed
+            FileListType       &&fileList, // caller doesn't really need this list after Iterator is constructed
+            const std::shared_ptr<DirPager> &pager = nullptr
         );
 
         virtual FileInfo* STORAGE_METHOD_CALL next(int* ecode) const override;
@@ -202,10 +352,12 @@ namespace nx_spl
         ~S3FileInfoIterator();
 
     private:
-        FileListType                m_fileList;
-        mutable
-        FileListIteratorType        m_curFile;
+        mutable FileListType        m_fileList;     // entries given up front, then the current page
+        mutable size_t              m_curFile;
         mutable FileInfo                    m_info;
+        std::shared_ptr<DirPager>   m_pager;
+        mutable bool                m_paging;       // m_fileList holds a page
+        std::set<std::string>       m_listedDirs;   // given up front, skipped in pages
         std::shared_ptr<TreeItem>    m_tree;
     }; // class FtpFileListIterator
 
@@ -270,9 +422,12 @@ namespace nx_spl
             int*            ecode
         ) const override;
         uint64_t getUsedSpace() const;
-        bool test_bucket() const;
+        // retry: retryable failures are tried again with a growing pause
+        bool test_bucket(bool retry = true) const;
         int should_retry() const;
-        mutable int retriesG;
+        bool rescanIndex();
+        mutable std::atomic<int> retriesG;
+        mutable std::atomic<int> m_retrySleep;  // seconds before the next retry, back to 1 on success
     public: // plugin interface implementation
         virtual void* queryInterface(const nxpl::NX_GUID& interfaceID) override;
 
@@ -289,12 +444,18 @@ namespace nx_spl
         std::string         m_secret_key;
         std::string         m_bucket_name;
         std::string         m_host;
+        S3Options           m_options;
         mutable std::mutex  m_mutex;
         mutable int         m_available;
 
         uint64_t            m_max_size;
         std::atomic<bool>   terminate_thread;
         std::shared_ptr<std::thread> t;
+        std::shared_ptr<UploadQueue> m_uploads;
+        std::shared_ptr<LocalStore> m_local;
+        std::shared_ptr<PackStore> m_packs;
+        std::shared_ptr<MetadataIndex> m_meta;
+        size_t              m_verifyNext;   // stream an incremental rescan lists in full
     }; // class Ftpstorage
 
     class S3StorageFactory
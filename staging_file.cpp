@@ -0,0 +1,293 @@
+#include "staging_file.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "plog/Log.h"
+
+namespace nx_spl
+{
+    namespace aux
+    {
+        namespace
+        {
+            // MediaServer writes 4-64 KB chunks, a few of them make one syscall
+            const size_t kBufferSize = 256 * 1024;
+            const size_t kBufferAlign = 4096;
+            // Preallocation step, keeps the file from fragmenting as it grows
+            const uint64_t kReserveStep = 8 * 1024 * 1024;
+
+            bool preadAll(int fd, char* dst, size_t size, uint64_t offset, size_t* got)
+            {
+                *got = 0;
+                while (*got < size)
+                {
+                    ssize_t res = pread(fd, dst + *got, size - *got, (off_t)(offset + *got));
+                    if (res < 0 && errno == EINTR)
+                        continue;
+                    if (res < 0)
+                        return false;
+                    if (res == 0)
+                        break;
+                    *got += res;
+                }
+                return true;
+            }
+
+            bool pwriteAll(int fd, const char* src, size_t size, uint64_t offset)
+            {
+                size_t done = 0;
+                while (done < size)
+                {
+                    ssize_t res = pwrite(fd, src + done, size - done, (off_t)(offset + done));
+                    if (res < 0 && errno == EINTR)
+                        continue;
+                    if (res <= 0)
+                        return false;
+                    done += res;
+                }
+                return true;
+            }
+        }
+
+        StagingFile::StagingFile()
+            : m_fd(-1),
+              m_size(0),
+              m_allocated(0),
+              m_buffer(nullptr),
+              m_bufOffset(0),
+              m_bufLen(0),
+              m_memory(false),
+              m_limit(0)
+        {}
+
+        StagingFile::~StagingFile()
+        {
+            close();
+        }
+
+        bool StagingFile::open(const std::string& path)
+        {
+            close();
+
+            m_fd = ::open(path.c_str(), O_RDWR);
+            if (m_fd == -1)
+            {
+                LOGE << "Couldn't open staging file:" << path << ", errno:" << errno;
+                return false;
+            }
+
+            struct stat st;
+            if (fstat(m_fd, &st) == -1)
+            {
+                ::close(m_fd);
+                m_fd = -1;
+                return false;
+            }
+
+            m_size = st.st_size;
+            m_allocated = st.st_size;
+            m_bufLen = 0;
+            return true;
+        }
+
+        bool StagingFile::openMemory(const std::string& path, uint64_t limit)
+        {
+            close();
+
+            m_memory = true;
+            m_path = path;
+            m_limit = std::min<uint64_t>(limit, BufferPool::kMaxSize);
+            m_size = 0;
+            return true;
+        }
+
+        bool StagingFile::close()
+        {
+            if (m_memory)
+            {
+                BufferPool::instance().release(m_mem);
+                m_mem = BufferPool::Buffer();
+                m_memory = false;
+                return true;
+            }
+
+            if (m_fd == -1)
+                return true;
+
+            bool ok = flush();
+            ::close(m_fd);
+            m_fd = -1;
+            free(m_buffer);
+            m_buffer = nullptr;
+            return ok;
+        }
+
+        bool StagingFile::flush()
+        {
+            if (m_memory || m_bufLen == 0)
+                return true;
+
+            bool ok = pwriteAll(m_fd, m_buffer, m_bufLen, m_bufOffset);
+            if (!ok)
+                LOGE << "Staging write failed, errno:" << errno;
+            m_bufLen = 0;
+            return ok;
+        }
+
+        bool StagingFile::grow(uint64_t size)
+        {
+            if (size <= m_mem.capacity)
+                return true;
+
+            BufferPool::Buffer bigger = BufferPool::instance().acquire(size);
+            if (!bigger.data)
+                return false;
+
+            if (m_size)
+                memcpy(bigger.data, m_mem.data, m_size);
+            BufferPool::instance().release(m_mem);
+            m_mem = bigger;
+            return true;
+        }
+
+        bool StagingFile::spill()
+        {
+            int fd = ::open(m_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd == -1)
+            {
+                LOGE << "Couldn't create staging file:" << m_path << ", errno:" << errno;
+                return false;
+            }
+
+            if (m_size && !pwriteAll(fd, m_mem.data, m_size, 0))
+            {
+                LOGE << "Staging write failed, errno:" << errno;
+                ::close(fd);
+                return false;
+            }
+
+            BufferPool::instance().release(m_mem);
+            m_mem = BufferPool::Buffer();
+            m_memory = false;
+            m_fd = fd;
+            m_allocated = m_size;
+            m_bufLen = 0;
+            return true;
+        }
+
+        bool StagingFile::persist()
+        {
+            return !m_memory || spill();
+        }
+
+
+        char* StagingFile::prepare(uint64_t size)
+        {
+            if (!m_memory || size > m_limit || !grow(std::max<uint64_t>(size, 1)))
+                return nullptr;
+
+            m_size = size;
+            return m_mem.data;
+        }
+
+        bool StagingFile::reserve(uint64_t end)
+        {
+            if (end <= m_allocated)
+                return true;
+
+            uint64_t target = std::max(end, m_allocated + kReserveStep);
+#if defined(__linux__)
+            // KEEP_SIZE: the file length stays what was actually written
+            if (fallocate(m_fd, FALLOC_FL_KEEP_SIZE, (off_t) m_allocated, (off_t)(target - m_allocated)) == -1)
+            {
+                // Not every filesystem can do it, pwrite will still allocate as it goes
+                if (errno != EOPNOTSUPP && errno != ENOSYS)
+                    LOGD << "fallocate failed, errno:" << errno;
+            }
+#endif
+            m_allocated = target;
+            return true;
+        }
+
+        long long StagingFile::read(uint64_t offset, void* dst, size_t size)
+        {
+            if (!isOpen())
+                return -1;
+
+            if (offset >= m_size)
+                return 0;
+            size = (size_t) std::min<uint64_t>(size, m_size - offset);
+
+            if (m_memory)
+            {
+                memcpy(dst, m_mem.data + offset, size);
+                return size;
+            }
+
+            // Overlapping the pending writes, let them land first
+            if (m_bufLen != 0 && offset < m_bufOffset + m_bufLen && m_bufOffset < offset + size && !flush())
+                return -1;
+
+            size_t got = 0;
+            if (!preadAll(m_fd, (char*) dst, size, offset, &got))
+                return -1;
+
+            // Holes past the last pwrite are zeroes
+            if (got < size)
+                memset((char*) dst + got, 0, size - got);
+            return size;
+        }
+
+        bool StagingFile::write(uint64_t offset, const void* src, size_t size)
+        {
+            if (!isOpen())
+                return false;
+
+            if (m_memory && offset + size > m_limit && !spill())
+                return false;
+
+            if (m_memory)
+            {
+                if (!grow(offset + size))
+                    return false;
+
+                if (offset > m_size)
+                    memset(m_mem.data + m_size, 0, offset - m_size);
+                memcpy(m_mem.data + offset, src, size);
+                m_size = std::max<uint64_t>(m_size, offset + size);
+                return true;
+            }
+
+            reserve(offset + size);
+
+            if (!m_buffer && posix_memalign((void**) &m_buffer, kBufferAlign, kBufferSize) != 0)
+                m_buffer = nullptr;
+
+            bool appends = m_bufLen != 0 && offset == m_bufOffset + m_bufLen && m_bufLen + size <= kBufferSize;
+            if (!appends && !flush())
+                return false;
+
+            if (m_buffer && size < kBufferSize)
+            {
+                if (m_bufLen == 0)
+                    m_bufOffset = offset;
+                memcpy(m_buffer + m_bufLen, src, size);
+                m_bufLen += size;
+            }
+            else if (!pwriteAll(m_fd, (const char*) src, size, offset))
+            {
+                LOGE << "Staging write failed, errno:" << errno;
+                return false;
+            }
+
+            m_size = std::max<uint64_t>(m_size, offset + size);
+            return true;
+        }
+    } // namespace aux
+} // namespace nx_spl
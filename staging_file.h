@@ -0,0 +1,76 @@
+#ifndef __S3_STAGING_FILE_H__
+#define __S3_STAGING_FILE_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "buffer_pool.h"
+
+namespace nx_spl
+{
+    namespace aux
+    {
+        // Local copy of an object, kept open for the lifetime of a device.
+        // Small sequential writes are coalesced in an aligned buffer and hit the
+        // file with one pwrite, space is preallocated ahead of the write position.
+        // The logical size is tracked here, so size() doesn't touch the disk.
+        // Small objects can be staged in a pooled buffer instead and only reach
+        // the file system if they outgrow it.
+        // Not thread safe, the owning device serializes access.
+        class StagingFile
+        {
+        public:
+            StagingFile();
+            ~StagingFile();
+
+            StagingFile(const StagingFile&) = delete;
+            StagingFile& operator =(const StagingFile&) = delete;
+
+            // Opens an existing file for read and write
+            bool open(const std::string& path);
+            // Keeps the content in RAM until it grows past limit, then moves it to path
+            bool openMemory(const std::string& path, uint64_t limit);
+            // Writes the buffer out and closes the descriptor
+            bool close();
+            bool isOpen() const { return m_fd != -1 || m_memory; }
+
+            bool inMemory() const { return m_memory; }
+            const char* data() const { return m_mem.data; }
+            // Memory mode only: resizes the content and returns it for filling in place
+            char* prepare(uint64_t size);
+            // Memory mode: moves the content to the file, which backs the copy from then on
+            bool persist();
+
+            // Returns bytes read, -1 on error
+            long long read(uint64_t offset, void* dst, size_t size);
+            bool write(uint64_t offset, const void* src, size_t size);
+            // Makes everything written so far visible to other readers of the file
+            bool flush();
+
+            uint64_t size() const { return m_size; }
+            // -1 in memory mode; writes through it bypass the coalescing buffer
+            int fd() const { return m_fd; }
+
+        private:
+            bool reserve(uint64_t end);
+            bool grow(uint64_t size);
+            bool spill();
+
+        private:
+            int         m_fd;
+            uint64_t    m_size;
+            uint64_t    m_allocated;
+            char*       m_buffer;
+            uint64_t    m_bufOffset;    // file offset of m_buffer[0]
+            size_t      m_bufLen;
+
+            bool                m_memory;
+            BufferPool::Buffer  m_mem;
+            std::string         m_path;
+            uint64_t            m_limit;
+        }; // class StagingFile
+    } // namespace aux
+} // namespace nx_spl
+
+#endif // __S3_STAGING_FILE_H__
@@ -0,0 +1,38 @@
+#include "token_bucket.h"
+
+#include <algorithm>
+#include <thread>
+
+namespace nx_spl
+{
+    namespace aux
+    {
+        TokenBucket::TokenBucket(uint64_t rate, uint64_t burst)
+            : m_rate(rate),
+              m_burst(burst),
+              m_tokens((double) burst),
+              m_last(Clock::now())
+        {}
+
+
+        void TokenBucket::consume(uint64_t bytes)
+        {
+            if (m_rate == 0)
+                return;
+
+            double debt;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                Clock::time_point now = Clock::now();
+                double elapsed = std::chrono::duration<double>(now - m_last).count();
+                m_last = now;
+
+                m_tokens = std::min<double>(m_burst, m_tokens + elapsed * m_rate) - bytes;
+                debt = -m_tokens;
+            }
+
+            if (debt > 0)
+                std::this_thread::sleep_for(std::chrono::duration<double>(debt / m_rate));
+        }
+    } // namespace aux
+} // namespace nx_spl
@@ -0,0 +1,40 @@
+#ifndef __S3_TOKEN_BUCKET_H__
+#define __S3_TOKEN_BUCKET_H__
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+namespace nx_spl
+{
+    namespace aux
+    {
+        // Byte rate limiter shared by any number of threads. consume() takes the
+        // bytes right away and makes the caller sleep off the debt, so a burst
+        // never waits and the long run average stays at the rate.
+        class TokenBucket
+        {
+        public:
+            // rate: bytes per second, 0 - unlimited; burst: bytes that may go without waiting
+            TokenBucket(uint64_t rate, uint64_t burst);
+
+            TokenBucket(const TokenBucket&) = delete;
+            TokenBucket& operator =(const TokenBucket&) = delete;
+
+            void consume(uint64_t bytes);
+            uint64_t rate() const { return m_rate; }
+
+        private:
+            typedef std::chrono::steady_clock Clock;
+
+            const uint64_t      m_rate;
+            const uint64_t      m_burst;
+
+            std::mutex          m_mutex;
+            double              m_tokens;
+            Clock::time_point   m_last;
+        }; // class TokenBucket
+    } // namespace aux
+} // namespace nx_spl
+
+#endif // __S3_TOKEN_BUCKET_H__
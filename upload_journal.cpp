@@ -0,0 +1,299 @@
+#include "upload_journal.h"
+
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "plog/Log.h"
+
+namespace nx_spl
+{
+    namespace
+    {
+        const char kSuffix[] = ".upl";
+
+        std::string absolutePath(const std::string& path)
+        {
+            if (!path.empty() && path[0] == '/')
+                return path;
+
+            char cwd[PATH_MAX];
+            if (!getcwd(cwd, sizeof(cwd)))
+                return path;
+            return std::string(cwd) + "/" + path;
+        }
+    }
+
+
+    UploadJournal& UploadJournal::instance()
+    {
+        static UploadJournal journal;
+        return journal;
+    }
+
+
+    UploadJournal::UploadJournal()
+        : m_next(0)
+    {}
+
+
+    UploadJournal::~UploadJournal()
+    {
+        for (auto& record : m_open)
+            fclose(record.second);
+    }
+
+
+    bool UploadJournal::configure(const std::string& dir)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (dir.empty())
+        {
+            m_dir.clear();
+            return false;
+        }
+
+        struct stat st;
+        if (mkdir(dir.c_str(), 0755) == -1 && (stat(dir.c_str(), &st) == -1 || !S_ISDIR(st.st_mode)))
+        {
+            LOGE << "Couldn't create upload journal dir:" << dir;
+            m_dir.clear();
+            return false;
+        }
+
+        m_dir = absolutePath(dir);
+        return true;
+    }
+
+
+    bool UploadJournal::enabled() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return !m_dir.empty();
+    }
+
+
+    std::string UploadJournal::recordPath(const std::string& id) const
+    {
+        return m_dir + "/" + id + kSuffix;
+    }
+
+
+    std::string UploadJournal::begin(
+        const std::string   &host,
+        const std::string   &bucket,
+        const std::string   &key,
+        const std::string   &path,
+        uint64_t            size,
+        uint64_t            partSize,
+        const std::string   &uploadId)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_dir.empty())
+            return std::string();
+
+        // Unique across restarts: start time, pid and a counter
+        std::string id = std::to_string((long long) time(nullptr)) + "_" + std::to_string((long long) getpid())
+                         + "_" + std::to_string((unsigned long long) m_next++);
+
+        FILE* f = fopen(recordPath(id).c_str(), "w");
+        if (!f)
+        {
+            LOGE << "Couldn't create upload journal record for:" << key;
+            return std::string();
+        }
+
+        Entry entry;
+        entry.host = host;
+        entry.bucket = bucket;
+        entry.key = key;
+        entry.path = absolutePath(path);
+        entry.size = size;
+        entry.partSize = partSize;
+        entry.uploadId = uploadId;
+        write(f, entry);
+
+        m_open[id] = f;
+        return id;
+    }
+
+
+    bool UploadJournal::write(FILE* f, const Entry& entry) const
+    {
+        fprintf(f, "host\t%s\nbucket\t%s\nkey\t%s\npath\t%s\nsize\t%llu\npart_size\t%llu\nupload\t%s\n",
+                entry.host.c_str(), entry.bucket.c_str(), entry.key.c_str(), entry.path.c_str(),
+                (unsigned long long) entry.size, (unsigned long long) entry.partSize, entry.uploadId.c_str());
+        for (const auto& part : entry.parts)
+            fprintf(f, "part\t%d\t%s\n", part.first, part.second.c_str());
+        return fflush(f) == 0;
+    }
+
+
+    bool UploadJournal::resume(const Entry& entry)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_dir.empty() || m_open.count(entry.id))
+            return false;
+
+        // Rewritten from what was read, so a torn tail can't swallow the next line
+        std::string path = recordPath(entry.id);
+        std::string temp = path + ".tmp";
+        FILE* f = fopen(temp.c_str(), "w");
+        if (!f)
+            return false;
+
+        if (!write(f, entry) || rename(temp.c_str(), path.c_str()) == -1)
+        {
+            fclose(f);
+            remove(temp.c_str());
+            return false;
+        }
+
+        m_open[entry.id] = f;
+        return true;
+    }
+
+
+    void UploadJournal::partDone(const std::string& id, int part, const std::string& etag)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto it = m_open.find(id);
+        if (it == m_open.end())
+            return;
+
+        fprintf(it->second, "part\t%d\t%s\n", part, etag.c_str());
+        fflush(it->second);
+    }
+
+
+    void UploadJournal::finish(const std::string& id)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (id.empty() || m_dir.empty())
+            return;
+
+        auto it = m_open.find(id);
+        if (it != m_open.end())
+        {
+            fclose(it->second);
+            m_open.erase(it);
+        }
+        remove(recordPath(id).c_str());
+    }
+
+
+    bool UploadJournal::load(const std::string& id, Entry* entry) const
+    {
+        FILE* f = fopen(recordPath(id).c_str(), "r");
+        if (!f)
+            return false;
+
+        entry->id = id;
+        entry->active = false;
+        entry->size = 0;
+        entry->partSize = 0;
+        entry->parts.clear();
+
+        char line[4096];
+        while (fgets(line, sizeof(line), f))
+        {
+            size_t len = strlen(line);
+            if (len == 0 || line[len - 1] != '\n')
+                break;      // torn tail
+            line[len - 1] = 0;
+
+            char* value = strchr(line, '\t');
+            if (!value)
+                continue;
+            *value++ = 0;
+
+            if (strcmp(line, "host") == 0)
+                entry->host = value;
+            else if (strcmp(line, "bucket") == 0)
+                entry->bucket = value;
+            else if (strcmp(line, "key") == 0)
+                entry->key = value;
+            else if (strcmp(line, "path") == 0)
+                entry->path = value;
+            else if (strcmp(line, "size") == 0)
+                entry->size = strtoull(value, nullptr, 10);
+            else if (strcmp(line, "part_size") == 0)
+                entry->partSize = strtoull(value, nullptr, 10);
+            else if (strcmp(line, "upload") == 0)
+                entry->uploadId = value;
+            else if (strcmp(line, "part") == 0)
+            {
+                char* etag = strchr(value, '\t');
+                if (etag)
+                    entry->parts[atoi(value)] = etag + 1;
+            }
+        }
+        fclose(f);
+
+        return !entry->key.empty() && !entry->uploadId.empty() && entry->partSize != 0;
+    }
+
+
+    std::vector<UploadJournal::Entry> UploadJournal::entries(const std::string& host, const std::string& bucket) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::vector<Entry> result;
+        if (m_dir.empty())
+            return result;
+
+        DIR* dir = opendir(m_dir.c_str());
+        if (!dir)
+            return result;
+
+        const size_t suffixLen = sizeof(kSuffix) - 1;
+        while (struct dirent* de = readdir(dir))
+        {
+            std::string name = de->d_name;
+            if (name.size() <= suffixLen || name.compare(name.size() - suffixLen, suffixLen, kSuffix) != 0)
+                continue;
+
+            Entry entry;
+            std::string id = name.substr(0, name.size() - suffixLen);
+            if (!load(id, &entry))
+            {
+                LOGE << "Dropping unreadable upload journal record:" << name;
+                remove(recordPath(id).c_str());
+                continue;
+            }
+
+            entry.active = m_open.count(id) != 0;
+            if (entry.host == host && entry.bucket == bucket)
+                result.push_back(entry);
+        }
+        closedir(dir);
+        return result;
+    }
+
+
+    bool UploadJournal::find(
+        const std::string   &host,
+        const std::string   &bucket,
+        const std::string   &key,
+        const std::string   &path,
+        uint64_t            size,
+        Entry               *entry) const
+    {
+        std::string absolute = absolutePath(path);
+        for (auto& candidate : entries(host, bucket))
+        {
+            // Uploads in flight in this process aren't interrupted ones
+            if (!candidate.active && candidate.key == key && candidate.path == absolute && candidate.size == size)
+            {
+                *entry = candidate;
+                return true;
+            }
+        }
+        return false;
+    }
+} // namespace nx_spl
@@ -0,0 +1,91 @@
+#ifndef __S3_UPLOAD_JOURNAL_H__
+#define __S3_UPLOAD_JOURNAL_H__
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace nx_spl
+{
+    // Process-wide record of multipart uploads in flight, so that an upload cut
+    // short by a restart can be resumed from its last acknowledged part.
+    //
+    // Every upload is a text file <n>.upl in the journal directory: a header
+    // with bucket, key, staging path, size, part size and upload ID, then one
+    // "part" line per acknowledged part. Lines are only appended and a line
+    // without its newline is ignored, so a crash loses at most the last part.
+    // The file is removed once the upload is completed or aborted.
+    class UploadJournal
+    {
+    public:
+        struct Entry
+        {
+            std::string                 id;         // journal file name
+            std::string                 host;
+            std::string                 bucket;
+            std::string                 key;
+            std::string                 path;       // staging file, absolute
+            uint64_t                    size;
+            uint64_t                    partSize;
+            std::string                 uploadId;
+            std::map<int, std::string>  parts;      // part number -> ETag
+            bool                        active;     // in flight in this process
+        };
+
+        static UploadJournal& instance();
+
+        // Empty dir disables the journal
+        bool configure(const std::string& dir);
+        bool enabled() const;
+
+        // Returns the id of the new record, empty if disabled or on error
+        std::string begin(
+            const std::string   &host,
+            const std::string   &bucket,
+            const std::string   &key,
+            const std::string   &path,
+            uint64_t            size,
+            uint64_t            partSize,
+            const std::string   &uploadId
+        );
+        // Takes over a record found by find() so that partDone() appends to it
+        bool resume(const Entry& entry);
+        void partDone(const std::string& id, int part, const std::string& etag);
+        // Upload completed or aborted
+        void finish(const std::string& id);
+
+        // Records of one bucket left by earlier runs or in flight now
+        std::vector<Entry> entries(const std::string& host, const std::string& bucket) const;
+        // Record of an interrupted upload of exactly this staging file, false if none
+        bool find(
+            const std::string   &host,
+            const std::string   &bucket,
+            const std::string   &key,
+            const std::string   &path,
+            uint64_t            size,
+            Entry               *entry
+        ) const;
+
+    private:
+        UploadJournal();
+        ~UploadJournal();
+
+        UploadJournal(const UploadJournal&) = delete;
+        UploadJournal& operator =(const UploadJournal&) = delete;
+
+        bool load(const std::string& id, Entry* entry) const;
+        bool write(FILE* f, const Entry& entry) const;
+        std::string recordPath(const std::string& id) const;
+
+    private:
+        mutable std::mutex              m_mutex;
+        std::string                     m_dir;
+        std::map<std::string, FILE*>    m_open;     // records of uploads of this process
+        uint64_t                        m_next;
+    }; // class UploadJournal
+} // namespace nx_spl
+
+#endif // __S3_UPLOAD_JOURNAL_H__
@@ -0,0 +1,463 @@
+#include "upload_queue.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "plog/Log.h"
+
+namespace nx_spl
+{
+    namespace
+    {
+        // A failed upload is retried this many times, pausing in between
+        const int kUploadAttempts = 3;
+        const int kRetryPauseSec = 5;
+        // With a spool: failed attempts, each after the bucket was found reachable, before a job is dropped
+        const int kSpoolAttempts = 10;
+        const char kManifestSuffix[] = ".job";
+        // Lets a burst of one multipart part through before the drain rate applies
+        const uint64_t kDrainBurst = 1024 * 1024;
+
+        bool copyFile(const std::string& from, const std::string& to)
+        {
+            FILE* in = fopen(from.c_str(), "rb");
+            if (!in)
+                return false;
+
+            FILE* out = fopen(to.c_str(), "wb");
+            if (!out)
+            {
+                fclose(in);
+                return false;
+            }
+
+            char buffer[64 * 1024];
+            size_t got;
+            bool ok = true;
+            while (ok && (got = fread(buffer, 1, sizeof(buffer), in)) > 0)
+                ok = fwrite(buffer, 1, got, out) == got;
+
+            fclose(in);
+            return fclose(out) == 0 && ok;
+        }
+    }
+
+
+    UploadQueue::UploadQueue(UploadFunc upload, int workers, uint64_t byteBudget,
+                             const std::string& spoolDir, uint64_t spoolBudget, uint64_t drainRate)
+        : m_upload(upload),
+          m_budget(byteBudget),
+          m_spoolLock(spoolDir),
+          m_spoolDir(m_spoolLock.locked() ? spoolDir : std::string()),
+          m_spoolBudget(std::max(spoolBudget, byteBudget)),
+          m_throttle(drainRate, kDrainBurst),
+          m_bytes(0),
+          m_nextManifest(0),
+          m_online(true),
+          m_draining(false),
+          m_uploaded(0),
+          m_failures(0),
+          m_dropped(0),
+          m_stop(false)
+    {
+        if (spooling())
+            loadSpool();
+
+        for (int i = 0; i < std::max(workers, 1); i++)
+            m_threads.emplace_back([this]{ run(); });
+    }
+
+
+    UploadQueue::~UploadQueue()
+    {
+        // Spooled jobs are picked up by the next run, only running ones are waited for
+        if (!spooling())
+            drain();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_workCond.notify_all();
+
+        for (auto& t : m_threads)
+            t.join();
+    }
+
+
+    bool UploadQueue::push(const std::string& key, const std::string& path, uint64_t size, const Digest& digest)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        // Backpressure: wait for room, but never deadlock on a single big job.
+        // Offline nothing leaves the queue, the spool budget decides instead.
+        m_doneCond.wait(lock, [this, size]
+        {
+            return m_bytes == 0 || m_bytes + size <= m_budget || !m_online;
+        });
+
+        if (!m_online && m_bytes != 0 && m_bytes + size > m_spoolBudget)
+        {
+            LOGE << "Spool is full, not queued:" << key;
+            return false;
+        }
+
+        // A waiting copy of the same key is superseded, only the newest one matters
+        for (auto it = m_jobs.begin(); it != m_jobs.end(); ++it)
+        {
+            if (it->key == key && !it->running)
+            {
+                discard(it);
+                break;
+            }
+        }
+
+        Job job;
+        job.key = key;
+        job.path = path;
+        job.size = size;
+        job.digest = digest;
+        job.running = false;
+        job.failures = 0;
+        if (spooling())
+            job.manifest = writeManifest(job);
+        m_jobs.push_back(job);
+        m_bytes += size;
+
+        m_workCond.notify_one();
+        return true;
+    }
+
+
+    std::string UploadQueue::writeManifest(const Job& job)
+    {
+        char absolute[PATH_MAX];
+        if (!realpath(job.path.c_str(), absolute))
+            return std::string();
+
+        // Zero padded, so that name order is push order across restarts
+        char name[32];
+        snprintf(name, sizeof(name), "%020llu", (unsigned long long) m_nextManifest++);
+        std::string manifest = m_spoolDir + "/" + name + kManifestSuffix;
+
+        FILE* f = fopen(manifest.c_str(), "w");
+        if (!f)
+        {
+            LOGE << "Couldn't write spool manifest for:" << job.key;
+            return std::string();
+        }
+
+        fprintf(f, "key\t%s\npath\t%s\nsize\t%llu\n", job.key.c_str(), absolute, (unsigned long long) job.size);
+        if (fclose(f) != 0)
+        {
+            std::remove(manifest.c_str());
+            return std::string();
+        }
+        return manifest;
+    }
+
+
+    void UploadQueue::loadSpool()
+    {
+        DIR* dir = opendir(m_spoolDir.c_str());
+        if (!dir)
+            return;
+
+        std::vector<std::string> names;
+        const size_t suffixLen = sizeof(kManifestSuffix) - 1;
+        while (struct dirent* de = readdir(dir))
+        {
+            std::string name = de->d_name;
+            if (name.size() > suffixLen && name.compare(name.size() - suffixLen, suffixLen, kManifestSuffix) == 0)
+                names.push_back(name);
+        }
+        closedir(dir);
+        std::sort(names.begin(), names.end());
+
+        for (const auto& name : names)
+        {
+            m_nextManifest = std::max<uint64_t>(m_nextManifest, strtoull(name.c_str(), nullptr, 10) + 1);
+
+            Job job;
+            job.manifest = m_spoolDir + "/" + name;
+            job.size = ULLONG_MAX;
+            job.running = false;
+            job.failures = 0;
+
+            FILE* f = fopen(job.manifest.c_str(), "r");
+            char line[4096];
+            while (f && fgets(line, sizeof(line), f))
+            {
+                size_t len = strlen(line);
+                if (len == 0 || line[len - 1] != '\n')
+                    break;
+                line[len - 1] = 0;
+
+                char* value = strchr(line, '\t');
+                if (!value)
+                    continue;
+                *value++ = 0;
+
+                if (strcmp(line, "key") == 0)
+                    job.key = value;
+                else if (strcmp(line, "path") == 0)
+                    job.path = value;
+                else if (strcmp(line, "size") == 0)
+                    job.size = strtoull(value, nullptr, 10);
+            }
+            if (f)
+                fclose(f);
+
+            struct stat st;
+            if (job.key.empty() || stat(job.path.c_str(), &st) == -1 || (uint64_t) st.st_size != job.size)
+            {
+                LOGE << "Dropping broken spool manifest:" << name;
+                std::remove(job.manifest.c_str());
+                continue;
+            }
+
+            // Older copies of the key are superseded as in push()
+            for (auto it = m_jobs.begin(); it != m_jobs.end(); ++it)
+            {
+                if (it->key == job.key)
+                {
+                    discard(it);
+                    break;
+                }
+            }
+
+            m_jobs.push_back(job);
+            m_bytes += job.size;
+        }
+
+        if (!m_jobs.empty())
+        {
+            LOGD << "Spooled uploads found: " << m_jobs.size() << ", bytes " << m_bytes;
+            m_draining = true;
+        }
+    }
+
+
+    std::list<UploadQueue::Job>::const_iterator UploadQueue::newest(const std::string& key) const
+    {
+        auto result = m_jobs.cend();
+        for (auto it = m_jobs.cbegin(); it != m_jobs.cend(); ++it)
+        {
+            if (it->key == key)
+                result = it;
+        }
+        return result;
+    }
+
+
+    bool UploadQueue::pendingSize(const std::string& key, uint64_t* size) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto job = newest(key);
+        if (job == m_jobs.cend())
+            return false;
+
+        if (size)
+            *size = job->size;
+        return true;
+    }
+
+
+    bool UploadQueue::snapshot(const std::string& key, const std::string& dest, bool copy) const
+    {
+        // A hard link pins the data even if the job finishes and deletes its file
+        std::string pinned = copy ? dest + ".pin" : dest;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto job = newest(key);
+            if (job == m_jobs.cend() || link(job->path.c_str(), pinned.c_str()) != 0)
+                return false;
+        }
+
+        if (!copy)
+            return true;
+
+        bool ok = copyFile(pinned, dest);
+        std::remove(pinned.c_str());
+        return ok;
+    }
+
+
+    void UploadQueue::cancel(const std::string& key)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (auto it = m_jobs.begin(); it != m_jobs.end();)
+        {
+            if (it->key == key && !it->running)
+                discard(it++);
+            else
+                ++it;
+        }
+        m_doneCond.notify_all();
+
+        m_doneCond.wait(lock, [this, &key]{ return m_running.count(key) == 0; });
+    }
+
+
+    bool UploadQueue::waitFor(const std::string& key)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_doneCond.wait(lock, [this, &key]
+        {
+            return newest(key) == m_jobs.cend() || (!m_online && m_running.count(key) == 0);
+        });
+        return newest(key) == m_jobs.cend();
+    }
+
+
+    void UploadQueue::drain()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_doneCond.wait(lock, [this]{ return m_jobs.empty() || !m_online; });
+    }
+
+
+    uint64_t UploadQueue::pendingBytes() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_bytes;
+    }
+
+
+    bool UploadQueue::online() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_online;
+    }
+
+
+    void UploadQueue::setOnline(bool online)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (online && !m_online)
+        {
+            LOGD << "Bucket reachable again, spooled uploads: " << m_jobs.size() << ", bytes " << m_bytes;
+            m_draining = !m_jobs.empty();
+        }
+        m_online = online;
+
+        m_workCond.notify_all();
+        m_doneCond.notify_all();
+    }
+
+
+    UploadQueue::Stats UploadQueue::stats() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Stats stats;
+        stats.jobs = m_jobs.size();
+        stats.bytes = m_bytes;
+        stats.online = m_online;
+        stats.draining = m_draining;
+        stats.uploaded = m_uploaded;
+        stats.failures = m_failures;
+        stats.dropped = m_dropped;
+        return stats;
+    }
+
+
+    void UploadQueue::discard(std::list<Job>::iterator job)
+    {
+        std::remove(job->path.c_str());
+        if (!job->manifest.empty())
+            std::remove(job->manifest.c_str());
+        m_bytes -= job->size;
+        m_jobs.erase(job);
+    }
+
+
+    void UploadQueue::finish(std::list<Job>::iterator job)
+    {
+        m_running.erase(job->key);
+        discard(job);
+        if (m_jobs.empty())
+            m_draining = false;
+
+        m_doneCond.notify_all();
+        // The next copy of that key may be runnable now
+        m_workCond.notify_all();
+    }
+
+
+    void UploadQueue::run()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true)
+        {
+            auto job = m_jobs.end();
+            m_workCond.wait(lock, [this, &job]
+            {
+                if (m_stop)
+                    return true;
+                if (!m_online)
+                    return false;
+
+                for (auto it = m_jobs.begin(); it != m_jobs.end(); ++it)
+                {
+                    if (!it->running && m_running.count(it->key) == 0)
+                    {
+                        job = it;
+                        return true;
+                    }
+                }
+                return false;
+            });
+
+            if (m_stop)
+                return;
+
+            job->running = true;
+            m_running.insert(job->key);
+            std::string key = job->key, path = job->path;
+            uint64_t size = job->size;
+            Digest digest = job->digest;
+            aux::TokenBucket* throttle = m_draining && m_throttle.rate() ? &m_throttle : nullptr;
+            lock.unlock();
+
+            bool ok = false;
+            for (int attempt = 0; attempt < kUploadAttempts && !ok; attempt++)
+            {
+                if (attempt > 0)
+                    sleep(kRetryPauseSec);
+                ok = m_upload(key, path, size, digest, throttle);
+                // A spooled copy can wait for the bucket instead
+                if (spooling())
+                    break;
+            }
+
+            lock.lock();
+            if (ok)
+            {
+                m_uploaded += size;
+                finish(job);
+                continue;
+            }
+
+            m_failures++;
+            if (spooling() && ++job->failures < kSpoolAttempts)
+            {
+                if (m_online)
+                    LOGE << "Upload failed, spooling until the bucket is reachable:" << key;
+                m_online = false;
+                job->running = false;
+                m_running.erase(key);
+                m_doneCond.notify_all();
+                continue;
+            }
+
+            LOGE << "Upload failed, dropping:" << key;
+            m_dropped++;
+            finish(job);
+        }
+    }
+} // namespace nx_spl
@@ -0,0 +1,137 @@
+#ifndef __S3_UPLOAD_QUEUE_H__
+#define __S3_UPLOAD_QUEUE_H__
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "checksum.h"
+#include "dir_lock.h"
+#include "token_bucket.h"
+
+namespace nx_spl
+{
+    // Write-behind pipeline: closed devices hand their staged file over and
+    // return at once, workers upload it later. The queue owns staged files
+    // from push() on and deletes them when done.
+    //
+    // Per key only the newest waiting copy is kept and uploads of one key never
+    // overlap, so the bucket ends up with the last close. Until then the staged
+    // copy answers open/fileExists/fileSize (read-your-writes).
+    //
+    // With a spool directory every job also gets a small manifest there, so the
+    // queue survives restarts, and a failed upload no longer drops the copy: the
+    // queue goes offline and keeps accepting closed objects up to the spool
+    // budget until setOnline() says the bucket answers again. The backlog is then
+    // drained at the drain rate, leaving bandwidth for live recording.
+    class UploadQueue
+    {
+    public:
+        typedef std::shared_ptr<const aux::UploadDigest> Digest;
+        // Uploads the file at path as key, true on success. digest may be null,
+        // throttle is set while a backlog is drained.
+        typedef std::function<bool(const std::string& key, const std::string& path, uint64_t size,
+                                   const Digest& digest, aux::TokenBucket* throttle)> UploadFunc;
+
+        struct Stats
+        {
+            size_t      jobs;
+            uint64_t    bytes;
+            bool        online;
+            bool        draining;
+            uint64_t    uploaded;   // bytes, since construction
+            uint64_t    failures;
+            uint64_t    dropped;
+        };
+
+        // spoolDir: empty - no spool; jobs found there are queued again at once.
+        // A spool another queue holds is not used.
+        // spoolBudget: queued bytes accepted while offline
+        // drainRate: bytes per second while draining a backlog, 0 - unlimited
+        UploadQueue(UploadFunc upload, int workers, uint64_t byteBudget,
+                    const std::string& spoolDir = std::string(), uint64_t spoolBudget = 0, uint64_t drainRate = 0);
+        // Waits for everything queued; with a spool only for running uploads
+        ~UploadQueue();
+
+        UploadQueue(const UploadQueue&) = delete;
+        UploadQueue& operator =(const UploadQueue&) = delete;
+
+        // Blocks while the queued bytes exceed the budget (backpressure). Offline it
+        // doesn't block but returns false if the spool budget is used up; the file
+        // stays with the caller then.
+        // digest: checksums of the file, finalized, travels along to the upload
+        bool push(const std::string& key, const std::string& path, uint64_t size, const Digest& digest);
+
+        // Size of the newest staged copy of key, false if nothing is pending
+        bool pendingSize(const std::string& key, uint64_t* size) const;
+        // Makes dest a private copy (copy = true) or a read-only link of the newest staged copy
+        bool snapshot(const std::string& key, const std::string& dest, bool copy) const;
+
+        // Drops waiting copies of key and waits for one being uploaded (removeFile)
+        void cancel(const std::string& key);
+        // Waits until nothing of key is pending (renameFile), false if the queue
+        // went offline with key still spooled
+        bool waitFor(const std::string& key);
+        // Waits until the queue is empty
+        void drain();
+
+        uint64_t pendingBytes() const;
+
+        bool spooling() const { return !m_spoolDir.empty(); }
+        // False after an upload failed, until a probe of the bucket succeeds
+        bool online() const;
+        void setOnline(bool online);
+        Stats stats() const;
+
+    private:
+        struct Job
+        {
+            std::string key;
+            std::string path;
+            uint64_t    size;
+            Digest      digest;
+            bool        running;
+            std::string manifest;   // spool record, empty without a spool
+            int         failures;
+        };
+
+        void run();
+        std::list<Job>::const_iterator newest(const std::string& key) const;
+        void finish(std::list<Job>::iterator job);
+        void discard(std::list<Job>::iterator job);
+        std::string writeManifest(const Job& job);
+        void loadSpool();
+
+    private:
+        UploadFunc                  m_upload;
+        const uint64_t              m_budget;
+        const aux::DirLock          m_spoolLock;
+        const std::string           m_spoolDir;     // empty unless m_spoolLock is held
+        const uint64_t              m_spoolBudget;
+        aux::TokenBucket            m_throttle;
+
+        mutable std::mutex          m_mutex;
+        std::condition_variable     m_workCond;     // a job became runnable
+        std::condition_variable     m_doneCond;     // a job finished or left the queue
+        std::list<Job>              m_jobs;         // in push order
+        std::set<std::string>       m_running;      // keys being uploaded
+        uint64_t                    m_bytes;
+        uint64_t                    m_nextManifest;
+        bool                        m_online;
+        bool                        m_draining;     // online again with a backlog
+        uint64_t                    m_uploaded;
+        uint64_t                    m_failures;
+        uint64_t                    m_dropped;
+        bool                        m_stop;
+        std::vector<std::thread>    m_threads;
+    }; // class UploadQueue
+} // namespace nx_spl
+
+#endif // __S3_UPLOAD_QUEUE_H__
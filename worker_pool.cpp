@@ -0,0 +1,67 @@
+#include "worker_pool.h"
+
+namespace nx_spl
+{
+    namespace aux
+    {
+        WorkerPool::WorkerPool(size_t threads)
+            : m_stop(false)
+        {
+            if (threads == 0)
+                threads = 1;
+
+            for (size_t i = 0; i < threads; i++)
+                m_threads.emplace_back([this]{ run(); });
+        }
+
+
+        WorkerPool::~WorkerPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stop = true;
+                m_tasks.clear();
+            }
+            m_cond.notify_all();
+
+            for (auto& t : m_threads)
+                t.join();
+        }
+
+
+        void WorkerPool::post(std::function<void()> task)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_tasks.push_back(std::move(task));
+            }
+            m_cond.notify_one();
+        }
+
+
+        size_t WorkerPool::pending() const
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_tasks.size();
+        }
+
+
+        void WorkerPool::run()
+        {
+            while (true)
+            {
+                std::function<void()> task;
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_cond.wait(lock, [this]{ return m_stop || !m_tasks.empty(); });
+                    if (m_stop)
+                        return;
+
+                    task = std::move(m_tasks.front());
+                    m_tasks.pop_front();
+                }
+                task();
+            }
+        }
+    } // namespace aux
+} // namespace nx_spl
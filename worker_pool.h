@@ -0,0 +1,43 @@
+#ifndef __S3_WORKER_POOL_H__
+#define __S3_WORKER_POOL_H__
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace nx_spl
+{
+    namespace aux
+    {
+        // Fixed set of threads serving a FIFO task queue.
+        // Tasks still queued at destruction are dropped, running ones are joined.
+        class WorkerPool
+        {
+        public:
+            explicit WorkerPool(size_t threads);
+            ~WorkerPool();
+
+            WorkerPool(const WorkerPool&) = delete;
+            WorkerPool& operator =(const WorkerPool&) = delete;
+
+            void post(std::function<void()> task);
+            size_t pending() const;
+            size_t size() const { return m_threads.size(); }
+
+        private:
+            void run();
+
+        private:
+            mutable std::mutex                  m_mutex;
+            std::condition_variable             m_cond;
+            std::deque<std::function<void()>>   m_tasks;
+            std::vector<std::thread>            m_threads;
+            bool                                m_stop;
+        }; // class WorkerPool
+    } // namespace aux
+} // namespace nx_spl
+
+#endif // __S3_WORKER_POOL_H__